@@ -0,0 +1,568 @@
+/* Copyright 2019 memlog Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+//
+// Binary trace file
+//
+// In binary mode the collector copies records out of the ring instead of
+// formatting them, and describes every site once per session. decode()
+// renders such a file to the text the collector writes otherwise.
+//
+
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include <algorithm>
+#include "log.h"
+
+using namespace std;
+using namespace memlog;
+
+// Text for dump(), frames for the trace stream in binary mode, and copies for
+// the format pool
+int Log::formatAtIndex(RingBuffer *ring, uint64_t index, char *dst, uint64_t *nextIndex,
+                       Header *printedHeader, int *length, const shared_ptr<Stream> &stream) {
+    if (isBinary(stream)) {
+        return encodeAtIndex(ring, index, dst, nextIndex, printedHeader, length, stream);
+    }
+    if (isStaged(stream)) {
+        return stageAtIndex(ring, index, dst, nextIndex, printedHeader, length);
+    }
+    return printAtIndex(ring, index, dst, nextIndex, printedHeader, length);
+}
+
+// Same contract as printAtIndex(), dst gets a FRAME_RECORD
+int Log::encodeAtIndex(RingBuffer *ring, uint64_t index, char *dst, uint64_t *nextIndex,
+                       Header *printedHeader, int *length, const shared_ptr<Stream> &stream) {
+    char scratchBuffer[LOG_MAX_LOG_TRACE_LINE * 2];
+    const char *record;
+
+    *length = 0;
+    *nextIndex = index;
+
+    RecordState state = getLog(ring, index, scratchBuffer, &record);
+    if (state == RECORD_PENDING) {
+        return 1;
+    }
+
+    if (state != RECORD_VALID) {
+        printFallCount_++;
+        return -1;
+    }
+
+    Header hdr;
+    memcpy(&hdr, scratchBuffer, sizeof(Header));
+
+    // The trailer is only needed to validate the record in the ring
+    Frame frame = { FRAME_RECORD, (uint16_t)(hdr.length - sizeof(Trailer)) };
+    memcpy(dst, &frame, sizeof(Frame));
+    memcpy(dst + sizeof(Frame), record, frame.length);
+
+    // Overwritten while copying in place
+    if (record != scratchBuffer && isOverwritten(ring, index)) {
+        printFallCount_++;
+        return -1;
+    }
+
+    // Neither do %#s pointers, their strings go in the copy. Only once it is
+    // validated, a torn pointer would not be safe to read.
+    const Site *site = catalog_->find(hdr.site);
+    char *args = dst + sizeof(Frame) + sizeof(Header);
+    uint32_t argsLength = frame.length - sizeof(Header);
+    uint32_t inlined = stringFormat_->inlineStatic(site ? site->format : "", (uint8_t *) args, argsLength, scratchBuffer,
+                                                   LOG_MAX_LOG_TRACE_LINE - sizeof(Header) - sizeof(Trailer));
+    memcpy(args, scratchBuffer, inlined);
+    frame.length = (uint16_t) (sizeof(Header) + inlined);
+    memcpy(dst, &frame, sizeof(Frame));
+
+    if (printedHeader) {
+        memcpy(printedHeader, &hdr, sizeof(Header));
+    }
+    memcpy(&debugLastHeader_, &hdr, sizeof(Header));
+
+    // Raw clock values mean nothing without this process
+    Header stamped = hdr;
+    stamped.length = (uint16_t) (frame.length + sizeof(Trailer));
+    stamped.pattern = START_PATTERN;
+    stamped.timestamp = hdr.timestamp ? clock_->toNsec(hdr.timestamp) : 0;
+    memcpy(dst + sizeof(Frame), &stamped, sizeof(Header));
+
+    describe(hdr.site, stream);
+
+    *nextIndex = index + LOG_MEM_ALIGN(hdr.length);
+    *length = sizeof(Frame) + frame.length;
+    lastPrintedId_ = hdr.id;
+    return 0;
+}
+
+// Open a segment with the session frame, then describe every site up to site
+// not described yet
+void Log::describe(uint32_t site, const shared_ptr<Stream> &stream) {
+    char buf[sizeof(SiteFrame) + 2 * LOG_MAX_LOG_TRACE_LINE];
+
+    if (describedSites_ == 0) {
+        memset(&segment_, 0, sizeof(segment_));
+        segment_.offset = stream->tell();
+        segment_.previous = lastIndex_;
+        segment_.minTimestamp = UINT64_MAX;
+        entries_.clear();
+        lastEntry_ = segment_.offset;
+
+        SessionFrame session = { BINARY_MAGIC, BINARY_VERSION, sizeof(Header),
+                                 control_ ? control_->pid : (uint32_t) getpid(), 0 };
+        writeFrame(stream, FRAME_SESSION, &session, sizeof(session));
+        describedSites_ = SiteCatalog::INVALID_ID + 1;
+    }
+
+    for (; describedSites_ <= site && describedSites_ < catalog_->size(); describedSites_++) {
+        const Site *s = catalog_->find(describedSites_);
+        const char *functionName = s->functionName ? s->functionName : "";
+        SiteFrame frame;
+
+        frame.id = s->id;
+        frame.lineNumber = s->lineNumber;
+        frame.functionLength = (uint16_t) min(strlen(functionName), (size_t) LOG_MAX_LOG_TRACE_LINE);
+        frame.formatLength = (uint16_t) min(strlen(s->format), (size_t) LOG_MAX_LOG_TRACE_LINE);
+        frame.tag = s->tag;
+        frame.level = s->level;
+        frame.unused = 0;
+
+        memcpy(buf, &frame, sizeof(frame));
+        memcpy(buf + sizeof(frame), functionName, frame.functionLength);
+        memcpy(buf + sizeof(frame) + frame.functionLength, s->format, frame.formatLength);
+        writeFrame(stream, FRAME_SITE, buf, sizeof(frame) + frame.functionLength + frame.formatLength);
+    }
+}
+
+void Log::writeFrame(const shared_ptr<Stream> &stream, FrameType type, const void *payload, uint32_t length) {
+    Frame frame = { type, (uint16_t) length };
+
+    stream->write((char *) &frame, sizeof(frame));
+    stream->write((char *) payload, length);
+}
+
+// Messages of the collector, framed in binary mode
+void Log::writeNote(const shared_ptr<Stream> &stream, char *text, int length) {
+    if (isStaged(stream)) {
+        formatPool_->addNote(text, length);
+    } else if (isBinary(stream)) {
+        describe(SiteCatalog::INVALID_ID, stream);
+        writeFrame(stream, FRAME_NOTE, text, length);
+    } else {
+        stream->write(text, length);
+    }
+}
+
+// Records of the trace stream, indexed in binary mode
+void Log::writeRecord(const shared_ptr<Stream> &stream, char *buf, int length) {
+    if (isStaged(stream)) {
+        formatPool_->addRecord(buf, length);
+        return;
+    }
+    if (!isBinary(stream)) {
+        stream->write(buf, length);
+        return;
+    }
+
+    Header hdr;
+    memcpy(&hdr, buf + sizeof(Frame), sizeof(Header));
+
+    // An entry every INDEX_INTERVAL bytes, with the maxima of the records before it
+    uint64_t offset = stream->tell();
+    if (offset - lastEntry_ >= INDEX_INTERVAL && entries_.size() < MAX_INDEX_ENTRIES) {
+        entries_.push_back({ offset, segment_.maxTimestamp, segment_.maxId, 0 });
+        lastEntry_ = offset;
+    }
+    indexRecord(hdr);
+
+    stream->write(buf, length);
+    if (stream->tell() - segment_.offset >= SEGMENT_SIZE) {
+        closeSegment(stream);
+    }
+}
+
+void Log::indexRecord(const Header &hdr) {
+    if (segment_.records == 0) {
+        segment_.minId = hdr.id;
+    }
+    segment_.minId = min(segment_.minId, hdr.id);
+    segment_.maxId = max(segment_.maxId, hdr.id);
+    if (hdr.timestamp) {
+        segment_.minTimestamp = min(segment_.minTimestamp, hdr.timestamp);
+        segment_.maxTimestamp = max(segment_.maxTimestamp, hdr.timestamp);
+    }
+    segment_.siteMask[(hdr.site / 64) % 4] |= 1ULL << (hdr.site % 64);
+    segment_.records++;
+}
+
+// Write the index frame of the open segment, the next frame opens a new one
+void Log::closeSegment(const shared_ptr<Stream> &stream) {
+    char buf[sizeof(SegmentIndex) + MAX_INDEX_ENTRIES * sizeof(IndexEntry) + sizeof(IndexTail)];
+
+    if (!binary_ || describedSites_ == 0) {
+        return;
+    }
+
+    segment_.entries = entries_.size();
+    uint32_t length = sizeof(SegmentIndex) + segment_.entries * sizeof(IndexEntry) + sizeof(IndexTail);
+    IndexTail tail = { (uint32_t)(sizeof(Frame) + length), INDEX_MAGIC };
+
+    memcpy(buf, &segment_, sizeof(SegmentIndex));
+    memcpy(buf + sizeof(SegmentIndex), entries_.data(), segment_.entries * sizeof(IndexEntry));
+    memcpy(buf + length - sizeof(IndexTail), &tail, sizeof(IndexTail));
+
+    lastIndex_ = stream->tell();
+    writeFrame(stream, FRAME_INDEX, buf, length);
+    describedSites_ = 0;
+}
+
+// A stretch of a binary file: a segment closed by its index, or frames
+// without an index such as an open segment
+struct Log::Span {
+    uint64_t start;
+    // Index frame, or end of the frames if not indexed
+    uint64_t end;
+    // Past the index frame
+    uint64_t next;
+    bool indexed;
+    SegmentIndex index;
+    std::vector<IndexEntry> entries;
+};
+
+struct Log::Decoder {
+    FILE *file;
+    uint64_t position;
+    shared_ptr<Stream> stream;
+    Range range;
+    unique_ptr<SiteCatalog> catalog;
+    unique_ptr<Log> reader;
+    uint32_t invalid;
+    // Notes are printed after a record in range
+    bool inRange;
+};
+
+static bool seekTo(FILE *file, uint64_t offset) {
+    return fseeko(file, (off_t) offset, SEEK_SET) == 0;
+}
+
+bool Log::readIndex(FILE *file, uint64_t offset, Span *span) {
+    char payload[UINT16_MAX + 1];
+    IndexTail tail;
+    Frame frame;
+
+    if (!seekTo(file, offset) || fread(&frame, sizeof(frame), 1, file) != 1 || frame.type != FRAME_INDEX ||
+        frame.length < sizeof(SegmentIndex) + sizeof(IndexTail) ||
+        fread(payload, 1, frame.length, file) != frame.length) {
+        return false;
+    }
+
+    memcpy(&span->index, payload, sizeof(SegmentIndex));
+    memcpy(&tail, payload + frame.length - sizeof(IndexTail), sizeof(IndexTail));
+    if (tail.magic != INDEX_MAGIC || tail.length != sizeof(Frame) + frame.length ||
+        span->index.offset >= offset || span->index.entries > MAX_INDEX_ENTRIES ||
+        frame.length != sizeof(SegmentIndex) + span->index.entries * sizeof(IndexEntry) + sizeof(IndexTail)) {
+        return false;
+    }
+
+    span->entries.resize(span->index.entries);
+    memcpy(span->entries.data(), payload + sizeof(SegmentIndex), span->index.entries * sizeof(IndexEntry));
+    span->start = span->index.offset;
+    span->end = offset;
+    span->next = offset + tail.length;
+    span->indexed = true;
+    return true;
+}
+
+// Offset of the last index frame before end, looking back at most
+// INDEX_SEARCH_LIMIT bytes past an open segment. NO_SEGMENT if there is none.
+uint64_t Log::findLastIndex(FILE *file, uint64_t end) {
+    static constexpr uint32_t BLOCK_SIZE = 64 * 1024;
+    char buf[BLOCK_SIZE];
+    uint64_t limit = end > INDEX_SEARCH_LIMIT ? end - INDEX_SEARCH_LIMIT : 0;
+    uint64_t blockEnd = end;
+    Span span;
+
+    while (blockEnd > limit + sizeof(IndexTail)) {
+        uint64_t blockStart = max(limit, blockEnd > BLOCK_SIZE ? blockEnd - BLOCK_SIZE : 0);
+        uint32_t length = blockEnd - blockStart;
+
+        if (!seekTo(file, blockStart) || fread(buf, 1, length, file) != length) {
+            break;
+        }
+
+        for (int32_t i = length - sizeof(IndexTail); i >= 0; i--) {
+            IndexTail tail;
+
+            memcpy(&tail, buf + i, sizeof(tail));
+            uint64_t tailEnd = blockStart + i + sizeof(IndexTail);
+            if (tail.magic == INDEX_MAGIC && tail.length <= tailEnd &&
+                readIndex(file, tailEnd - tail.length, &span) && span.next == tailEnd) {
+                return span.end;
+            }
+        }
+
+        // Blocks overlap so that a tail across two is not missed
+        blockEnd = blockStart + sizeof(IndexTail) - 1;
+        if (blockStart == limit) {
+            break;
+        }
+    }
+    return NO_SEGMENT;
+}
+
+// Segments of the file in order, from the chain of indexes ending with the
+// last one, and the frames around them that are not indexed
+bool Log::readSpans(FILE *file, std::vector<Span> *spans) {
+    std::vector<Span> indexed;
+    Span span;
+
+    if (fseeko(file, 0, SEEK_END) != 0) {
+        return false;
+    }
+    uint64_t size = ftello(file);
+
+    uint64_t offset = findLastIndex(file, size);
+    while (offset != NO_SEGMENT && readIndex(file, offset, &span)) {
+        indexed.push_back(span);
+        // The chain only goes back
+        if (span.index.previous >= span.start) {
+            break;
+        }
+        offset = span.index.previous;
+    }
+    std::reverse(indexed.begin(), indexed.end());
+
+    uint64_t position = 0;
+    for (auto &segment : indexed) {
+        if (segment.start > position) {
+            spans->push_back({ position, segment.start, segment.start, false, SegmentIndex(), {} });
+        }
+        position = segment.next;
+        spans->push_back(std::move(segment));
+    }
+    if (position < size) {
+        spans->push_back({ position, size, size, false, SegmentIndex(), {} });
+    }
+    return true;
+}
+
+bool Log::matches(const SegmentIndex &index, const Range &range) {
+    if (index.records == 0 || index.minId > range.toId || index.maxId < range.fromId) {
+        return false;
+    }
+    if ((range.fromNsec > 0 || range.toNsec < UINT64_MAX) &&
+        (index.minTimestamp > range.toNsec || index.maxTimestamp < range.fromNsec)) {
+        return false;
+    }
+    return range.site == SiteCatalog::INVALID_ID || (index.siteMask[(range.site / 64) % 4] & (1ULL << (range.site % 64)));
+}
+
+// Decode the frames from the decoder position to end. Without records only
+// the session and the sites are read, to decode from the middle of a segment.
+bool Log::decodeFrames(Decoder *decoder, uint64_t end, bool records) {
+    char payload[UINT16_MAX + 1];
+    char traceBuffer[LOG_MAX_LOG_TRACE_LINE * 2];
+    alignas(8) uint8_t record[LOG_MAX_LOG_TRACE_LINE];
+    const Range &range = decoder->range;
+    FILE *file = decoder->file;
+    Frame frame;
+
+    while (decoder->position < end && fread(&frame, sizeof(frame), 1, file) == 1) {
+        decoder->position += sizeof(frame) + frame.length;
+
+        if (!records && frame.type != FRAME_SESSION && frame.type != FRAME_SITE) {
+            if (fseeko(file, frame.length, SEEK_CUR) != 0) {
+                return false;
+            }
+            continue;
+        }
+
+        if (fread(payload, 1, frame.length, file) != frame.length) {
+            return false;
+        }
+
+        if (frame.type == FRAME_SESSION) {
+            SessionFrame session;
+
+            memcpy(&session, payload, min((size_t) frame.length, sizeof(session)));
+            if (frame.length < sizeof(session) || session.magic != BINARY_MAGIC ||
+                session.version != BINARY_VERSION || session.headerSize != sizeof(Header)) {
+                return false;
+            }
+
+            // Site ids start over with every session, timestamps are wall clock
+            decoder->reader.reset();
+            decoder->catalog.reset(new SiteCatalog());
+            decoder->reader.reset(new Log({make_shared<RingBuffer>(RingBuffer::MIN_SIZE)}, decoder->catalog.get(),
+                                          make_shared<Clock>(Clock::REALTIME, Clock::Calibration()),
+                                          decoder->stream));
+            // encodeAtIndex() wrote the %#s strings into the records
+            decoder->reader->stringFormat_->setStaticStrings(StringFormat::STATIC_INLINE);
+            continue;
+        }
+
+        if (!decoder->reader) {
+            return false;
+        }
+
+        switch (frame.type) {
+            case FRAME_SITE: {
+                SiteFrame site;
+
+                memcpy(&site, payload, min((size_t) frame.length, sizeof(site)));
+                if (frame.length < sizeof(site) ||
+                    frame.length != sizeof(site) + site.functionLength + site.formatLength) {
+                    decoder->invalid++;
+                    break;
+                }
+                string functionName(payload + sizeof(site), site.functionLength);
+                string format(payload + sizeof(site) + site.functionLength, site.formatLength);
+                decoder->catalog->restore(site.id, format.c_str(), functionName.c_str(), site.lineNumber, site.tag,
+                                          site.level);
+                break;
+            }
+
+            case FRAME_RECORD: {
+                Header *hdr = (Header *) record;
+                int length = 0;
+
+                if (frame.length < sizeof(Header) || frame.length > sizeof(record)) {
+                    decoder->invalid++;
+                    break;
+                }
+                memcpy(record, payload, frame.length);
+                decoder->inRange = hdr->id >= range.fromId && hdr->id <= range.toId &&
+                                   hdr->timestamp >= range.fromNsec && hdr->timestamp <= range.toNsec &&
+                                   (range.site == SiteCatalog::INVALID_ID || hdr->site == range.site);
+                if (!decoder->inRange) {
+                    break;
+                }
+                if (hdr->length != frame.length + sizeof(Trailer) || !decoder->catalog->find(hdr->site) ||
+                    decoder->reader->formatRecord(hdr, record, traceBuffer, &length) < 0) {
+                    decoder->invalid++;
+                    break;
+                }
+                decoder->stream->write(traceBuffer, length);
+                break;
+            }
+
+            case FRAME_NOTE:
+                if (decoder->inRange) {
+                    decoder->stream->write(payload, frame.length);
+                }
+                break;
+
+            default:
+                // Indexes, and frames of a later version
+                break;
+        }
+    }
+    return true;
+}
+
+static bool finishDecode(shared_ptr<Stream> stream, uint32_t invalid, bool valid) {
+    char buf[128];
+
+    if (invalid) {
+        int length = sprintf(buf, "<<<< Invalid frames skipped: %u >>>>>\n", invalid);
+        stream->write(buf, length);
+    }
+    stream->flush();
+    return valid;
+}
+
+bool Log::decode(FILE *file, shared_ptr<Stream> stream) {
+    Decoder decoder = { file, 0, stream ? stream : Stream::getStdoutStream(), Range(), nullptr, nullptr, 0, true };
+
+    bool valid = decodeFrames(&decoder, UINT64_MAX, true) && feof(file);
+    return finishDecode(decoder.stream, decoder.invalid, valid);
+}
+
+bool Log::decode(FILE *file, const Range &range, shared_ptr<Stream> stream) {
+    Decoder decoder = { file, 0, stream ? stream : Stream::getStdoutStream(), range, nullptr, nullptr, 0, false };
+    std::vector<Span> spans;
+    bool valid = readSpans(file, &spans);
+
+    for (auto &span : spans) {
+        if (!valid) {
+            break;
+        }
+        if (span.indexed && !matches(span.index, range)) {
+            continue;
+        }
+
+        // Skip to the last entry with only records before the range behind it
+        uint64_t start = span.start;
+        for (auto &entry : span.entries) {
+            if (entry.maxTimestamp < range.fromNsec || entry.maxId < range.fromId) {
+                start = entry.offset;
+            }
+        }
+
+        decoder.position = span.start;
+        valid = seekTo(file, span.start) && decodeFrames(&decoder, start, false) &&
+                decodeFrames(&decoder, span.end, true);
+    }
+    return finishDecode(decoder.stream, decoder.invalid, valid);
+}
+
+// Same layout as the timestamps of the records
+static int formatNsec(uint64_t nsec, char *buf) {
+    struct tm result;
+    time_t seconds = (time_t)(nsec / Clock::NSEC_PER_SEC);
+
+    localtime_r(&seconds, &result);
+    int length = strftime(buf, 64, "%Y %h %e %T", &result);
+    return length + sprintf(buf + length, ".%9.9ld", (long)(nsec % Clock::NSEC_PER_SEC));
+}
+
+bool Log::listSegments(FILE *file, shared_ptr<Stream> stream) {
+    char buf[512];
+    std::vector<Span> spans;
+
+    if (stream == nullptr) {
+        stream = Stream::getStdoutStream();
+    }
+    if (!readSpans(file, &spans)) {
+        return false;
+    }
+
+    for (auto &span : spans) {
+        int length = sprintf(buf, "%" PRIu64 "-%" PRIu64 ": ", span.start, span.end);
+
+        if (!span.indexed) {
+            length += sprintf(buf + length, "not indexed\n");
+        } else {
+            uint32_t sites = 0;
+            for (auto mask : span.index.siteMask) {
+                sites += __builtin_popcountll(mask);
+            }
+
+            length += sprintf(buf + length, "records: %u ids: %u-%u entries: %u sites: %u", span.index.records,
+                              span.index.minId, span.index.maxId, span.index.entries, sites);
+            if (span.index.minTimestamp <= span.index.maxTimestamp) {
+                length += sprintf(buf + length, " time: ");
+                length += formatNsec(span.index.minTimestamp, buf + length);
+                length += sprintf(buf + length, " - ");
+                length += formatNsec(span.index.maxTimestamp, buf + length);
+            }
+            buf[length++] = '\n';
+        }
+        stream->write(buf, length);
+    }
+    stream->flush();
+    return true;
+}
@@ -0,0 +1,198 @@
+/* Copyright 2019 memlog Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+//
+// Clock class
+//
+
+#include <cstdio>
+#include <unistd.h>
+#include "clock.h"
+
+using namespace memlog;
+
+uint64_t Clock::realtimeNsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+uint64_t Clock::monotonicNsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+// Raw value of the underlying clock, at full precision
+uint64_t Clock::readRaw() const {
+    switch (mode_) {
+        case TSC:
+            return now();
+        case MONOTONIC_COARSE:
+            return monotonicNsec();
+        default:
+            return realtimeNsec();
+    }
+}
+
+// Only the first TSC clock waits for a measurable tick rate, the later ones
+// measure it over the lifetime of the process
+void Clock::startTsc() {
+    struct Baseline {
+        uint64_t raw;
+        uint64_t nsec;
+    };
+    static const Baseline baseline = [this] {
+        Baseline taken = { readRaw(), monotonicNsec() };
+        usleep(CALIBRATE_USEC);
+        return taken;
+    }();
+
+    startRaw_ = baseline.raw;
+    startNsec_ = baseline.nsec;
+}
+
+Clock::Clock(Mode mode) : mode_(mode), sequence_(0), calibrateCount_(0), calibrateNsec_(0), foreign_(false) {
+    if (mode_ == TSC) {
+        startTsc();
+    } else {
+        startRaw_ = readRaw();
+        startNsec_ = monotonicNsec();
+    }
+    setCalibration(readRaw(), realtimeNsec(), 1ULL << 32);
+    calibrate();
+}
+
+Clock::Clock(Mode mode, const Calibration &calibration)
+        : mode_(mode), sequence_(0), startRaw_(calibration.rawBase), startNsec_(0), calibrateCount_(0),
+          calibrateNsec_(0), foreign_(true) {
+    setCalibration(calibration.rawBase, calibration.nsecBase, calibration.nsecPerRaw);
+}
+
+// Writers exclude each other by taking the sequence odd, readers retry while
+// it is odd or moved
+bool Clock::setCalibration(uint64_t rawBase, uint64_t nsecBase, uint64_t nsecPerRaw) {
+    uint32_t sequence = __atomic_load_n(&sequence_, __ATOMIC_RELAXED);
+
+    if ((sequence & 1) || !__atomic_compare_exchange_n(&sequence_, &sequence, sequence + 1, false,
+                                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return false;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&calibration_.rawBase, rawBase, __ATOMIC_RELAXED);
+    __atomic_store_n(&calibration_.nsecBase, nsecBase, __ATOMIC_RELAXED);
+    __atomic_store_n(&calibration_.nsecPerRaw, nsecPerRaw, __ATOMIC_RELAXED);
+    __atomic_store_n(&sequence_, sequence + 2, __ATOMIC_RELEASE);
+    return true;
+}
+
+Clock::Calibration Clock::getCalibration() const {
+    Calibration calibration;
+    uint32_t sequence;
+
+    do {
+        sequence = __atomic_load_n(&sequence_, __ATOMIC_ACQUIRE);
+        calibration.rawBase = __atomic_load_n(&calibration_.rawBase, __ATOMIC_RELAXED);
+        calibration.nsecBase = __atomic_load_n(&calibration_.nsecBase, __ATOMIC_RELAXED);
+        calibration.nsecPerRaw = __atomic_load_n(&calibration_.nsecPerRaw, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((sequence & 1) || sequence != __atomic_load_n(&sequence_, __ATOMIC_RELAXED));
+
+    return calibration;
+}
+
+void Clock::calibrate() {
+    uint64_t raw, nsec, monotonic;
+    uint64_t nsecPerRaw = 1ULL << 32;
+
+    switch (mode_) {
+        case REALTIME:
+        case REALTIME_COARSE:
+            // Raw values are already wall clock nanoseconds
+            return;
+
+        case TSC:
+            monotonic = monotonicNsec();
+            raw = readRaw();
+            nsec = realtimeNsec();
+            // Measure the tick rate over the whole lifetime of the clock, the
+            // longer the baseline the smaller the error
+            if (raw > startRaw_ && monotonic > startNsec_) {
+                nsecPerRaw = (uint64_t)((((unsigned __int128)(monotonic - startNsec_)) << 32) /
+                                        (raw - startRaw_));
+            }
+            break;
+
+        default:
+            monotonic = monotonicNsec();
+            raw = readRaw();
+            nsec = realtimeNsec();
+            break;
+    }
+
+    if (setCalibration(raw, nsec, nsecPerRaw)) {
+        __atomic_store_n(&calibrateNsec_, monotonic, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&calibrateCount_, 1, __ATOMIC_RELAXED);
+    }
+}
+
+bool Clock::refresh() {
+    if (foreign_ || mode_ == REALTIME || mode_ == REALTIME_COARSE) {
+        return false;
+    }
+
+    uint32_t count = __atomic_load_n(&calibrateCount_, __ATOMIC_RELAXED);
+    if (monotonicNsec() - __atomic_load_n(&calibrateNsec_, __ATOMIC_RELAXED) <
+        (uint64_t) RECALIBRATE_SEC * NSEC_PER_SEC) {
+        return false;
+    }
+    calibrate();
+    return __atomic_load_n(&calibrateCount_, __ATOMIC_RELAXED) != count;
+}
+
+uint64_t Clock::toNsec(uint64_t raw) const {
+    if (mode_ == REALTIME || mode_ == REALTIME_COARSE) {
+        return raw;
+    }
+
+    Calibration calibration = getCalibration();
+    __int128 delta = (__int128)(int64_t)(raw - calibration.rawBase) * calibration.nsecPerRaw;
+    return calibration.nsecBase + (int64_t)(delta >> 32);
+}
+
+const char *Clock::getModeName() const {
+    switch (mode_) {
+        case REALTIME:
+            return "realtime";
+        case REALTIME_COARSE:
+            return "realtime coarse";
+        case MONOTONIC_COARSE:
+            return "monotonic coarse";
+        case TSC:
+            return "tsc";
+        default:
+            return "unknown";
+    }
+}
+
+void Clock::dumpState(char *buffer, int bufferLen) const {
+    Calibration calibration = getCalibration();
+    char *bufferNext = buffer;
+
+    bufferNext += sprintf(bufferNext, "Clock: %s\n", getModeName());
+    bufferNext += sprintf(bufferNext, "Clock raw per usec: %.3f\n",
+                          calibration.nsecPerRaw ? 1000.0 * (1ULL << 32) / calibration.nsecPerRaw : 0.0);
+    bufferNext += sprintf(bufferNext, "Clock calibrations: %u\n", calibrateCount_);
+}
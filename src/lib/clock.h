@@ -0,0 +1,136 @@
+/* Copyright 2019 memlog Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+//
+// Clock class
+//
+// Producers store the raw value of the selected clock in the record header,
+// conversion to wall time happens when the record is printed. The TSC mode
+// stores CPU ticks and measures their rate from a baseline taken once per
+// process. It is calibrated against CLOCK_REALTIME at startup, then by
+// refresh() from the collector and from the readers of the rings.
+//
+
+#ifndef MEMLOG_CLOCK_H
+#define MEMLOG_CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace memlog {
+
+    class Clock {
+    public:
+        static constexpr uint64_t NSEC_PER_SEC = 1000000000ULL;
+        // Calibration window of the first TSC clock of the process
+        static constexpr int CALIBRATE_USEC = 10000;
+        // Age of a calibration refresh() renews
+        static constexpr int RECALIBRATE_SEC = 1;
+
+        enum Mode {
+            REALTIME,
+            REALTIME_COARSE,
+            MONOTONIC_COARSE,
+            TSC,
+            DEFAULT = REALTIME
+        };
+
+        struct Calibration {
+            uint64_t rawBase;
+            uint64_t nsecBase;
+            // Nanoseconds per raw unit, 32.32 fixed point
+            uint64_t nsecPerRaw;
+        };
+
+        // Raw value stored in the record header
+        inline uint64_t now() const {
+            struct timespec ts;
+
+            switch (mode_) {
+                case TSC:
+#if defined(__x86_64__) || defined(__i386__)
+                    return __rdtsc();
+#else
+                    clock_gettime(CLOCK_MONOTONIC, &ts);
+                    break;
+#endif
+                case REALTIME_COARSE:
+                    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+                    break;
+                case MONOTONIC_COARSE:
+                    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+                    break;
+                default:
+                    clock_gettime(CLOCK_REALTIME, &ts);
+                    break;
+            }
+            return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+        }
+
+        // Convert a raw value to nanoseconds since epoch
+        uint64_t toNsec(uint64_t raw) const;
+
+        // Refresh the raw to wall clock mapping. Safe to call from several
+        // threads, a call made while another one runs does nothing.
+        void calibrate();
+
+        // calibrate() if the last calibration is older than RECALIBRATE_SEC.
+        // Return true if it did. Never for the clock of another process.
+        bool refresh();
+
+        Mode getMode() const { return mode_; }
+
+        const char *getModeName() const;
+
+        Calibration getCalibration() const;
+
+        void dumpState(char *buffer, int bufferLen) const;
+
+        // For intervals, independent of the mode
+        static uint64_t monotonicNsec();
+
+        explicit Clock(Mode mode = DEFAULT);
+
+        // Clock of another process, converts its raw values without calibrating
+        Clock(Mode mode, const Calibration &calibration);
+
+    private:
+        Mode mode_;
+        // Odd while calibrate() is updating calibration_
+        uint32_t sequence_;
+        Calibration calibration_;
+        // Start of the tick rate measurement
+        uint64_t startRaw_;
+        uint64_t startNsec_;
+        uint32_t calibrateCount_;
+        // Monotonic time of the last calibration
+        uint64_t calibrateNsec_;
+        bool foreign_;
+
+        static uint64_t realtimeNsec();
+
+        uint64_t readRaw() const;
+
+        // Start of the first TSC clock of the process
+        void startTsc();
+
+        // Return false if another thread is updating the calibration
+        bool setCalibration(uint64_t rawBase, uint64_t nsecBase, uint64_t nsecPerRaw);
+    };
+}
+#endif //MEMLOG_CLOCK_H
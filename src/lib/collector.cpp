@@ -18,23 +18,127 @@ limitations under the License.
 //
 
 #include <unistd.h>
+#include <inttypes.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <algorithm>
+#include <vector>
 #include "stream.h"
 #include "log.h"
 
 using namespace memlog;
 
-void Log::Collect::idle () {
-    usleep(SLEEP_USEC);
+// Sleep until a producer crosses the watermark or usec passed. Return true
+// if a producer woke the collector. A wakeup lost to a producer racing with
+// the sleep is caught by the timeout.
+bool Log::Collect::wait(uint32_t usec) {
+    struct timespec timeout = { usec / 1000000, (long) (usec % 1000000) * 1000 };
 
-    lastFlushCounter_++;
-    if (lastFlushCounter_ > (FLUSH_IN_SEC *  1000000) / SLEEP_USEC) {
+    if (park()) {
+        if (!getEnable()) {
+            __atomic_store_n(&log_->collectorSleeping_, 0, __ATOMIC_RELAXED);
+            return false;
+        }
+        syscall(SYS_futex, &log_->collectorSleeping_, FUTEX_WAIT_PRIVATE, 1, &timeout, nullptr, 0);
+    }
+    return unpark();
+}
+
+// A producer that committed past a watermark before the flag was set saw
+// the collector awake, it is found here and the collector stays awake
+bool Log::Collect::park() {
+    __atomic_store_n(&log_->collectorSleeping_, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    for (uint32_t s = 0; s <= log_->shardCount_; s++) {
+        if (log_->shards_[s].ringBuffer->getCurrentIndex() >
+            __atomic_load_n(&log_->shards_[s].wakeIndex, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&log_->collectorSleeping_, 0, __ATOMIC_RELAXED);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Log::Collect::woken() const {
+    return !__atomic_load_n(&log_->collectorSleeping_, __ATOMIC_ACQUIRE);
+}
+
+bool Log::Collect::unpark() {
+    if (__atomic_exchange_n(&log_->collectorSleeping_, 0, __ATOMIC_ACQ_REL)) {
+        timeoutWakeups_++;
+        return false;
+    }
+    producerWakeups_++;
+    return true;
+}
+
+// A producer committing at or past watermarkPct of a ring past the bookmark
+// wakes the collector, 0 wakes it on the first record
+void Log::Collect::arm(uint32_t watermarkPct) {
+    for (uint32_t s = 0; s <= log_->shardCount_; s++) {
+        RingBuffer *ring = log_->shards_[s].ringBuffer.get();
+        uint64_t bookmark = s ? shardBookmarks_[s] : collectorBookmark_;
+        uint64_t watermark = (uint64_t) watermarkPct * ring->size() / 100;
+
+        __atomic_store_n(&log_->shards_[s].wakeIndex, bookmark + watermark, __ATOMIC_RELAXED);
+    }
+}
+
+// Between bursts, return how long to sleep
+uint32_t Log::Collect::idle() {
+    // Written out at the end of each burst
+    if (unflushed_) {
         log_->getStream()->flush();
-        lastFlushCounter_ = 0;
+        markCollected();
+        unflushed_ = false;
     }
+    log_->maintainFile();
+
+    log_->refreshClock();
+
+    if (pending() == 0) {
+        // Quiet, back off until the first record arrives
+        arm(0);
+        quiet_ = true;
+        return idleUsec_;
+    }
+
+    // Gather what follows for up to the latency bound, unless the ring fills
+    arm(wakeWatermarkPct_);
+    return maxLatencyUsec_;
+}
+
+uint32_t Log::Collect::step(bool woken) {
+    if (quiet_) {
+        quiet_ = false;
+        if (woken) {
+            idleUsec_ = maxLatencyUsec_;
+            arm(wakeWatermarkPct_);
+            return maxLatencyUsec_;
+        }
+        idleUsec_ = std::min<uint32_t>(idleUsec_ * 2, MAX_IDLE_USEC);
+    }
+
+    // Idle when the pass made no progress, the ring is blocked by a record
+    // not committed yet
+    if (shallCollect() && collect() > 0) {
+        unflushed_ = true;
+        log_->maintainFile();
+        return 0;
+    }
+    return idle();
 }
 
 void Log::Collect::resetBookmark() {
-    collectorBookmark_  = log_->getLastWrittenIndex();
+    collectorBookmark_  = log_->ringBuffer_->getCurrentIndex();
+    for (uint32_t s = 0; s < shardBookmarks_.size(); s++) {
+        shardBookmarks_[s] = log_->shards_[s].ringBuffer->getCurrentIndex();
+    }
+    for (auto &stall : stalls_) {
+        stall.sinceNsec = 0;
+    }
+    release();
 }
 
 void Log::Collect::setEnable(bool enabled) {
@@ -44,13 +148,24 @@ void Log::Collect::setEnable(bool enabled) {
 
     if (enabled) {
         resetBookmark();
-        enable_ = enabled;
-        if (pthread_create(&collectorThread_, NULL, executeWorkerThread, this)) {
+        quiet_ = false;
+        __atomic_store_n(&enable_, enabled, __ATOMIC_RELEASE);
+        if (log_->collectorPool_) {
+            log_->collectorPool_->add(this, priority_);
+        } else if (pthread_create(&collectorThread_, NULL, executeWorkerThread, this)) {
             throw new std::exception();
         }
-    } else {
+    } else if (log_->collectorPool_) {
+        // Out of the pool no thread collects it but this one
+        __atomic_store_n(&enable_, enabled, __ATOMIC_RELEASE);
+        log_->collectorPool_->remove(this);
+        __atomic_store_n(&log_->collectorSleeping_, 0, __ATOMIC_RELAXED);
         flush();
-        enable_ = enabled;
+    } else {
+        // The worker collects what is left before it exits. Collecting from
+        // this thread as well would write the same records twice.
+        __atomic_store_n(&enable_, enabled, __ATOMIC_RELEASE);
+        log_->wakeCollector();
         pthread_join(collectorThread_, nullptr);
     }
 }
@@ -69,78 +184,147 @@ uint32_t Log::Collect::getBufferThreshold() {
 
 
 
-uint32_t Log::Collect::collect () {
-    uint32_t bookmarkEnd = log_->getLastWrittenIndex();
+// A record a producer reserved and never committed blocks its ring. Once it
+// blocked it for ABANDON_NSEC, skip it.
+uint64_t Log::Collect::checkStall(uint32_t shard, uint64_t index, uint64_t end) {
+    Stall &stall = stalls_[shard];
+    uint64_t now = Clock::monotonicNsec();
 
-    if (log_->ringBuffer_->normalize(collectorBookmark_) == log_->ringBuffer_->normalize(bookmarkEnd)) {
-        // Empty buffer
-    } else if (log_->ringBuffer_->normalize(collectorBookmark_) <
-               log_->ringBuffer_->normalize(bookmarkEnd)) {
-        prevCollectRangeStart_ = collectorBookmark_;
-        prevCollectRangeEnd_ = bookmarkEnd;
-        bookmarkEnd = log_->dumpRange(collectorBookmark_, bookmarkEnd - 1, true, log_->getStream());
-    } else {
-        // Wrapped around
-        uint32_t rangeEnd = bookmarkEnd;
+    if (index >= end || stall.index != index || !stall.sinceNsec) {
+        stall.index = index;
+        stall.sinceNsec = index < end ? now : 0;
+        return index;
+    }
 
-        // Top buffer
-        prevCollectRangeStart_ = collectorBookmark_;
-        prevCollectRangeEnd_ = log_->ringBuffer_->size();
-        bookmarkEnd = log_->dumpRange( collectorBookmark_, log_->ringBuffer_->size() - 1, true, log_->getStream());
+    if (now - stall.sinceNsec < ABANDON_NSEC) {
+        return index;
+    }
+
+    stall.sinceNsec = 0;
+    return log_->skipAbandoned(log_->shards_[shard].ringBuffer.get(), index, log_->getStream());
+}
 
-        // Bottom buffer
-        prevCollectRangeStart_ = 0;
-        prevCollectRangeEnd_ = rangeEnd;
-        bookmarkEnd = log_->dumpRange( 0, rangeEnd - 1, true, log_->getStream());
+// Shard mode: merge every shard from its bookmark up to its current index
+uint64_t Log::Collect::collectShards() {
+    std::vector<uint64_t> ends(shardBookmarks_.size());
+    uint64_t consumed = 0;
+
+    for (uint32_t s = 0; s < ends.size(); s++) {
+        ends[s] = log_->shards_[s].ringBuffer->getCurrentIndex();
     }
 
-    collectorBookmark_ = bookmarkEnd;
+    shardBookmarks_[0] = collectorBookmark_;
+    prevCollectRangeStart_ = collectorBookmark_;
+    prevCollectRangeEnd_ = ends[0];
+
+    std::vector<uint64_t> starts(shardBookmarks_);
+    log_->dumpShards(shardBookmarks_.data(), ends.data(), true, log_->getStream());
 
-    return bookmarkEnd;
+    for (uint32_t s = 0; s < ends.size(); s++) {
+        shardBookmarks_[s] = checkStall(s, shardBookmarks_[s], ends[s]);
+        consumed += shardBookmarks_[s] - starts[s];
+    }
+    collectorBookmark_ = shardBookmarks_[0];
+    release();
+
+    return consumed;
 }
 
-bool Log::Collect::shallCollect() {
-    if (log_->ringBuffer_->normalize(log_->getLastWrittenIndex()) ==
-        log_->ringBuffer_->normalize(collectorBookmark_)) {
-        return false;
+uint64_t Log::Collect::collect () {
+    auto pass = log_->stagePass(log_->getStream());
+
+    if (!shardBookmarks_.empty()) {
+        return collectShards();
+    }
+
+    uint64_t start = collectorBookmark_;
+    uint64_t end = log_->ringBuffer_->getCurrentIndex();
+
+    if (start == end) {
+        // Empty buffer
+        return 0;
+    }
+
+    prevCollectRangeStart_ = start;
+    prevCollectRangeEnd_ = end;
+    collectorBookmark_ = log_->dumpRange(start, end, true, log_->getStream());
+    collectorBookmark_ = checkStall(0, collectorBookmark_, end);
+    release();
+
+    return collectorBookmark_ - start;
+}
+
+// Producers of a bounded ring may reuse everything before the bookmarks
+void Log::Collect::release() {
+    log_->ringBuffer_->release(collectorBookmark_);
+    for (uint32_t s = 1; s < shardBookmarks_.size(); s++) {
+        log_->shards_[s].ringBuffer->release(shardBookmarks_[s]);
     }
+}
 
-    if ((log_->ringBuffer_->normalize(log_->getLastWrittenIndex()) -
-         log_->ringBuffer_->normalize(collectorBookmark_)) > getBufferThreshold()) {
-        return true;
+// Bytes not collected yet over every ring
+uint64_t Log::Collect::pending() {
+    uint64_t pending;
+
+    if (!shardBookmarks_.empty()) {
+        pending = 0;
+        for (uint32_t s = 0; s < shardBookmarks_.size(); s++) {
+            uint64_t bookmark = s ? shardBookmarks_[s] : collectorBookmark_;
+            pending += log_->shards_[s].ringBuffer->getCurrentIndex() - bookmark;
+        }
+    } else {
+        pending = log_->ringBuffer_->getCurrentIndex() - collectorBookmark_;
     }
 
-    /* Wrapped-around logs */
-    uint32_t sizeBlockEnd = log_->ringBuffer_->normalize(0xffffffff) -
-                              log_->ringBuffer_->normalize(collectorBookmark_);
-    uint32_t sizeBlockStart = log_->ringBuffer_->normalize(log_->getLastWrittenIndex());
+    return pending;
+}
 
-    if ((sizeBlockEnd + sizeBlockStart) > getBufferThreshold()) {
-        return true;
+bool Log::Collect::shallCollect() {
+    return pending() > getBufferThreshold();
+}
+
+// Share of the rings not collected yet
+uint32_t Log::Collect::occupancyPct() {
+    uint64_t size = 0;
+
+    for (uint32_t s = 0; s <= log_->shardCount_; s++) {
+        size += log_->shards_[s].ringBuffer->size();
     }
+    return size ? (uint32_t) std::min<uint64_t>(pending() * 100 / size, 100) : 0;
+}
 
-    return false;
+uint32_t Log::Collect::getMaxLatencyUsec() const {
+    return maxLatencyUsec_;
 }
 
 void Log::Collect::workerThread() {
+    bool woken = false;
+
     while (getEnable()) {
-        if (getEnable() && shallCollect()) {
-            collect();
-            continue;
-        }
-        idle();
+        uint32_t usec = step(woken);
+        woken = usec && wait(usec);
     }
 
     flush();
 }
 
 bool Log::Collect::getEnable() const {
-    return enable_;
+    return __atomic_load_n(&enable_, __ATOMIC_ACQUIRE);
 }
 
 void Log::Collect::flush(void) {
     collect();
     log_->stream_->flush();
+    markCollected();
+}
+
+// Everything before the bookmarks reached the stream, a recovery of a ring
+// file starts there
+void Log::Collect::markCollected() {
+    log_->ringBuffer_->setCollected(collectorBookmark_);
+    for (uint32_t s = 1; s < shardBookmarks_.size(); s++) {
+        log_->shards_[s].ringBuffer->setCollected(shardBookmarks_[s]);
+    }
 }
 
 void* Log::Collect::executeWorkerThread(void *ctx) {
@@ -153,15 +337,26 @@ void Log::Collect::dumpState(char *buffer, int bufferLen) const {
     char *bufferNext = buffer;
 
     bufferNext += sprintf(bufferNext, "Collector State:\n");
-    bufferNext += sprintf(bufferNext, "Bookmark: %u\n", collectorBookmark_);
+    bufferNext += sprintf(bufferNext, "Bookmark: %" PRIu64 "\n", collectorBookmark_);
     bufferNext += sprintf(bufferNext, "buffer threshold pct: %u\n", bufferThresholdPct_);
     bufferNext += sprintf(bufferNext, "Enabled: %u\n", getEnable());
-    bufferNext += sprintf(bufferNext, "Prev collect range start: %u\n", prevCollectRangeStart_);
-    bufferNext += sprintf(bufferNext, "Prev collect range end: %u\n", prevCollectRangeEnd_);
+    bufferNext += sprintf(bufferNext, "Prev collect range start: %" PRIu64 "\n", prevCollectRangeStart_);
+    bufferNext += sprintf(bufferNext, "Prev collect range end: %" PRIu64 "\n", prevCollectRangeEnd_);
+    bufferNext += sprintf(bufferNext, "Max latency usec: %u\n", maxLatencyUsec_);
+    bufferNext += sprintf(bufferNext, "Wake watermark pct: %u\n", wakeWatermarkPct_);
+    bufferNext += sprintf(bufferNext, "Idle sleep usec: %u\n", idleUsec_);
+    bufferNext += sprintf(bufferNext, "Producer wakeups: %" PRIu64 "\n", producerWakeups_);
+    bufferNext += sprintf(bufferNext, "Timeout wakeups: %" PRIu64 "\n", timeoutWakeups_);
+    bufferNext += sprintf(bufferNext, "Pooled: %d priority: %u\n", log_->collectorPool_ != nullptr, priority_);
 }
 
-Log::Collect::Collect(Log *log, bool enable)
-        : log_(log), bufferThresholdPct_(DEFAULT_BUFFER_THRESHOLD_PCT) {
+Log::Collect::Collect(Log *log, bool enable, uint32_t maxLatencyUsec, uint32_t wakeWatermarkPct, uint32_t priority)
+        : log_(log), bufferThresholdPct_(DEFAULT_BUFFER_THRESHOLD_PCT),
+          shardBookmarks_(log->shardCount_ ? log->shardCount_ + 1 : 0),
+          stalls_(log->shardCount_ + 1, Stall{0, 0}), enable_(false),
+          maxLatencyUsec_(maxLatencyUsec ? maxLatencyUsec : 1), wakeWatermarkPct_(wakeWatermarkPct),
+          priority_(priority ? priority : 1), quiet_(false), idleUsec_(maxLatencyUsec_), unflushed_(false),
+          producerWakeups_(0), timeoutWakeups_(0) {
     setEnable(enable);
 }
 
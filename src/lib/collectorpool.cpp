@@ -0,0 +1,175 @@
+/* Copyright 2019 memlog Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+//
+// CollectorPool class
+//
+
+#include <climits>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <algorithm>
+#include "log.h"
+
+using namespace std;
+using namespace memlog;
+
+shared_ptr<Log::CollectorPool> Log::CollectorPool::global() {
+    static mutex globalMutex;
+    static weak_ptr<CollectorPool> instance;
+    lock_guard<mutex> lock(globalMutex);
+
+    shared_ptr<CollectorPool> pool = instance.lock();
+    if (!pool) {
+        pool = make_shared<CollectorPool>();
+        instance = pool;
+    }
+    return pool;
+}
+
+Log::CollectorPool::CollectorPool(uint32_t threads)
+        : sequence_(0), stop_(false), passCount_(0), overdueCount_(0), wakeCount_(0) {
+    for (uint32_t t = 0; t < std::max<uint32_t>(threads, 1); t++) {
+        threads_.emplace_back(&CollectorPool::workerThread, this);
+    }
+}
+
+Log::CollectorPool::~CollectorPool() {
+    {
+        lock_guard<mutex> lock(mutex_);
+        stop_ = true;
+    }
+    __atomic_add_fetch(&sequence_, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &sequence_, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+    for (auto &thread : threads_) {
+        thread.join();
+    }
+}
+
+// Due at once, parked until then
+void Log::CollectorPool::add(Collect *collect, uint32_t priority) {
+    collect->park();
+    {
+        lock_guard<mutex> lock(mutex_);
+        entries_.push_back(Entry{collect, priority ? priority : 1, Clock::monotonicNsec(), false});
+    }
+    wake();
+}
+
+void Log::CollectorPool::remove(Collect *collect) {
+    unique_lock<mutex> lock(mutex_);
+
+    for (auto entry = entries_.begin(); entry != entries_.end(); entry++) {
+        if (entry->collect == collect) {
+            idleCond_.wait(lock, [&entry] { return !entry->busy; });
+            entries_.erase(entry);
+            return;
+        }
+    }
+}
+
+// Producer side, no lock
+void Log::CollectorPool::wake() {
+    __atomic_add_fetch(&sequence_, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&wakeCount_, 1, __ATOMIC_RELAXED);
+    syscall(SYS_futex, &sequence_, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+}
+
+// The entry to collect next, or none and how long until one is due. An entry
+// left waiting past its latency bound goes before any ranked by priority, so
+// a full ring of high priority cannot hold the others back for long.
+Log::CollectorPool::Entry *Log::CollectorPool::pick(uint64_t now, uint64_t *sleepNsec) {
+    Entry *next = nullptr;
+    bool nextOverdue = false;
+    uint64_t nextScore = 0;
+
+    for (auto &entry : entries_) {
+        if (entry.busy) {
+            continue;
+        }
+        if (entry.dueNsec > now && !entry.collect->woken()) {
+            *sleepNsec = std::min(*sleepNsec, entry.dueNsec - now);
+            continue;
+        }
+
+        bool overdue = entry.dueNsec < now && now - entry.dueNsec > entry.collect->getMaxLatencyUsec() * 1000ULL;
+        uint64_t score = (uint64_t) entry.priority * (entry.collect->occupancyPct() + 1);
+        bool better;
+        if (!next || overdue != nextOverdue) {
+            better = !next || overdue;
+        } else if (overdue) {
+            better = entry.dueNsec < next->dueNsec;
+        } else {
+            better = score > nextScore || (score == nextScore && entry.dueNsec < next->dueNsec);
+        }
+
+        if (better) {
+            next = &entry;
+            nextOverdue = overdue;
+            nextScore = score;
+        }
+    }
+
+    if (next && nextOverdue) {
+        overdueCount_++;
+    }
+    return next;
+}
+
+void Log::CollectorPool::workerThread() {
+    unique_lock<mutex> lock(mutex_);
+
+    while (!stop_) {
+        // Read before the entries, a wakeup after the scan ends the sleep
+        uint32_t sequence = __atomic_load_n(&sequence_, __ATOMIC_ACQUIRE);
+        uint64_t sleepNsec = MAX_SLEEP_NSEC;
+        Entry *entry = pick(Clock::monotonicNsec(), &sleepNsec);
+
+        if (!entry) {
+            struct timespec timeout = { (time_t) (sleepNsec / Clock::NSEC_PER_SEC),
+                                        (long) (sleepNsec % Clock::NSEC_PER_SEC) };
+            lock.unlock();
+            syscall(SYS_futex, &sequence_, FUTEX_WAIT_PRIVATE, sequence, &timeout, nullptr, 0);
+            lock.lock();
+            continue;
+        }
+
+        entry->busy = true;
+        lock.unlock();
+
+        Collect *collect = entry->collect;
+        uint32_t usec = collect->step(collect->unpark());
+        if (usec) {
+            collect->park();
+        }
+
+        lock.lock();
+        entry->busy = false;
+        entry->dueNsec = Clock::monotonicNsec() + usec * 1000ULL;
+        passCount_++;
+        idleCond_.notify_all();
+    }
+}
+
+void Log::CollectorPool::dumpState(char *buffer, int bufferLen) const {
+    char *bufferNext = buffer;
+    lock_guard<mutex> lock(mutex_);
+
+    bufferNext += sprintf(bufferNext, "Collector pool threads: %zu logs: %zu\n", threads_.size(), entries_.size());
+    bufferNext += sprintf(bufferNext, "Collector pool passes: %" PRIu64 " overdue: %" PRIu64 " wakeups: %" PRIu64 "\n",
+                          passCount_, overdueCount_, wakeCount_);
+}
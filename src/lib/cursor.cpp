@@ -0,0 +1,239 @@
+/* Copyright 2019 memlog Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+//
+// Cursor class
+//
+
+#include <cstring>
+#include <algorithm>
+#include "log.h"
+
+using namespace std;
+using namespace memlog;
+
+Log::Cursor::Cursor(Log *log, const Query &query)
+        : log_(log), query_(query), reversed_(false), returned_(0), lastRing_(nullptr), lastIndex_(0),
+          lastInPlace_(false) {
+    log_->refreshClock();
+    for (uint32_t s = 0; s <= log_->shardCount_; s++) {
+        RingCursor cursor;
+        cursor.ring = log_->shards_[s].ringBuffer.get();
+        cursor.end = cursor.ring->getCurrentIndex();
+        cursor.begin = log_->findFirstLine(cursor.ring, buffer_);
+        cursor.index = cursor.begin;
+        cursor.windowStart = cursor.end;
+        cursor.ready = false;
+        rings_.push_back(std::move(cursor));
+    }
+
+    // Oldest first among the newest ones: find them backwards, then return
+    // them the other way
+    reversed_ = query_.order == OLDEST_FIRST && query_.last;
+    if (reversed_) {
+        RingBuffer *ring;
+        uint64_t index;
+
+        query_.order = NEWEST_FIRST;
+        while (collected_.size() < query_.last && advance(&ring, &index)) {
+            collected_.emplace_back(ring, index);
+        }
+    }
+}
+
+bool Log::Cursor::next(Record *record) {
+    RingBuffer *ring;
+    uint64_t index;
+
+    while (true) {
+        if (reversed_) {
+            if (collected_.empty()) {
+                return false;
+            }
+            ring = collected_.back().first;
+            index = collected_.back().second;
+            collected_.pop_back();
+        } else if ((query_.last && returned_ == query_.last) || !advance(&ring, &index)) {
+            return false;
+        }
+
+        // Skip a record overwritten since it was found
+        if (load(ring, index, record)) {
+            returned_++;
+            return true;
+        }
+    }
+}
+
+bool Log::Cursor::intact() const {
+    return lastRing_ && (!lastInPlace_ || !log_->isOverwritten(lastRing_, lastIndex_));
+}
+
+int Log::Cursor::format(const Record &record, char *dst) const {
+    int length = 0;
+
+    if (log_->formatRecord((Header *) record.header, (uint8_t *) record.header, dst, &length) < 0) {
+        return -1;
+    }
+    return length;
+}
+
+// Tested on the header alone, the site part once per site
+bool Log::Cursor::matches(const Header &hdr) {
+    if (hdr.id < query_.fromId || hdr.id > query_.toId) {
+        return false;
+    }
+    if (query_.fromNsec || query_.toNsec != UINT64_MAX) {
+        uint64_t nsec = hdr.timestamp ? log_->clock_->toNsec(hdr.timestamp) : 0;
+        if (nsec < query_.fromNsec || nsec > query_.toNsec) {
+            return false;
+        }
+    }
+
+    if (hdr.site >= sites_.size()) {
+        sites_.resize(hdr.site + 1, MATCH_UNKNOWN);
+    }
+    Match &match = sites_[hdr.site];
+    if (match == MATCH_UNKNOWN) {
+        const Site *site = log_->catalog_->find(hdr.site);
+        bool yes = site && site->level >= query_.level && (!query_.tag || site->tag == query_.tag) &&
+                   (!query_.functionName ||
+                    (site->functionName && strcmp(site->functionName, query_.functionName) == 0));
+        match = yes ? MATCH_YES : MATCH_NO;
+    }
+    return match == MATCH_YES;
+}
+
+// Next matching record of the ring from cursor->index, skipping the pending
+// and overwritten ones as dump() does
+bool Log::Cursor::peekForward(RingCursor *cursor) {
+    RingBuffer *ring = cursor->ring;
+
+    while (!cursor->ready && cursor->index < cursor->end) {
+        if (log_->readLog(ring, cursor->index, buffer_) != RECORD_VALID) {
+            cursor->index = log_->findNextHeader(ring, cursor->index + LOG_RECORD_ALIGN, cursor->end, buffer_);
+            continue;
+        }
+
+        memcpy(&cursor->hdr, buffer_, sizeof(Header));
+        if (matches(cursor->hdr)) {
+            cursor->ready = true;
+        } else {
+            cursor->index += LOG_MEM_ALIGN(cursor->hdr.length);
+        }
+    }
+    return cursor->ready;
+}
+
+// Records only link forward, the newest are found by reading the window
+// below the last one read
+bool Log::Cursor::peekBackward(RingCursor *cursor) {
+    while (!cursor->ready) {
+        if (!cursor->window.empty()) {
+            cursor->index = cursor->window.back();
+            cursor->ring->get((uint8_t *) &cursor->hdr, cursor->index, sizeof(Header));
+            cursor->ready = true;
+            break;
+        }
+        if (cursor->windowStart <= cursor->begin) {
+            break;
+        }
+        readWindow(cursor);
+    }
+    return cursor->ready;
+}
+
+// Matching records starting in the WINDOW_SIZE bytes below windowStart
+void Log::Cursor::readWindow(RingCursor *cursor) {
+    RingBuffer *ring = cursor->ring;
+    uint64_t limit = cursor->windowStart;
+
+    cursor->windowStart = limit - std::min<uint64_t>(WINDOW_SIZE, limit - cursor->begin);
+    uint64_t index = log_->findNextHeader(ring, cursor->windowStart, limit, buffer_);
+
+    while (index < limit) {
+        if (log_->readLog(ring, index, buffer_) != RECORD_VALID) {
+            index = log_->findNextHeader(ring, index + LOG_RECORD_ALIGN, limit, buffer_);
+            continue;
+        }
+
+        Header hdr;
+        memcpy(&hdr, buffer_, sizeof(Header));
+        if (matches(hdr)) {
+            cursor->window.push_back(index);
+        }
+        index += LOG_MEM_ALIGN(hdr.length);
+    }
+}
+
+// Take the next record of the merge in query order, by timestamp then id
+bool Log::Cursor::advance(RingBuffer **ring, uint64_t *index) {
+    bool newestFirst = query_.order == NEWEST_FIRST;
+    RingCursor *next = nullptr;
+
+    for (auto &cursor : rings_) {
+        if (!(newestFirst ? peekBackward(&cursor) : peekForward(&cursor))) {
+            continue;
+        }
+        if (!next) {
+            next = &cursor;
+            continue;
+        }
+
+        int order = cursor.hdr.timestamp != next->hdr.timestamp ?
+                    (cursor.hdr.timestamp < next->hdr.timestamp ? -1 : 1) :
+                    log_->cmpHeader(&cursor.hdr, &next->hdr);
+        if (newestFirst ? order > 0 : order < 0) {
+            next = &cursor;
+        }
+    }
+
+    if (!next) {
+        return false;
+    }
+
+    *ring = next->ring;
+    *index = next->index;
+    next->ready = false;
+    if (newestFirst) {
+        next->window.pop_back();
+    } else {
+        next->index += LOG_MEM_ALIGN(next->hdr.length);
+    }
+    return true;
+}
+
+bool Log::Cursor::load(RingBuffer *ring, uint64_t index, Record *record) {
+    const char *data;
+
+    if (log_->readLog(ring, index, buffer_, &data) != RECORD_VALID) {
+        return false;
+    }
+
+    // The copy in buffer_ was validated, the header in the ring may change
+    Header hdr;
+    memcpy(&hdr, buffer_, sizeof(Header));
+
+    record->header = (const Header *) data;
+    record->site = log_->catalog_->find(hdr.site);
+    record->nsec = hdr.timestamp ? log_->clock_->toNsec(hdr.timestamp) : 0;
+    record->args = (const uint8_t *) data + sizeof(Header);
+    record->argsLength = hdr.length - sizeof(Header) - sizeof(Trailer);
+
+    lastRing_ = ring;
+    lastIndex_ = index;
+    lastInPlace_ = data != buffer_;
+    return true;
+}
@@ -0,0 +1,242 @@
+/* Copyright 2019 memlog Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+//
+// FormatPool class
+//
+
+#include <cstring>
+#include <inttypes.h>
+#include "log.h"
+
+using namespace std;
+using namespace memlog;
+
+// Same contract as printAtIndex(), dst gets a copy of the record to format
+// later. The copy cannot be overwritten while it is formatted.
+int Log::stageAtIndex(RingBuffer *ring, uint64_t index, char *dst, uint64_t *nextIndex,
+                      Header *printedHeader, int *length) {
+    char scratchBuffer[LOG_MAX_LOG_TRACE_LINE * 2];
+    const char *record;
+
+    *length = 0;
+    *nextIndex = index;
+
+    RecordState state = getLog(ring, index, scratchBuffer, &record);
+    if (state == RECORD_PENDING) {
+        return 1;
+    }
+
+    if (state != RECORD_VALID) {
+        printFallCount_++;
+        return -1;
+    }
+
+    Header hdr;
+    memcpy(&hdr, scratchBuffer, sizeof(Header));
+    memcpy(dst, record, hdr.length);
+
+    // Overwritten while copying in place
+    if (record != scratchBuffer && isOverwritten(ring, index)) {
+        printFallCount_++;
+        return -1;
+    }
+
+    if (printedHeader) {
+        memcpy(printedHeader, &hdr, sizeof(Header));
+    }
+    memcpy(&debugLastHeader_, &hdr, sizeof(Header));
+
+    *nextIndex = index + LOG_MEM_ALIGN(hdr.length);
+    *length = hdr.length;
+    lastPrintedId_ = hdr.id;
+    return 0;
+}
+
+// Held while the records are staged for stream, nothing when they are not
+unique_lock<mutex> Log::stagePass(const shared_ptr<Stream> &stream) {
+    if (!isStaged(stream)) {
+        return unique_lock<mutex>();
+    }
+    return formatPool_->begin(stream);
+}
+
+Log::FormatPool::FormatPool(Log *log, uint32_t threads)
+        : log_(log), stream_(nullptr), current_(nullptr), stop_(false), chunkCount_(0), waitCount_(0), formatFailCount_(0) {
+    // Every formatter busy with one chunk and one more waiting for each
+    for (uint32_t i = 0; i < 2 * threads + 1; i++) {
+        all_.emplace_back(new Chunk{ vector<char>(CHUNK_SIZE), 0, vector<char>(CHUNK_SIZE), 0, 0, false });
+        free_.push_back(all_.back().get());
+    }
+    current_ = free_.back();
+    free_.pop_back();
+
+    for (uint32_t i = 0; i < threads; i++) {
+        threads_.emplace_back(&FormatPool::workerThread, this);
+    }
+}
+
+Log::FormatPool::~FormatPool() {
+    {
+        lock_guard<mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cond_.notify_all();
+    for (auto &thread : threads_) {
+        thread.join();
+    }
+}
+
+unique_lock<mutex> Log::FormatPool::begin(const shared_ptr<Stream> &stream) {
+    unique_lock<mutex> pass(passMutex_);
+
+    stream_ = stream.get();
+    return pass;
+}
+
+void Log::FormatPool::addRecord(const char *record, int length) {
+    add(ITEM_RECORD, record, length);
+}
+
+void Log::FormatPool::addNote(const char *text, int length) {
+    add(ITEM_NOTE, text, length);
+}
+
+void Log::FormatPool::add(ItemType type, const char *data, int length) {
+    uint32_t size = sizeof(Item) + LOG_MEM_ALIGN(length);
+
+    if (current_->stagedLength + size > CHUNK_SIZE) {
+        submit();
+    }
+
+    Item item = { type, (uint32_t) length };
+    memcpy(current_->staged.data() + current_->stagedLength, &item, sizeof(Item));
+    memcpy(current_->staged.data() + current_->stagedLength + sizeof(Item), data, length);
+    current_->stagedLength += size;
+}
+
+// Queue the current chunk, then write the chunks already formatted, waiting
+// for the oldest one when no chunk is free
+void Log::FormatPool::submit() {
+    unique_lock<mutex> lock(mutex_);
+
+    if (current_->stagedLength) {
+        current_->done = false;
+        chunks_.push_back(current_);
+        queue_.push_back(current_);
+        chunkCount_++;
+        cond_.notify_all();
+
+        write(lock, false);
+        current_ = free_.back();
+        free_.pop_back();
+    }
+    current_->stagedLength = 0;
+}
+
+void Log::FormatPool::drain() {
+    submit();
+
+    unique_lock<mutex> lock(mutex_);
+    write(lock, true);
+}
+
+// Called by the thread of the pass only, chunks_ is in the order the chunks were filled
+void Log::FormatPool::write(unique_lock<mutex> &lock, bool all) {
+    while (!chunks_.empty()) {
+        Chunk *chunk = chunks_.front();
+
+        if (!chunk->done) {
+            if (!all && !free_.empty()) {
+                return;
+            }
+            waitCount_++;
+            cond_.wait(lock, [chunk] { return chunk->done; });
+        }
+        chunks_.pop_front();
+
+        lock.unlock();
+        stream_->write(chunk->output.data(), chunk->outputLength);
+        log_->printFallCount_ += chunk->failures;
+        lock.lock();
+
+        formatFailCount_ += chunk->failures;
+        free_.push_back(chunk);
+    }
+}
+
+void Log::FormatPool::format(Chunk *chunk) {
+    char line[LOG_MAX_LOG_TRACE_LINE * 2];
+    uint32_t offset = 0;
+
+    chunk->outputLength = 0;
+    chunk->failures = 0;
+
+    while (offset < chunk->stagedLength) {
+        Item item;
+        memcpy(&item, chunk->staged.data() + offset, sizeof(Item));
+
+        char *data = chunk->staged.data() + offset + sizeof(Item);
+        const char *text = data;
+        int length = (int) item.length;
+        offset += sizeof(Item) + LOG_MEM_ALIGN(item.length);
+
+        if (item.type == ITEM_RECORD) {
+            // A record that does not decode is counted and left out, as a
+            // print failure of the collector thread
+            if (log_->formatRecord((Header *) data, (uint8_t *) data, line, &length) < 0) {
+                chunk->failures++;
+                continue;
+            }
+            text = line;
+        }
+
+        if (chunk->outputLength + length > chunk->output.size()) {
+            chunk->output.resize(2 * chunk->output.size() + length);
+        }
+        memcpy(chunk->output.data() + chunk->outputLength, text, length);
+        chunk->outputLength += length;
+    }
+}
+
+void Log::FormatPool::workerThread() {
+    unique_lock<mutex> lock(mutex_);
+
+    while (true) {
+        cond_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+        if (queue_.empty()) {
+            break;
+        }
+
+        Chunk *chunk = queue_.front();
+        queue_.pop_front();
+
+        lock.unlock();
+        format(chunk);
+        lock.lock();
+
+        chunk->done = true;
+        cond_.notify_all();
+    }
+}
+
+void Log::FormatPool::dumpState(char *buffer, int bufferLen) const {
+    char *bufferNext = buffer;
+
+    bufferNext += sprintf(bufferNext, "Formatters: %zu\n", threads_.size());
+    bufferNext += sprintf(bufferNext, "Formatted chunks: %" PRIu64 "\n", chunkCount_);
+    bufferNext += sprintf(bufferNext, "Formatter waits: %" PRIu64 "\n", waitCount_);
+    bufferNext += sprintf(bufferNext, "Formatter failures: %" PRIu64 "\n", formatFailCount_);
+}
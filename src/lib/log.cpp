@@ -23,12 +23,21 @@ limitations under the License.
 #include <assert.h>
 #include <string.h>
 #include <sys/time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <cstdio>
 #include <cstring>
 #include <cstdarg>
 #include <cctype>
 #include <pthread.h>
+#include <sched.h>
 #include <inttypes.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
 
 #include "log.h"
 #include "ringbuffer.h"
@@ -37,90 +46,309 @@ limitations under the License.
 using namespace std;
 using namespace memlog;
 
-uint32_t Log::getTime(struct timespec *ts, char *ts_buf, unsigned int ts_buf_size) {
-    struct tm result;
+// Each field once, literal text stays as it is
+void Log::compilePrefix(const char *prefix) {
+    PrefixStep step{ std::string(), 0 };
+
+    prefix_.clear();
+    for (const char *p = prefix; *p; p++) {
+        if (p[0] == '%' && p[1] && strchr("ticFLs", p[1])) {
+            step.field = p[1];
+            prefix_.push_back(step);
+            step = { std::string(), 0 };
+            p++;
+        } else if (p[0] == '%' && p[1] == '%') {
+            step.literal += '%';
+            p++;
+        } else {
+            step.literal += *p;
+        }
+    }
+    if (!step.literal.empty()) {
+        prefix_.push_back(step);
+    }
+}
 
-    localtime_r(&ts->tv_sec, &result);
-    strftime(ts_buf, ts_buf_size, "%Y %h %e %T", &result);
-    sprintf(&ts_buf[20], ".%9.9ld", ts->tv_nsec);
-    return strlen(ts_buf);
+char *Log::formatPrefix(const Header *hdr, const Site *site, char *dst) {
+    for (const PrefixStep &step : prefix_) {
+        memcpy(dst, step.literal.data(), step.literal.size());
+        dst += step.literal.size();
+
+        switch (step.field) {
+            case 't':
+                dst = formatTime(hdr->timestamp, dst);
+                break;
+            case 'i':
+                dst = StringFormat::formatDecimal(dst, hdr->id);
+                break;
+            case 'c':
+                *dst++ = site->tag;
+                break;
+            case 'F':
+                if (site->functionName) {
+                    size_t length = strlen(site->functionName);
+                    memcpy(dst, site->functionName, length);
+                    dst += length;
+                }
+                break;
+            case 'L':
+                dst = StringFormat::formatDecimal(dst, site->lineNumber);
+                break;
+            case 's':
+                if (site->labelLength) {
+                    memcpy(dst, site->label, site->labelLength);
+                    dst += site->labelLength;
+                } else {
+                    dst = StringFormat::formatDecimal(dst, hdr->length);
+                }
+                break;
+        }
+    }
+    return dst;
 }
 
-uint32_t Log::allocateId() {
-    uint32_t id = globalId_;
-    globalId_++;
+// The date and time are rendered once a second per thread, each record only
+// adds its nanoseconds
+char *Log::formatTime(uint64_t timestamp, char *dst) {
+    struct TimeCache {
+        uint64_t second;
+        TimeFormat format;
+        uint32_t length;
+        char text[64];
+    };
+    static thread_local TimeCache cache = { UINT64_MAX, LOCAL_TIME, 0, {} };
+    uint64_t nsec = clock_->toNsec(timestamp);
+
+    if (timeFormat_ == EPOCH_NSEC) {
+        return StringFormat::formatDecimal(dst, nsec);
+    }
+
+    uint64_t second = nsec / Clock::NSEC_PER_SEC;
+    if (second != cache.second || timeFormat_ != cache.format) {
+        struct tm result;
+        auto seconds = (time_t) second;
 
-    if (globalId_ == START_PATTERN ||
-        globalId_ == END_PATTERN) {
-        globalId_++;
+        if (timeFormat_ == UTC_TIME) {
+            gmtime_r(&seconds, &result);
+        } else {
+            localtime_r(&seconds, &result);
+        }
+        cache.length = strftime(cache.text, sizeof(cache.text), "%Y %h %e %T", &result);
+        cache.second = second;
+        cache.format = timeFormat_;
     }
+
+    memcpy(dst, cache.text, cache.length);
+    dst += cache.length;
+    *dst++ = '.';
+    return StringFormat::formatDecimal(dst, nsec % Clock::NSEC_PER_SEC, 9);
+}
+
+// Ids never match a record pattern. The shared ring takes them one at a time
+// from globalId_, a private shard ID_BLOCK at a time so its producer does not
+// contend for the counter.
+uint32_t Log::allocateId(Shard *shard) {
+    uint32_t id;
+
+    do {
+        if (shard == &shards_[0]) {
+            id = __atomic_fetch_add(&globalId_, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (shard->nextId == shard->idLimit) {
+            shard->nextId = __atomic_fetch_add(&globalId_, ID_BLOCK, __ATOMIC_RELAXED);
+            shard->idLimit = shard->nextId + ID_BLOCK;
+        }
+        id = shard->nextId++;
+    } while (id == START_PATTERN || id == END_PATTERN);
     return id;
 }
 
 uint32_t Log::setHeader(char *dst,
-                        const char *function_name,
-                        uint16_t lineNumber,
-                        char tag,
-                        const char *s,
+                        uint32_t site,
                         bool withTs,
                         uint16_t length, // optional
-                        uint32_t location, // optional
                         uint32_t id // optional
 ) {
     Log::Header *hdr = (Log::Header *)dst;
 
     // Set the timestamp
     if (withTs) {
-        clock_gettime(CLOCK_REALTIME, &hdr->timestamp);
+        hdr->timestamp = clock_->now();
     } else {
-        memset(&hdr->timestamp, 0, sizeof(hdr->timestamp));
+        hdr->timestamp = 0;
     }
 
-    // Set the start pattern
-    hdr->pattern = START_PATTERN;
+    // The record stays reserved until publish() stores the commit pattern
+    hdr->pattern = RESERVED_PATTERN;
     hdr->id = id;
     hdr->length = length;
-    hdr->functionName = function_name;
-    hdr->lineNumber = lineNumber;
-    hdr->tag = tag;
-    hdr->location = ringBuffer_->normalize(location);
-
-    // Set the format string
-    hdr->format = s;
+    hdr->site = site;
+    hdr->unused = 0;
 
     return sizeof(Log::Header);
 }
 
-void Log::setLastWrittenIndex(uint32_t index) {
-    bufLastWrittenIndex_ = index;
+void Log::traceVargs(bool withTs, const char *functionName, uint32_t lineNumber, char tag, const char *format, ...) {
+    va_list va;
+
+    const Site *site = catalog_->find(catalog_->lookup(format, functionName, lineNumber, tag, tagLevel(tag)));
+    if (!site || !__atomic_load_n(&site->enabled, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    va_start(va, format);
+    encodeVargs(site->id, withTs, format, va);
+    va_end(va);
 }
 
-uint32_t Log::getLastWrittenIndex() {
-    return bufLastWrittenIndex_;
+void Log::traceSite(uint32_t site, const char *format, ...) {
+    va_list va;
+
+    // The site keeps the format of its first call. Another one, such as a
+    // format built at run time, gets a site of its own as in traceVargs.
+    const Site *registered = catalog_->find(site);
+    if (registered && registered->format != format) {
+        registered = catalog_->find(catalog_->lookup(format, registered->functionName, registered->lineNumber,
+                                                     registered->tag, registered->level));
+        if (!registered || !__atomic_load_n(&registered->enabled, __ATOMIC_RELAXED)) {
+            return;
+        }
+        site = registered->id;
+    }
+
+    va_start(va, format);
+    encodeVargs(site, true, format, va);
+    va_end(va);
 }
 
-#define LOG_MEM_ALIGN(ret) (ret)
-//#define LOG_MEM_ALIGN(ret) \
-//    ((ret + (sizeof(void *) - 1)) & ~(sizeof(void *) - 1))
+// Size the record first, so the arguments are encoded straight into the
+// reserved slot
+void Log::encodeVargs(uint32_t site, bool withTs, const char *format, va_list va) {
+    Reservation reservation;
+    StringFormat::StringRoom strings = { 0, 0 };
+    va_list sizing;
+
+    va_copy(sizing, va);
+    uint32_t length = sizeof(Log::Header) + stringFormat_->getArgsBufferSize(format, sizing, &strings) +
+                      sizeof(Log::Trailer);
+    va_end(sizing);
+
+    if (length > LOG_MAX_LOG_TRACE_LINE) {
+        encodeTruncated(site, withTs, format, va, strings, length);
+        return;
+    }
 
-#define LOG_MAX_LOG_TRACE_LINE 4096
-void Log::traceVargs(bool withTs, const char *functionName, uint32_t lineNumber, char tag, const char *format, ...) {
-    va_list va;
-    uint32_t location;
-    uint32_t buffer_len, allignedBufferLen;
+    char *record = reserve(length, &reservation);
+    if (!record) {
+        if (reservation.ring) {
+            encodeStaged(reservation, site, withTs, format, va);
+        }
+        return;
+    }
+
+    char *dst = record + sizeof(Log::Header);
+    stringFormat_->encodeToArgsBuffer(format, va, &dst);
+    assert((uint32_t)(dst - record) + sizeof(Log::Trailer) == length);
+    seal(record, dst, site, withTs, reservation.id);
+    commit(reservation);
+}
+
+// The reserved slot wraps around the end of the ring, encode in a buffer.
+// Kept out of line so the fast path does not touch the buffer's stack pages.
+__attribute__((noinline))
+void Log::encodeStaged(const Reservation &reservation, uint32_t site, bool withTs, const char *format,
+                       va_list va) {
     char buffer[LOG_MAX_LOG_TRACE_LINE + 1];
-    char *dst = buffer;
+    char *dst = buffer + sizeof(Log::Header);
 
-    va_start(va, format);
-    dst += sizeof(Log::Header);
     stringFormat_->encodeToArgsBuffer(format, va, &dst);
-    va_end(va);
+    stage(reservation, buffer, dst, site, withTs);
+}
 
-    // Copy the temporary buffer
-    buffer_len = (uint32_t)(dst - buffer);
-    //printf("buffer_len: %d\n", buffer_len);
+// Cut the %s arguments so the record fits in LOG_MAX_LOG_TRACE_LINE, as
+// log() does. Only a record too long without its strings is dropped.
+__attribute__((noinline))
+void Log::encodeTruncated(uint32_t site, bool withTs, const char *format, va_list va,
+                          const StringFormat::StringRoom &strings, uint32_t length) {
+    uint32_t fixedLength = length - strings.bytes;
 
-    uint32_t id = allocateId();
+    if (fixedLength + strings.strings > LOG_MAX_LOG_TRACE_LINE) {
+        oversizeCount_++;
+        return;
+    }
+
+    char buffer[LOG_MAX_LOG_TRACE_LINE + 1];
+    char *dst = buffer + sizeof(Log::Header);
+    StringFormat::StringRoom room = { LOG_MAX_LOG_TRACE_LINE - fixedLength, strings.strings };
+
+    stringFormat_->encodeToArgsBuffer(format, va, &dst, &room);
+    publish(buffer, dst, site, withTs);
+}
+
+// Reserve a slot for a record of length bytes. Return the slot if it is
+// contiguous in the ring, NULL if it wraps around and has to be staged, or
+// if the overrun policy dropped the record (reservation->ring is NULL then).
+char *Log::reserve(uint32_t length, Reservation *reservation) {
+    Shard *shard = getShard();
+    uint32_t allignedLength = LOG_MEM_ALIGN(length);
+
+    assert(allignedLength <= LOG_MAX_LOG_TRACE_LINE);
+
+    reservation->shard = shard;
+    reservation->ring = shard->ringBuffer.get();
+    reservation->id = allocateId(shard);
+    if (overrun_ == OVERRUN_OVERWRITE) {
+        reservation->location = reservation->ring->allocate(allignedLength);
+    } else if (!reserveBounded(reservation->ring, allignedLength, &reservation->location)) {
+        // Dropped, nothing to stage
+        reservation->ring = nullptr;
+        return nullptr;
+    }
+
+    return (char *) reservation->ring->contiguous(reservation->location, allignedLength);
+}
+
+// Reserve without overwriting what the collector has not written out.
+// Return false if the record is dropped.
+bool Log::reserveBounded(RingBuffer *ring, uint32_t length, RingBuffer::Location *location) {
+    if (__builtin_expect(ring->tryAllocate(length, location), 1)) {
+        return true;
+    }
+
+    if (overrun_ != OVERRUN_DROP) {
+        uint64_t start = Clock::monotonicNsec();
+
+        __sync_fetch_and_add(&blockedCount_, 1);
+        for (uint32_t spins = 0; !ring->tryAllocate(length, location); spins++) {
+            // The collector may sleep with the watermark not crossed yet
+            wakeCollector();
+            if (spins < BLOCK_SPINS) {
+                sched_yield();
+            } else {
+                usleep(BLOCK_SLEEP_USEC);
+            }
+            // Without a collector nothing frees the ring, lossless waits as block
+            bool unattended = !collect_ || !collect_->getEnable();
+            if ((overrun_ == OVERRUN_BLOCK || unattended) && Clock::monotonicNsec() - start >= blockNsec_) {
+                __sync_fetch_and_add(unattended ? &unattendedCount_ : &blockTimeoutCount_, 1);
+                __sync_fetch_and_add(&droppedCount_, 1);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    __sync_fetch_and_add(&droppedCount_, 1);
+    return false;
+}
+
+// Write the trailer, the padding and the header around the arguments
+// encoded in [record + sizeof(Header), dst). Return the aligned length.
+uint32_t Log::seal(char *record, char *dst, uint32_t site, bool withTs, uint32_t id) {
+    uint32_t buffer_len, allignedBufferLen;
+
+    buffer_len = (uint32_t)(dst - record);
 
     // Add trailer marker
     Log::Trailer marker = { id, END_PATTERN };
@@ -128,25 +356,99 @@ void Log::traceVargs(bool withTs, const char *functionName, uint32_t lineNumber,
     buffer_len += sizeof(Log::Trailer);
     allignedBufferLen = LOG_MEM_ALIGN(buffer_len);
 
-    // If alignment is enabled, pad it with 0
+    // Pad it with 0 up to the alignment
     int aligned_padding = allignedBufferLen - buffer_len;
     if (aligned_padding > 0) {
-        memset(buffer + buffer_len, 0, allignedBufferLen-buffer_len);
-        assert(allignedBufferLen - buffer_len < sizeof(void *));
+        memset(record + buffer_len, 0, aligned_padding);
     }
 
-    assert(allignedBufferLen <= LOG_MAX_LOG_TRACE_LINE);
+    // Write header
+    setHeader(record, site, withTs, buffer_len, id);
 
-    // Allocate
-    location = ringBuffer_->allocate(allignedBufferLen);
+    return allignedBufferLen;
+}
 
-    // Write header
-    setHeader(buffer, functionName, lineNumber, tag, format, withTs, buffer_len, location, id);
+// Store the commit pattern, the collector treats the record as pending until
+// then
+void Log::commit(const Reservation &reservation) {
+    reservation.ring->storeRelease(reservation.location, commitPattern(reservation.location));
+
+    // The collector set the watermark before it went to sleep. Either it
+    // sees this record when it parks, or this sees it asleep.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (reservation.location >= __atomic_load_n(&reservation.shard->wakeIndex, __ATOMIC_RELAXED) &&
+        __atomic_load_n(&collectorSleeping_, __ATOMIC_RELAXED)) {
+        wakeCollector();
+    }
+}
+
+// Only the first producer to find the collector asleep makes the syscall
+void Log::wakeCollector() {
+    if (!__atomic_exchange_n(&collectorSleeping_, 0, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    if (collectorPool_) {
+        collectorPool_->wake();
+    } else {
+        syscall(SYS_futex, &collectorSleeping_, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+    }
+}
+
+// Copy a record encoded in a buffer into its reserved slot
+void Log::stage(const Reservation &reservation, char *buffer, char *dst, uint32_t site, bool withTs) {
+    if (!reservation.ring) {
+        return;
+    }
 
-    // Copy buffer to circular buffer
-    ringBuffer_->set(location, (uint8_t *) buffer, allignedBufferLen);
+    uint32_t allignedBufferLen = seal(buffer, dst, site, withTs, reservation.id);
 
-    setLastWrittenIndex(ringBuffer_->getCurrentIndex());
+    reservation.ring->set(reservation.location, (uint8_t *) buffer, allignedBufferLen);
+    commit(reservation);
+}
+
+// Reserve, seal and commit a record encoded in a buffer (header at buffer,
+// arguments up to dst)
+void Log::publish(char *buffer, char *dst, uint32_t site, bool withTs) {
+    Reservation reservation;
+
+    reserve((uint32_t)(dst - buffer) + sizeof(Log::Trailer), &reservation);
+    stage(reservation, buffer, dst, site, withTs);
+}
+
+// Shard 0 is the shared ring. In shard mode every producer thread claims a
+// private ring on its first record, and falls back to the shared ring once all
+// shards are taken.
+Log::Shard *Log::getShard() {
+    static thread_local uint64_t cachedSerial = 0;
+    static thread_local Shard *cachedShard = nullptr;
+    static thread_local std::map<uint64_t, Shard *> claimedShards;
+
+    if (shardCount_ == 0) {
+        return &shards_[0];
+    }
+
+    if (cachedSerial == serial_) {
+        return cachedShard;
+    }
+
+    Shard *shard;
+    auto it = claimedShards.find(serial_);
+    if (it != claimedShards.end()) {
+        shard = it->second;
+    } else {
+        uint32_t claimed = __sync_fetch_and_add(&shardsClaimed_, 1);
+        if (claimed < shardCount_) {
+            shard = &shards_[claimed + 1];
+        } else {
+            __sync_fetch_and_add(&shardFallbackCount_, 1);
+            shard = &shards_[0];
+        }
+        claimedShards[serial_] = shard;
+    }
+
+    cachedSerial = serial_;
+    cachedShard = shard;
+    return shard;
 }
 
 FILE *Log::createTracefile(const char *filename, bool redirStd) {
@@ -173,123 +475,187 @@ uint32_t Log::indexInc(uint32_t index, uint32_t v) {
     return index + v;
 }
 
-// Get a valid log stored in index.
-// Return true if the index contain a valid log
-bool Log::getLog(uint32_t index, char *buf) {
-    Header read_hdr_buf;
-    Header *read_hdr = &read_hdr_buf;
-    Header *hdr = (Header *)&buf[0];
-    Trailer *trailer_ptr;
-    uint16_t length;
-    uint32_t id;
+// A producer of a later lap reserved the space of the record at index
+bool Log::isOverwritten(RingBuffer *ring, uint64_t index) {
+    return index + ring->size() < ring->getCurrentIndex();
+}
 
-    index = ringBuffer_->normalize(index);
+// Get a valid log stored in index. The header is copied to buf, and record
+// points to the complete log: in the ring itself if it is mapped twice, the
+// caller then checks isOverwritten() after using it, in buf otherwise.
+// Return RECORD_VALID if the index contain a valid log, RECORD_PENDING if the
+// record is reserved by a producer but not committed yet.
+Log::RecordState Log::getLog(RingBuffer *ring, uint64_t index, char *buf, const char **record) {
+    const char *data = nullptr;
+    RecordFault fault = FAULT_NONE;
+    RecordState state = readLog(ring, index, buf, &data, &fault);
+
+    if (fault != FAULT_NONE && fault != FAULT_PATTERN) {
+        memcpy(&debugHdr_, buf, sizeof(Header));
+    }
+    if (state != RECORD_INVALID) {
+        if (state == RECORD_VALID && record) {
+            *record = data;
+        }
+        return state;
+    }
 
-    // Get the header to get the length
-    ringBuffer_->get((uint8_t *)read_hdr, index, sizeof(Header));
-    memcpy(&debugHdr_, read_hdr, sizeof(Header));
+    debugIndex_ = index;
+    debugState1_ = 0;
+    debugState2_ = 0;
+    debugState3_ = 0;
+    switch (fault) {
+        case FAULT_PATTERN:
+            hdrPatErr++;
+            debugState1_ = 1;
+            break;
+        case FAULT_LENGTH:
+            fullBufLenErr++;
+            debugState2_ = 1;
+            break;
+        case FAULT_SITE:
+            hdrSiteErr++;
+            debugState1_ = 3;
+            break;
+        case FAULT_COPY:
+            hdrLenErr++;
+            debugState1_ = 2;
+            break;
+        case FAULT_TRAILER:
+            memcpy(&debugTrailer_, data + ((Header *) buf)->length - sizeof(Trailer), sizeof(Trailer));
+            hdrTailErr++;
+            debugState3_ = 1;
+            break;
+        case FAULT_NONE:
+            break;
+    }
+    return RECORD_INVALID;
+}
+
+// Validation of getLog() without touching the counters, for readers on
+// other threads than the collector. The header read is in buf whenever the
+// pattern matched, record is set once the record was copied, fault tells
+// why a record is invalid.
+Log::RecordState Log::readLog(RingBuffer *ring, uint64_t index, char *buf, const char **record,
+                              RecordFault *fault) {
+    Header readHdr;
+    Header *hdr = (Header *) buf;
+    RecordFault unused;
+
+    if (!fault) {
+        fault = &unused;
+    }
+    *fault = FAULT_NONE;
+
+    // The commit pattern is published last, with release semantics
+    uint32_t pattern = ring->loadAcquire(index);
 
     // Validate begining marker
-    if (read_hdr->pattern != START_PATTERN) {
-        debugIndex_ = index;
-        hdrPatErr++;
-        debugState1_ = 1;
-        debugState2_ = 0;
-        debugState3_ = 0;
-        return false;
+    if (pattern != commitPattern(index)) {
+        // Inside the current lap the producer has not committed yet
+        if (index + ring->size() >= ring->getCurrentIndex()) {
+            return RECORD_PENDING;
+        }
+        *fault = FAULT_PATTERN;
+        return RECORD_INVALID;
     }
 
+    // Get the header to get the length
+    ring->get((uint8_t *) &readHdr, index, sizeof(Header));
+    memcpy(buf, &readHdr, sizeof(Header));
+
     // Validate length
-    if ((read_hdr->length < (sizeof(Header) +
-                             sizeof(Trailer))) ||
-        (read_hdr->length > LOG_MAX_LOG_TRACE_LINE)) {
-        debugIndex_ = index;
-        fullBufLenErr++;
-        debugState1_ = 0;
-        debugState2_ = 1;
-        debugState3_ = 0;
-        return false;
+    if (readHdr.length < sizeof(Header) + sizeof(Trailer) || readHdr.length > LOG_MAX_LOG_TRACE_LINE) {
+        *fault = FAULT_LENGTH;
+        return RECORD_INVALID;
     }
 
-    length = read_hdr->length;
-    id = read_hdr->id;
+    // Validate site
+    if (!catalog_->find(readHdr.site)) {
+        *fault = FAULT_SITE;
+        return RECORD_INVALID;
+    }
 
-    // Now copy the complete log with header and length
-    ringBuffer_->get((uint8_t *)hdr, index, length);
+    // Now copy the complete log with header and length, unless the record is
+    // one contiguous span of the ring
+    if (ring->isMapped()) {
+        hdr = (Header *) ring->span(index);
+    } else {
+        ring->get((uint8_t *) hdr, index, readHdr.length);
+    }
 
-    // Validate Header
-    if (memcmp(read_hdr, hdr, sizeof(Header)) != 0) {
-        debugIndex_ = index;
-        hdrLenErr++;
-        debugState1_ = 2;
-        debugState2_ = 0;
-        debugState3_ = 0;
-        return false;
+    // Validate Header, and that no producer of the next lap reserved this
+    // space while it was being copied
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (memcmp(&readHdr, hdr, sizeof(Header)) != 0 || isOverwritten(ring, index)) {
+        *fault = FAULT_COPY;
+        return RECORD_INVALID;
     }
 
-    // Check trailer
-    trailer_ptr = (Trailer *)(((uint8_t *)hdr) + length - sizeof(Trailer));
-
-    // Construct a trailer
-    Trailer trailer = { id, END_PATTERN };
-
-    if (memcmp(trailer_ptr, &trailer, sizeof(Trailer)) != 0) {
-        memcpy(&debugTrailer_, trailer_ptr, sizeof(Trailer));
-        debugIndex_ = index;
-        hdrTailErr++;
-        debugState1_ = 0;
-        debugState2_ = 0;
-        debugState3_ = 1;
-        return false;
+    if (record) {
+        *record = (const char *) hdr;
     }
 
-    return true;
+    // Check trailer
+    Trailer trailer = { readHdr.id, END_PATTERN };
+    if (memcmp(((uint8_t *) hdr) + readHdr.length - sizeof(Trailer), &trailer, sizeof(Trailer)) != 0) {
+        *fault = FAULT_TRAILER;
+        return RECORD_INVALID;
+    }
+    return RECORD_VALID;
 }
 
-bool Log::isEntryValid(uint32_t index, char *buf) {
+bool Log::isEntryValid(RingBuffer *ring, uint64_t index, char *buf) {
     char scratch_buffer[LOG_MAX_LOG_TRACE_LINE * 2];
     if (buf == NULL) {
         buf = scratch_buffer;
     }
-    return getLog(index, buf);
+    return getLog(ring, index, buf) == RECORD_VALID;
 }
 
-// Find current or next header from the circular buffer
-uint32_t Log::getNextHeader(uint32_t index, char *buf) {
-    // Re-allign pointer
-    Marker pattern = START_PATTERN;
-    uint32_t loop = 0;
+// Find current or next committed header before end.
+// Return end if there is none.
+uint64_t Log::getNextHeader(RingBuffer *ring, uint64_t index, uint64_t end, char *buf) {
+    uint64_t current = ring->getCurrentIndex();
 
-    do {
-        while (ringBuffer_->compare(index, (uint8_t *) &pattern, sizeof(pattern))) {
-            index++;
-            loop++;
-            if (loop > ringBuffer_->size()) {
-                getNextHeaderFailCount_++;
-                return 0;
-            }
-        }
+    // Anything older than one lap has been overwritten
+    if (current > ring->size() && index < current - ring->size()) {
+        index = current - ring->size();
+    }
 
-        // Got a good index, try to validate the complete log entry.
-        if (isEntryValid(index, buf)) {
-            break;
-        } else {
-            index++;
-            loop++;
-            if (loop > ringBuffer_->size()) {
-                getNextHeaderFailCount_++;
-                return 0;
-            }
-            continue;
+    // Records start on aligned boundaries
+    index = LOG_MEM_ALIGN(index);
+    uint64_t start = index;
+
+    while (index < end) {
+        if (isEntryValid(ring, index, buf)) {
+            glideCount_ = (uint32_t)(index - start);
+            return index;
         }
-    } while(1);
+        index += LOG_RECORD_ALIGN;
+    }
 
-    glideCount_ = loop;
-    return index;
+    getNextHeaderFailCount_++;
+    return end;
 }
 
-uint32_t Log::getNextHeaderIndex(uint32_t index) {
-    return getNextHeader(index, NULL);
+uint64_t Log::getNextHeaderIndex(RingBuffer *ring, uint64_t index, uint64_t end) {
+    return getNextHeader(ring, index, end, NULL);
+}
+
+// getNextHeader() without touching the counters, buf is required
+uint64_t Log::findNextHeader(RingBuffer *ring, uint64_t index, uint64_t end, char *buf) {
+    uint64_t current = ring->getCurrentIndex();
+
+    if (current > ring->size() && index < current - ring->size()) {
+        index = current - ring->size();
+    }
+    for (index = LOG_MEM_ALIGN(index); index < end; index += LOG_RECORD_ALIGN) {
+        if (readLog(ring, index, buf) == RECORD_VALID) {
+            return index;
+        }
+    }
+    return end;
 }
 
 //
@@ -322,18 +688,15 @@ int Log::cmpHeader(Header *entry1, Header *entry2) {
 // next_index: the next log entry index
 //
 // Return 0 on success
+// Return 1 if the record is not committed yet
 // Return -1 on print failure, and the error message string on the dst.
 //
-int Log::printAtIndex(uint32_t index, char *dst, uint32_t *next_index,
-                      bool retry, Header *printed_header, int *stringLength) {
+int Log::printAtIndex(RingBuffer *ring, uint64_t index, char *dst, uint64_t *next_index,
+                      Header *printed_header, int *stringLength) {
     char scratch_buffer_[LOG_MAX_LOG_TRACE_LINE * 2];
-    Header *hdr = (Header *)&scratch_buffer_[0];
-    const char *s;
-    char format[32];
-    uint32_t buf_index;
-    uint8_t *start_buf;
+    const char *record;
+    Header *hdr;
     uint32_t hdrid;
-    char *start_dst_buffer = dst;
 
     *stringLength = 0;
 
@@ -342,27 +705,20 @@ int Log::printAtIndex(uint32_t index, char *dst, uint32_t *next_index,
     // Set dst to NULL terminated string
     *dst = 0;
 
-    // Find the next header
-    //index = getNextHeader(index);
-
-    // Consumer is faster than producer
-    int count = 0;
-    bool success;
-    do {
-        success = getLog(index, (char *) hdr);
-        if (success || !retry) {
-            break;
-        }
-
-        usleep(Log::Collect::SPIN_USEC);
-        count++;
-    } while (count < Log::Collect::SPINS);
+    RecordState state = getLog(ring, index, scratch_buffer_, &record);
+    if (state == RECORD_PENDING) {
+        return 1;
+    }
 
-    if (!success) {
+    if (state != RECORD_VALID) {
         printFallCount_++;
         return -1;
     }
 
+    // The header is always copied, the arguments are decoded in place if the
+    // ring is mapped twice
+    hdr = (Header *) scratch_buffer_;
+
     hdrid = hdr->id;
 
     // Store the printed header if requested by caller
@@ -372,25 +728,35 @@ int Log::printAtIndex(uint32_t index, char *dst, uint32_t *next_index,
     // Store last printed header for debugging
     memcpy(&debugLastHeader_, hdr, sizeof(Header));
 
+    auto ret = formatRecord(hdr, (uint8_t *)record, dst, stringLength);
+    if (ret < 0) {
+        return ret;
+    }
+
+    // Overwritten while decoding in place
+    if (record != scratch_buffer_ && isOverwritten(ring, index)) {
+        printFallCount_++;
+        return -1;
+    }
+
+    // Records are padded to the alignment after the trailer
+    *next_index = index + LOG_MEM_ALIGN(hdr->length);
+
+    // For statistic
+    lastPrintedId_ = hdrid;
+
+    return 0;
+}
+
+// Print the record, hdr is its header and record its first byte
+int Log::formatRecord(Header *hdr, uint8_t *record, char *dst, int *stringLength) {
+    const Site *site = catalog_->find(hdr->site);
+    uint32_t buf_index;
+    char *start_dst_buffer = dst;
+
     // Print the time stamp if exists
-    if (hdr->timestamp.tv_sec != 0) {
-        *dst++ = '[';
-        dst += getTime(&hdr->timestamp, dst, LOG_MAX_LOG_TRACE_LINE);
-        if (hdr->functionName) {
-            dst += snprintf(dst,LOG_MAX_LOG_TRACE_LINE,":%u:%c:%s:%u] ",
-                            hdr->id,
-                            hdr->tag, hdr->functionName, hdr->lineNumber);
-        } else if (hdr->lineNumber) {
-            dst += sprintf(dst, ":%u:%c:%u] ",
-                           hdr->id, hdr->tag, hdr->lineNumber);
-        } else if (hdr->tag){
-            dst += sprintf(dst, ":%u:%c] ", hdr->id, hdr->tag);
-        } else {
-            dst += sprintf(dst, ":%u:%u] ", hdr->id, hdr->length);
-        }
-    } else {
-        // Verbose debug
-        //dst += sprintf(dst, "[%d:%d] ", hdr->id, hdr->length);
+    if (hdr->timestamp != 0) {
+        dst = formatPrefix(hdr, site, dst);
     }
 
     auto timestampLength = (int)(dst - start_dst_buffer);
@@ -402,12 +768,9 @@ int Log::printAtIndex(uint32_t index, char *dst, uint32_t *next_index,
     buf_index = indexInc(0, sizeof(Header));
 
     // Parse the format string
-    s = &hdr->format[0];
-    start_buf = (uint8_t *)hdr;
-
     int decodeLength = 0;
-    auto ret = stringFormat_->decodeFromArgsBuffer(s,
-                                                   start_buf,
+    auto ret = stringFormat_->decodeFromArgsBuffer(site->format,
+                                                   record,
                                                    &buf_index,
                                                    dst,
                                                    hdr->length - sizeof(Trailer),
@@ -416,78 +779,88 @@ int Log::printAtIndex(uint32_t index, char *dst, uint32_t *next_index,
         return ret;
     }
 
-    // Adding extra trailer bytes, and return it the incoming index
-    //*next_index = LOG_MEM_ALIGN(buf_index, sizeof(Trailer));
-    *next_index = LOG_MEM_ALIGN(indexInc(buf_index, index) + sizeof(Trailer));
     *stringLength = decodeLength + timestampLength;
+    return 0;
+}
 
-    // For statistic
-    lastPrintedId_ = hdrid;
+uint64_t Log::firstLine(RingBuffer *ring) {
+    uint64_t current = ring->getCurrentIndex();
 
+    if (ring->hasWrappedAround()) {
+        // wrapped around case, the oldest records are one lap behind
+        return getNextHeaderIndex(ring, current - ring->size(), current);
+    }
     return 0;
 }
 
-unsigned int Log::firstLine(void) {
-    uint32_t current = ringBuffer_->getCurrentIndex();
+uint64_t Log::findFirstLine(RingBuffer *ring, char *buf) {
+    uint64_t current = ring->getCurrentIndex();
 
-    if (current >= ringBuffer_->size() || ringBuffer_->hasWrappedAround()) {
-        // wrapped around case
-        current = ringBuffer_->normalize(current);
-        return getNextHeaderIndex(current);
+    if (ring->hasWrappedAround()) {
+        return findNextHeader(ring, current - ring->size(), current, buf);
     }
     return 0;
 }
 
-uint32_t Log::dumpRange(uint32_t start, uint32_t end, bool continueOnFailure, shared_ptr<Stream> stream) {
+uint64_t Log::dumpRange(uint64_t start, uint64_t end, bool collecting, shared_ptr<Stream> stream) {
+    return dumpRange(ringBuffer_.get(), start, end, collecting, stream);
+}
+
+int Log::writeDiscarded(uint64_t newIndex, Header *hdr, Header *printedHeader, char *traceBuffer) {
+    return sprintf(traceBuffer,
+                   "<<<< Logs are discarded. Index is realigned to id: %u lastid: %u pat: 0x%x site: %u "
+                   "new_i: %" PRIu64 " prev_id: %u prev_site: %u fail: %u >>>>>\n",
+                   hdr->id, lastPrintedId_, hdr->pattern,
+                   hdr->site, newIndex,
+                   printedHeader->id, printedHeader->site,
+                   getNextHeaderFailCount_);
+}
+
+// Print the records in [start, end). A collecting caller stops at the first
+// record that is not committed yet and resumes from the returned index on the
+// next pass, dump skips it.
+uint64_t Log::dumpRange(RingBuffer *ring, uint64_t start, uint64_t end, bool collecting,
+                        shared_ptr<Stream> stream) {
     char traceBuffer[LOG_MAX_LOG_TRACE_LINE * 2];
-    uint32_t new_i, i;
+    uint64_t new_i, i;
     int traceBufferLen = 0;
     int err;
     Header printedHeader;
 
-    // Normalized both start and end index
-    start = ringBuffer_->normalize(start);
-    end = ringBuffer_->normalize(end) + 1;
-    if (start > end) {
-        end = ringBuffer_->size();
-    }
     i = start;
 
     memset(&printedHeader, 0, sizeof(printedHeader));
-    bool retry = true;
-    if (continueOnFailure) {
-        retry = false;
-    }
 
     while (i < end) {
-        err = printAtIndex(i, traceBuffer, &new_i, retry, &printedHeader, &traceBufferLen);
+        err = formatAtIndex(ring, i, traceBuffer, &new_i, &printedHeader, &traceBufferLen, stream);
+        if (err > 0) {
+            pendingCount_++;
+            if (collecting) {
+                break;
+            }
+            i = getNextHeader(ring, i + LOG_RECORD_ALIGN, end, traceBuffer);
+            continue;
+        }
+
         // Producer is faster the log consumer. Realign the collector bookmark to
         // the next log entry, and print the error.
         if (err) {
             Header hdr;
-            uint64_t lost = 0;
 
             // Find the next header and get the header content
-            new_i = getNextHeader(i, traceBuffer);
-            memcpy(&hdr, traceBuffer, sizeof(hdr));
-
-            // Print the error and bail out
-            traceBufferLen = sprintf(traceBuffer,
-                                     "<<<< Logs are discarded. Index is realigned to id: %u lastid: %u pat: 0x%x lastwrittenidx: %u loc: %u "
-                                     "new_i: %u prev_id: %u prev_loc: %u fail: %u >>>>>\n",
-                                     hdr.id, lastPrintedId_, hdr.pattern,
-                                     bufLastWrittenIndex_,
-                                     hdr.location, new_i,
-                                     printedHeader.id, printedHeader.location,
-                                     getNextHeaderFailCount_);
-            stream->write(traceBuffer, traceBufferLen);
-
-            // Return to the next scanned line
-            if (!continueOnFailure) {
-                return new_i;
+            new_i = getNextHeader(ring, i + LOG_RECORD_ALIGN, end, traceBuffer);
+            if (new_i < end) {
+                memcpy(&hdr, traceBuffer, sizeof(hdr));
+            } else {
+                memset(&hdr, 0, sizeof(hdr));
             }
-        }
 
+            // Print the error and continue from the realigned index
+            traceBufferLen = writeDiscarded(new_i, &hdr, &printedHeader, traceBuffer);
+            writeNote(stream, traceBuffer, traceBufferLen);
+            i = new_i;
+            continue;
+        }
 
         // Stop if we exceeded the requested range, and dont print
         if (new_i > end) {
@@ -496,53 +869,228 @@ uint32_t Log::dumpRange(uint32_t start, uint32_t end, bool continueOnFailure, sh
         i = new_i;
 
         // Start printing
-        if (!err) {
-            assert(traceBufferLen <= LOG_MAX_LOG_TRACE_LINE);
-            collectCount_++;
-            stream->write(traceBuffer, traceBufferLen);
-        }
+        assert(traceBufferLen <= LOG_MAX_LOG_TRACE_LINE);
+        collectCount_++;
+        writeRecord(stream, traceBuffer, traceBufferLen);
     }
 
+    if (isStaged(stream)) {
+        formatPool_->drain();
+    }
     return i;
 }
 
+// Skip a record a producer reserved but never committed, return the index
+// past it
+uint64_t Log::skipAbandoned(RingBuffer *ring, uint64_t index, shared_ptr<Stream> stream) {
+    char traceBuffer[LOG_MAX_LOG_TRACE_LINE * 2];
+    uint64_t end = ring->getCurrentIndex();
+    uint64_t new_i;
+    Header hdr;
+
+    ring->get((uint8_t *) &hdr, index, sizeof(hdr));
+    if (hdr.pattern == RESERVED_PATTERN &&
+        hdr.length >= sizeof(Header) + sizeof(Trailer) && hdr.length <= LOG_MAX_LOG_TRACE_LINE) {
+        new_i = index + LOG_MEM_ALIGN(hdr.length);
+    } else {
+        new_i = getNextHeader(ring, index + LOG_RECORD_ALIGN, end, traceBuffer);
+    }
+
+    abandonedCount_++;
+    int traceBufferLen = sprintf(traceBuffer,
+                                 "<<<< Abandoned record skipped. id: %u pat: 0x%x index: %" PRIu64
+                                 " new_i: %" PRIu64 " >>>>>\n",
+                                 hdr.id, hdr.pattern, index, new_i);
+    writeNote(stream, traceBuffer, traceBufferLen);
+    if (isStaged(stream)) {
+        formatPool_->drain();
+    }
+    return new_i;
+}
+
+void Log::setLevel(Level level) {
+    catalog_->setLevel(level);
+}
+
+void Log::setFunctionEnabled(const char *functionName, bool enable) {
+    catalog_->setFunctionEnabled(functionName, enable);
+}
+
+void Log::setSiteEnabled(uint32_t site, bool enable) {
+    catalog_->setEnabled(site, enable);
+}
+
 char * Log::getTraceFilename() const {
     return (char *)filename_;
 }
 
+// Peek the next valid record of a shard cursor, realigning over records the
+// producer has overwritten. Return false when the range is exhausted or, when
+// collecting, blocked by a record that is not committed yet.
+bool Log::peekShard(MergeCursor *cursor, bool collecting, Header *printedHeader, shared_ptr<Stream> stream) {
+    char buf[LOG_MAX_LOG_TRACE_LINE * 2];
+    RingBuffer *ring = cursor->ring;
+
+    while (!cursor->ready && cursor->index < cursor->end) {
+        RecordState state = getLog(ring, cursor->index, buf);
+
+        if (state == RECORD_VALID) {
+            memcpy(&cursor->hdr, buf, sizeof(Header));
+            cursor->ready = true;
+            break;
+        }
+
+        if (state == RECORD_PENDING) {
+            pendingCount_++;
+            if (collecting) {
+                cursor->blocked = true;
+                break;
+            }
+            cursor->index = getNextHeader(ring, cursor->index + LOG_RECORD_ALIGN, cursor->end, buf);
+            continue;
+        }
+
+        printFallCount_++;
+        uint64_t newIndex = getNextHeader(ring, cursor->index + LOG_RECORD_ALIGN, cursor->end, buf);
+        Header hdr;
+
+        if (newIndex < cursor->end) {
+            memcpy(&hdr, buf, sizeof(hdr));
+        } else {
+            memset(&hdr, 0, sizeof(hdr));
+        }
+        int length = writeDiscarded(newIndex, &hdr, printedHeader, buf);
+        writeNote(stream, buf, length);
+        cursor->index = newIndex;
+    }
+    return cursor->ready;
+}
+
+// K-way merge of the shard ranges [starts[i], ends[i]) ordered by timestamp,
+// then id. starts[i] is advanced past the records written to the stream.
+void Log::dumpShards(uint64_t *starts, const uint64_t *ends, bool collecting, shared_ptr<Stream> stream) {
+    char traceBuffer[LOG_MAX_LOG_TRACE_LINE * 2];
+    std::vector<MergeCursor> cursors(shardCount_ + 1);
+    Header printedHeader;
+    int traceBufferLen = 0;
+
+    memset(&printedHeader, 0, sizeof(printedHeader));
+
+    for (uint32_t s = 0; s <= shardCount_; s++) {
+        MergeCursor &cursor = cursors[s];
+        cursor.ring = shards_[s].ringBuffer.get();
+        cursor.index = starts[s];
+        cursor.end = ends[s];
+        cursor.ready = false;
+        cursor.blocked = false;
+    }
+
+    while (true) {
+        MergeCursor *next = nullptr;
+        bool blocked = false;
+
+        for (auto &cursor : cursors) {
+            if (!peekShard(&cursor, collecting, &printedHeader, stream)) {
+                blocked |= cursor.blocked;
+                continue;
+            }
+            if (!next || cursor.hdr.timestamp < next->hdr.timestamp ||
+                (cursor.hdr.timestamp == next->hdr.timestamp && cmpHeader(&cursor.hdr, &next->hdr) < 0)) {
+                next = &cursor;
+            }
+        }
+
+        // A pending record may be older than every peeked one, keep the
+        // order and wait for the next pass
+        if (!next || blocked) {
+            break;
+        }
+
+        uint64_t newIndex;
+        int err = formatAtIndex(next->ring, next->index, traceBuffer, &newIndex,
+                                &printedHeader, &traceBufferLen, stream);
+        next->ready = false;
+        if (err) {
+            // Overwritten since it was peeked, peekShard realigns
+            continue;
+        }
+
+        assert(traceBufferLen <= LOG_MAX_LOG_TRACE_LINE);
+        collectCount_++;
+        writeRecord(stream, traceBuffer, traceBufferLen);
+        next->index = newIndex;
+    }
+
+    for (uint32_t s = 0; s <= shardCount_; s++) {
+        starts[s] = cursors[s].index;
+    }
+    if (isStaged(stream)) {
+        formatPool_->drain();
+    }
+}
+
+// Print every ring, merged by timestamp in shard mode. With uncollected,
+// only what the collector did not write out. Return the next index of ring 0.
+uint64_t Log::dumpRings(shared_ptr<Stream> stream, bool uncollected) {
+    std::vector<uint64_t> starts(shardCount_ + 1);
+    std::vector<uint64_t> ends(shardCount_ + 1);
+
+    for (uint32_t s = 0; s <= shardCount_; s++) {
+        RingBuffer *ring = shards_[s].ringBuffer.get();
+        starts[s] = firstLine(ring);
+        if (uncollected) {
+            starts[s] = std::max(starts[s], ring->getCollected());
+        }
+        ends[s] = ring->getCurrentIndex();
+    }
+
+    if (shardCount_) {
+        dumpShards(starts.data(), ends.data(), false, stream);
+        return starts[0];
+    }
+    return dumpRange(ringBuffer_.get(), starts[0], ends[0], false, stream);
+}
+
 void Log::dump(shared_ptr<Stream> stream, bool detail) {
-    char buf[1000];
-    uint32_t i, end;
+    char buf[4096];
+    uint64_t i, end;
 
     if (stream == nullptr) {
         stream = Stream::getStdoutStream();
     }
+    refreshClock();
+    auto pass = stagePass(stream);
 
-    i = ringBuffer_->normalize(firstLine());
-    end = ringBuffer_->normalize(ringBuffer_->getCurrentIndex());
+    i = firstLine(ringBuffer_.get());
+    end = ringBuffer_->getCurrentIndex();
 
     if (detail) {
-        sprintf(buf, "Global id: %d First line: %d Last line: %d\n\n", globalId_, i, end);
-        stream->write(buf, strlen(buf));
+        sprintf(buf, "Global id: %d First line: %" PRIu64 " Last line: %" PRIu64 "\n\n",
+                __atomic_load_n(&globalId_, __ATOMIC_RELAXED), i, end);
+        writeNote(stream, buf, strlen(buf));
     }
-    i = dumpRange(i, end - 1, false, stream);
+    i = dumpRings(stream, false);
     if (detail) {
-        sprintf(buf, "Next printed index: %u\n", i);
-        stream->write(buf, strlen(buf));
+        sprintf(buf, "Next printed index: %" PRIu64 "\n", i);
+        writeNote(stream, buf, strlen(buf));
         dumpState(buf, sizeof(buf));
-        stream->write(buf, strlen(buf));
+        writeNote(stream, buf, strlen(buf));
+    }
+    if (isStaged(stream)) {
+        formatPool_->drain();
     }
     stream->flush();
 }
 
 void Log::dumpState(char *buffer, int bufferLen) const {
+    static const char *overrunNames[] = { "overwrite", "drop", "block", "lossless" };
     char *bufferNext = buffer;
 
     bufferNext += sprintf(bufferNext, "Counters:\n");
     bufferNext += sprintf(bufferNext, "File name: %s\n", getTraceFilename());
     bufferNext += sprintf(bufferNext, "Size: %u\n", ringBuffer_->size());
-    bufferNext += sprintf(bufferNext, "Current Index: %u\n", ringBuffer_->getCurrentIndex());
-    bufferNext += sprintf(bufferNext, "Global Id: %u\n", globalId_);
+    bufferNext += sprintf(bufferNext, "Current Index: %" PRIu64 "\n", ringBuffer_->getCurrentIndex());
+    bufferNext += sprintf(bufferNext, "Global Id: %u\n", __atomic_load_n(&globalId_, __ATOMIC_RELAXED));
     bufferNext += sprintf(bufferNext, "Glide: %u\n", glideCount_);
     bufferNext += sprintf(bufferNext, "Collected trace: %" PRId64 "\n", collectCount_);
     bufferNext += sprintf(bufferNext, "Fwrite fail: %u\n", fwriteFailCount_);
@@ -551,23 +1099,54 @@ void Log::dumpState(char *buffer, int bufferLen) const {
     bufferNext += sprintf(bufferNext, "Fwrite zero: %u\n", fwriteZeroCount_);
     bufferNext += sprintf(bufferNext, "Fwrite errno: %d\n", fwriteErrno_);
     bufferNext += sprintf(bufferNext, "Lost lines: %" PRId64 "\n", lostCollectCount_);
-    bufferNext += sprintf(bufferNext, "Index 32bit Wrap Around: %u\n", ringBuffer_->getStats().indexWrapAroundCount);
+    bufferNext += sprintf(bufferNext, "Ring laps: %" PRIu64 "\n", ringBuffer_->getStats().laps);
     bufferNext += sprintf(bufferNext, "Print Fail: %u\n", printFallCount_);
+    bufferNext += sprintf(bufferNext, "Oversize drop: %u\n", oversizeCount_);
+    bufferNext += sprintf(bufferNext, "Overrun policy: %s\n", overrunNames[overrun_]);
+    bufferNext += sprintf(bufferNext, "Overrun drop: %" PRIu64 "\n", droppedCount_);
+    bufferNext += sprintf(bufferNext, "Overrun blocked: %" PRIu64 " timeouts: %" PRIu64 " no collector: %" PRIu64
+                          "\n", blockedCount_, blockTimeoutCount_, unattendedCount_);
     bufferNext += sprintf(bufferNext, "Header pattern mismatch count: %u\n", hdrPatErr);
     bufferNext += sprintf(bufferNext, "hdr length mismatch count: %u\n", hdrLenErr);
     bufferNext += sprintf(bufferNext, "Trailer pattern mismatch count: %u\n", hdrTailErr);
     bufferNext += sprintf(bufferNext, "Buf length validation count: %u\n", fullBufLenErr);
+    bufferNext += sprintf(bufferNext, "Unknown site count: %u\n", hdrSiteErr);
+    catalog_->dumpState(bufferNext, bufferLen - (int)(bufferNext - buffer));
+    bufferNext += strlen(bufferNext);
+    bufferNext += sprintf(bufferNext, "Pending records: %" PRIu64 "\n", pendingCount_);
+    bufferNext += sprintf(bufferNext, "Abandoned records: %u\n", abandonedCount_);
     bufferNext += sprintf(bufferNext, "Get next header fail: %u\n", getNextHeaderFailCount_);
     bufferNext += sprintf(bufferNext, "Get string corrupted: %u\n", getStringCorruptedCount);
+    bufferNext += sprintf(bufferNext, "Shards: %u\n", shardCount_);
+    bufferNext += sprintf(bufferNext, "Shards claimed: %u\n", shardsClaimed_ < shardCount_ ? shardsClaimed_ : shardCount_);
+    bufferNext += sprintf(bufferNext, "Shard fallback: %u\n", shardFallbackCount_);
+    bufferNext += sprintf(bufferNext, "Ring file errno: %d\n", ringFileErrno_);
+    bufferNext += sprintf(bufferNext, "Binary: %d sites described: %u\n", binary_, describedSites_);
+    bufferNext += sprintf(bufferNext, "Binary segment offset: %" PRIu64 " records: %u last index: %" PRIu64 "\n",
+                          segment_.offset, segment_.records, lastIndex_);
+    bufferNext += sprintf(bufferNext, "Rotated files: %u fail: %u retention deletes: %u\n",
+                          rotateCount_, rotateFailCount_, retainDeleteCount_);
+    bufferNext += sprintf(bufferNext, "Writeback syncs: %u file errno: %d\n", syncCount_, fileErrno_);
+    if (formatPool_) {
+        formatPool_->dumpState(bufferNext, bufferLen - (int)(bufferNext - buffer));
+        bufferNext += strlen(bufferNext);
+    }
+    if (collectorPool_) {
+        collectorPool_->dumpState(bufferNext, bufferLen - (int)(bufferNext - buffer));
+        bufferNext += strlen(bufferNext);
+    }
+    ringBuffer_->dumpState(bufferNext, bufferLen - (int)(bufferNext - buffer));
+    bufferNext += strlen(bufferNext);
+    clock_->dumpState(bufferNext, bufferLen - (int)(bufferNext - buffer));
 
 }
 
 void Log::printState() const {
-    char state[1000];
+    char state[4096];
     dumpState(state, sizeof(state));
     printf("\n%s\n", state);
 
-    char collectorState[1000];
+    char collectorState[4096];
     collect_->dumpState(collectorState, sizeof(collectorState));
     printf("\n%s\n", collectorState);
 
@@ -575,22 +1154,255 @@ void Log::printState() const {
     printf("\n%s\n", state);
 }
 
+static Log::Options makeOptions(const char *filename, int lines, bool enableCollect, bool redirectStd) {
+    Log::Options options;
+
+    options.filename = filename;
+    options.size = lines;
+    options.enableCollect = enableCollect;
+    options.redirectStd = redirectStd;
+    return options;
+}
+
 Log::Log(const char *filename, int lines, bool enableCollect, bool redirectStd)
-        : marker_(MARKER), version_(VERSION), ringBuffer_(make_shared<RingBuffer>(lines)),
-          redirectStd_(redirectStd), stringFormat_(make_shared<StringFormat>()) {
-    strncpy(filename_, filename, sizeof(filename_));
-    fileHandle_ = createTracefile(filename, redirectStd);
-    stream_ = Stream::create(fileHandle_);
-    collect_ = make_shared<Collect>(this, enableCollect);
+        : Log(makeOptions(filename, lines, enableCollect, redirectStd)) {
+}
+
+Log::Log(const Options &options)
+        : marker_(MARKER), version_(VERSION), collectorPool_(options.collectorPool),
+          redirectStd_(options.redirectStd), globalId_(0), shardCount_(options.shards), shardsClaimed_(0),
+          shardFallbackCount_(0), collectorSleeping_(0),
+          overrun_(options.enableCollect ? options.overrun : OVERRUN_OVERWRITE),
+          blockNsec_((uint64_t) options.blockUsec * 1000), getStringCorruptedCount(0), glideCount_(0),
+          lostCollectCount_(0), printFallCount_(0), getNextHeaderFailCount_(0), lastPrintedId_(0), collectCount_(0), freopenFailedCount_(0), fwriteFailCount_(0),
+          fwriteEwouldblockCount_(0), fwriteEintrCount_(0), fwriteZeroCount_(0), fwriteErrno_(0), debugLastHeader_(),
+          debugState1_(0), debugState2_(0), debugState3_(0), fullBufLenErr(0), hdrPatErr(0), hdrLenErr(0), hdrTailErr(0),
+          hdrSiteErr(0), pendingCount_(0), abandonedCount_(0), oversizeCount_(0),
+          droppedCount_(0), blockedCount_(0), blockTimeoutCount_(0), unattendedCount_(0),
+          stringFormat_(make_shared<StringFormat>()),
+          maxStringLength_(options.maxStringLength), catalog_(&SiteCatalog::global()), clock_(make_shared<Clock>(options.clock)),
+          timeFormat_(options.timeFormat), rotation_(options.rotation), fileOpenNsec_(0), syncMark_(0), syncStart_(0), syncEnd_(0),
+          rotateCount_(0), rotateFailCount_(0), retainDeleteCount_(0), syncCount_(0), fileErrno_(0),
+          control_(nullptr), ringFileErrno_(0), binary_(options.binary), segment_(),
+          lastEntry_(0), lastIndex_(NO_SEGMENT), describedSites_(0) {
+    static uint64_t nextSerial = 0;
+    serial_ = __sync_add_and_fetch(&nextSerial, 1);
+
+    compilePrefix(options.prefix ? options.prefix : DEFAULT_PREFIX);
+    stringFormat_->setMaxStringLength(maxStringLength_);
+    strncpy(filename_, options.filename, sizeof(filename_));
+    fileHandle_ = createTracefile(options.filename, options.redirectStd);
+    if (fileHandle_) {
+        // Appended, the offsets of the binary index start at the end
+        fseeko(fileHandle_, 0, SEEK_END);
+        if (binary_) {
+            lastIndex_ = findLastIndex(fileHandle_, ftello(fileHandle_));
+        }
+    }
+    stream_ = Stream::create(fileHandle_, options.compression, options.uring);
+    if (fileHandle_) {
+        startFile();
+        enforceRetention();
+    }
+
+    std::vector<std::shared_ptr<RingBuffer>> rings;
+    if (options.ringFile) {
+        // Logs the previous session did not write out come first
+        recover(options.ringFile, stream_, binary_, &lastIndex_);
+        createFileRings(options, &rings);
+    }
+
+    if (rings.empty()) {
+        // Shard 0 is the shared ring, per-thread shards are not thread safe
+        rings.push_back(make_shared<RingBuffer>(options.size, true, options.allocation));
+        for (uint32_t s = 1; s <= shardCount_; s++) {
+            rings.push_back(make_shared<RingBuffer>(options.shardSize, false, options.allocation));
+        }
+    }
+    setRings(rings);
+
+    if (options.formatters && !binary_) {
+        formatPool_ = make_shared<FormatPool>(this, options.formatters);
+    }
+    collect_ = make_shared<Collect>(this, options.enableCollect, options.maxLatencyUsec, options.wakeWatermarkPct,
+                                    options.collectorPriority);
+}
+
+Log::Log(const std::vector<std::shared_ptr<RingBuffer>> &rings, SiteCatalog *catalog, shared_ptr<Clock> clock,
+         shared_ptr<Stream> stream, bool binary)
+        : marker_(MARKER), version_(VERSION), stream_(stream), redirectStd_(false), fileHandle_(nullptr), globalId_(0),
+          shardCount_(0), shardsClaimed_(0), shardFallbackCount_(0), serial_(0), collectorSleeping_(0),
+          overrun_(OVERRUN_OVERWRITE), blockNsec_(0), getStringCorruptedCount(0), glideCount_(0), lostCollectCount_(0),
+          printFallCount_(0), getNextHeaderFailCount_(0), lastPrintedId_(0), collectCount_(0), freopenFailedCount_(0), fwriteFailCount_(0),
+          fwriteEwouldblockCount_(0), fwriteEintrCount_(0), fwriteZeroCount_(0), fwriteErrno_(0), debugLastHeader_(),
+          debugState1_(0), debugState2_(0), debugState3_(0), fullBufLenErr(0), hdrPatErr(0), hdrLenErr(0), hdrTailErr(0),
+          hdrSiteErr(0), pendingCount_(0), abandonedCount_(0), oversizeCount_(0), droppedCount_(0), blockedCount_(0),
+          blockTimeoutCount_(0), unattendedCount_(0), stringFormat_(make_shared<StringFormat>()), maxStringLength_(0),
+          catalog_(catalog), clock_(clock),
+          timeFormat_(LOCAL_TIME), fileOpenNsec_(0), syncMark_(0), syncStart_(0), syncEnd_(0), rotateCount_(0), rotateFailCount_(0),
+          retainDeleteCount_(0), syncCount_(0), fileErrno_(0), control_(nullptr), ringFileErrno_(0), binary_(binary), segment_(),
+          lastEntry_(0), lastIndex_(NO_SEGMENT), describedSites_(0) {
+    filename_[0] = 0;
+    compilePrefix(DEFAULT_PREFIX);
+    setRings(rings);
+}
+
+void Log::setRings(const std::vector<std::shared_ptr<RingBuffer>> &rings) {
+    ringBuffer_ = rings[0];
+    shardCount_ = rings.size() - 1;
+    shards_.reset(new Shard[rings.size()]());
+    for (uint32_t s = 0; s < rings.size(); s++) {
+        shards_[s].ringBuffer = rings[s];
+        shards_[s].wakeIndex = UINT64_MAX;
+    }
+}
+
+static std::string sitesPath(const char *ringFile) {
+    return std::string(ringFile) + ".sites";
+}
+
+// The shared ring then the shards, each a control page followed by its data.
+// Return false to fall back to anonymous rings.
+bool Log::createFileRings(const Options &options, std::vector<std::shared_ptr<RingBuffer>> *rings) {
+    int fd = open(options.ringFile, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        ringFileErrno_ = errno;
+        return false;
+    }
+
+    uint64_t length = RingBuffer::fileLength(options.size) +
+                      (uint64_t) shardCount_ * RingBuffer::fileLength(options.shardSize);
+
+    // Start from a zeroed file, the previous session is recovered already
+    if (ftruncate(fd, 0) != 0 || ftruncate(fd, length) != 0) {
+        ringFileErrno_ = errno;
+        close(fd);
+        return false;
+    }
+
+    uint64_t offset = 0;
+    for (uint32_t s = 0; s <= shardCount_; s++) {
+        uint32_t size = s ? options.shardSize : options.size;
+        auto ring = RingBuffer::create(fd, offset, size, s == 0, options.allocation);
+
+        if (!ring) {
+            ringFileErrno_ = errno ? errno : EINVAL;
+            rings->clear();
+            close(fd);
+            return false;
+        }
+        rings->push_back(ring);
+        offset += RingBuffer::fileLength(size);
+    }
+    // The mappings keep the file alive
+    close(fd);
+
+    control_ = (Control *) (*rings)[0]->getUserControl();
+    control_->version = VERSION;
+    control_->shards = shardCount_;
+    control_->clockMode = clock_->getMode();
+    control_->pid = getpid();
+    saveClock();
+    __atomic_store_n(&control_->marker, MARKER, __ATOMIC_RELEASE);
+
+    sitesFile_ = sitesPath(options.ringFile);
+    catalog_->persist(sitesFile_.c_str());
+    return true;
+}
+
+void Log::saveClock() {
+    if (control_) {
+        control_->calibration = clock_->getCalibration();
+    }
+}
+
+void Log::refreshClock() {
+    if (clock_->refresh()) {
+        saveClock();
+    }
+}
+
+bool Log::recover(const char *ringFile, shared_ptr<Stream> stream, bool binary) {
+    uint64_t lastIndex = NO_SEGMENT;
+
+    return recover(ringFile, stream, binary, &lastIndex);
+}
+
+// lastIndex chains the segments of a binary stream, it is updated past the
+// recovered ones
+bool Log::recover(const char *ringFile, shared_ptr<Stream> stream, bool binary, uint64_t *lastIndex) {
+    std::vector<std::shared_ptr<RingBuffer>> rings;
+    char buf[256];
+
+    int fd = open(ringFile, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    auto ring = RingBuffer::attach(fd, 0);
+    Control *control = ring ? (Control *) ring->getUserControl() : nullptr;
+    if (!control || control->marker != MARKER || control->version != VERSION) {
+        close(fd);
+        return false;
+    }
+
+    uint64_t offset = 0;
+    while (ring) {
+        rings.push_back(ring);
+        offset += RingBuffer::fileLength(ring->size());
+        ring = rings.size() <= control->shards ? RingBuffer::attach(fd, offset) : nullptr;
+    }
+    close(fd);
+
+    if (rings.size() != control->shards + 1) {
+        return false;
+    }
+
+    bool uncollected = false;
+    for (auto &r : rings) {
+        uncollected |= r->getCurrentIndex() > r->getCollected();
+    }
+    if (!uncollected) {
+        return true;
+    }
+
+    if (stream == nullptr) {
+        stream = Stream::getStdoutStream();
+    }
+
+    SiteCatalog catalog;
+    catalog.load(sitesPath(ringFile).c_str());
+    Log reader(rings, &catalog, make_shared<Clock>((Clock::Mode) control->clockMode, control->calibration),
+               stream, binary);
+    reader.control_ = control;
+    reader.lastIndex_ = *lastIndex;
+    // The %#s pointers belong to the crashed process
+    reader.stringFormat_->setStaticStrings(StringFormat::STATIC_FOREIGN);
+
+    int length = sprintf(buf, "<<<< Recovered logs of pid: %u >>>>>\n", control->pid);
+    reader.writeNote(stream, buf, length);
+    reader.dumpRings(stream, true);
+    length = sprintf(buf, "<<<< End of recovered logs >>>>>\n");
+    reader.writeNote(stream, buf, length);
+    reader.closeSegment(stream);
+    *lastIndex = reader.lastIndex_;
+    stream->flush();
+    return true;
 }
 
 Log::~Log() {
     if (collect_) {
         collect_->setEnable(false);
     }
+    if (!sitesFile_.empty()) {
+        catalog_->unpersist(sitesFile_.c_str());
+    }
+    if (binary_) {
+        closeSegment(stream_);
+    }
     if (fileHandle_) {
-        fflush(fileHandle_);
-        fclose(fileHandle_);
+        stream_->close();
+        closeFile(fileHandle_);
         fileHandle_ = nullptr;
     }
 }
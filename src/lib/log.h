@@ -18,63 +18,317 @@ limitations under the License.
 
 #include <stdint.h>
 #include <time.h>
+#include <cstdarg>
+#include <list>
 #include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 #include <pthread.h>
 #include "ringbuffer.h"
 #include "stream.h"
 #include "stringformat.h"
+#include "staticformat.h"
+#include "site.h"
+#include "clock.h"
+
+#define LOG_MAX_LOG_TRACE_LINE 4096
+
+// Records start on 8-byte boundaries, so the pattern word never straddles the
+// end of the ring and can be published with a single store
+#define LOG_RECORD_ALIGN 8
+#define LOG_MEM_ALIGN(ret) \
+    (((ret) + (LOG_RECORD_ALIGN - 1)) & ~(uint64_t)(LOG_RECORD_ALIGN - 1))
+
+// Calls below this level are compiled out, e.g. -DMEMLOG_MIN_LEVEL=warn
+#ifndef MEMLOG_MIN_LEVEL
+#define MEMLOG_MIN_LEVEL all
+#endif
 
 namespace memlog {
-#define info(msg, ...) traceVargs(true, __func__, __LINE__, 'I', msg, ##__VA_ARGS__)
+// The arguments are only evaluated if the level is compiled in and the site
+// is enabled, e.g. MEMLOG_INFO(log, "%d\n", i) with log a Log pointer
+#define MEMLOG_LAZY(level, msg, ...) traceLazy<level>( \
+        MEMLOG_SITE(::memlog::Log::levelTag(level), level, msg), \
+        [&](::memlog::Log *memlogLog, uint32_t memlogSite) { memlogLog->traceSite(memlogSite, msg, ##__VA_ARGS__); })
+#define MEMLOG_LOG(logger, level, msg, ...) (logger)->MEMLOG_LAZY(level, msg, ##__VA_ARGS__)
+#define MEMLOG_TRACE(logger, msg, ...) MEMLOG_LOG(logger, ::memlog::Log::trace, msg, ##__VA_ARGS__)
+#define MEMLOG_DEBUG(logger, msg, ...) MEMLOG_LOG(logger, ::memlog::Log::debug, msg, ##__VA_ARGS__)
+#define MEMLOG_INFO(logger, msg, ...) MEMLOG_LOG(logger, ::memlog::Log::info, msg, ##__VA_ARGS__)
+#define MEMLOG_WARN(logger, msg, ...) MEMLOG_LOG(logger, ::memlog::Log::warn, msg, ##__VA_ARGS__)
+#define MEMLOG_ERROR(logger, msg, ...) MEMLOG_LOG(logger, ::memlog::Log::error, msg, ##__VA_ARGS__)
+#define MEMLOG_FATAL(logger, msg, ...) MEMLOG_LOG(logger, ::memlog::Log::fatal, msg, ##__VA_ARGS__)
+
+// log->info(msg, ...) and the other levels. Define MEMLOG_NO_SHORT_MACROS where
+// the short names clash with other functions, such as error() of <error.h>
+#ifndef MEMLOG_NO_SHORT_MACROS
+#define trace(msg, ...) MEMLOG_LAZY(::memlog::Log::trace, msg, ##__VA_ARGS__)
+#define debug(msg, ...) MEMLOG_LAZY(::memlog::Log::debug, msg, ##__VA_ARGS__)
+#define info(msg, ...) MEMLOG_LAZY(::memlog::Log::info, msg, ##__VA_ARGS__)
+#define warn(msg, ...) MEMLOG_LAZY(::memlog::Log::warn, msg, ##__VA_ARGS__)
+#define error(msg, ...) MEMLOG_LAZY(::memlog::Log::error, msg, ##__VA_ARGS__)
+#define fatal(msg, ...) MEMLOG_LAZY(::memlog::Log::fatal, msg, ##__VA_ARGS__)
+#endif
 
     class Log {
     public:
-        static constexpr uint32_t DEFAULT_BUFFER_SIZE = 20 * 1024 * 1024;
+        // Ring sizes are powers of two, see RingBuffer
+        static constexpr uint32_t DEFAULT_BUFFER_SIZE = 16 * 1024 * 1024;
+        static constexpr uint32_t DEFAULT_SHARD_SIZE = 2 * 1024 * 1024;
         static constexpr uint64_t MARKER = 0xaf1cfeefbeefae0dLL;
-        static constexpr uint32_t VERSION = 1;
+        static constexpr uint32_t VERSION = 2;
         static constexpr uint32_t START_PATTERN = 0xbeedface;
+        // Pattern of a record reserved but not committed yet, its low bits never
+        // match a commit pattern of an aligned location
+        static constexpr uint32_t RESERVED_PATTERN = 0xbeedfac1;
         static constexpr uint32_t END_PATTERN = 0xfadebeef;
+        // A producer waiting for room yields this many times, then sleeps
+        static constexpr uint32_t BLOCK_SPINS = 64;
+        static constexpr uint32_t BLOCK_SLEEP_USEC = 50;
+        // Ids a private shard takes from the shared counter at a time
+        static constexpr uint32_t ID_BLOCK = 64;
+        static constexpr const char *DEFAULT_PREFIX = "[%t:%i:%s] ";
 
+        // Ordered by severity, all and off are thresholds only. The values
+        // differ from version 1, where off was 0 and trace and all came last.
         enum Level {
-            off,
+            all,
+            trace,
             debug,
             info,
             warn,
             error,
             fatal,
-            trace,
-            all,
+            off,
         };
 
+        static constexpr Level MIN_LEVEL = MEMLOG_MIN_LEVEL;
+
         class Collect;
 
+        class CollectorPool;
+
+        class FormatPool;
+
+        class Cursor;
+
+        class Snapshot;
+
+        // What a producer does when its ring is full of records the collector
+        // has not written out
+        enum Overrun {
+            // Overwrite the oldest records
+            OVERRUN_OVERWRITE,
+            // Drop the new record and count it
+            OVERRUN_DROP,
+            // Wait up to blockUsec for the collector, then drop
+            OVERRUN_BLOCK,
+            // Wait for the collector as long as it takes, up to blockUsec
+            // while the collector is disabled
+            OVERRUN_LOSSLESS,
+        };
+
+        // Time stamp in the prefix of text records
+        enum TimeFormat {
+            // 2019 Mar  4 17:36:16.442382600
+            LOCAL_TIME,
+            UTC_TIME,
+            // Nanoseconds since the epoch
+            EPOCH_NSEC,
+        };
+
+        // When the collector starts a new trace file and which old ones it keeps
+        struct Rotation {
+            // Rename the file to <filename>.<YYYYmmdd-HHMMSS> and start a new
+            // one once it holds bytes or it is sec old, 0 never. Bytes of a
+            // compressed file are the compressed ones.
+            uint64_t bytes = 0;
+            uint32_t sec = 0;
+            // Reserve the blocks of each file up to bytes when it is opened,
+            // what is left unused is given back when it is closed
+            bool preallocate = true;
+            // Delete the oldest rotated files while all of them and the
+            // current one are over retainBytes, and those older than retainSec
+            uint64_t retainBytes = 0;
+            uint32_t retainSec = 0;
+            // Start the writeback of every syncBytes written, waiting for the
+            // previous ones, instead of leaving it to the page cache
+            uint32_t syncBytes = 0;
+        };
+
+        struct Options {
+            const char *filename = "rxtrace.txt";
+            // Rounded up to a power of two, as shardSize
+            uint32_t size = DEFAULT_BUFFER_SIZE;
+            bool enableCollect = true;
+            bool redirectStd = false;
+            // Per-thread rings of shardSize bytes, 0 keeps every thread on the shared ring
+            uint32_t shards = 0;
+            uint32_t shardSize = DEFAULT_SHARD_SIZE;
+            // Timestamp source, converted to wall time only when printed
+            Clock::Mode clock = Clock::DEFAULT;
+            // Huge pages, prefault and NUMA placement of the ring and the shards
+            RingBuffer::Allocation allocation;
+            // Keep the rings in this file (or /dev/shm object) so they survive a
+            // crash. Logs a previous session did not write out are recovered first.
+            const char *ringFile = nullptr;
+            // Write raw records and a site dictionary to the file instead of
+            // text, rendered later by memlog-decode
+            bool binary = false;
+            // BUFFERED_COMPRESS writes gzip members from a worker thread,
+            // BUFFERED_URING keeps several writes in flight through io_uring
+            Stream::CompressedMode compression = Stream::DEFAULT;
+            Stream::UringOptions uring;
+            // Longest a record waits in the ring before the collector writes
+            // it out. A producer wakes the collector earlier once a ring is
+            // wakeWatermarkPct full.
+            uint32_t maxLatencyUsec = 10000;
+            uint32_t wakeWatermarkPct = 50;
+            // Collect on the threads of this pool, such as
+            // CollectorPool::global(), instead of a thread of its own. A Log
+            // of higher priority is drained first when several are due.
+            std::shared_ptr<CollectorPool> collectorPool;
+            uint32_t collectorPriority = 1;
+            // Threads formatting the text records collected or dumped, 0
+            // formats them on the collector or dump() thread. The output is
+            // the same. A dump() waits for a collector pass and the other way
+            // around.
+            uint32_t formatters = 0;
+            // Policies other than overwrite need the collector enabled
+            Overrun overrun = OVERRUN_OVERWRITE;
+            uint32_t blockUsec = 1000;
+            Rotation rotation;
+            // Prefix of the text records with a time stamp: %t time, %i id,
+            // %c tag, %F function, %L line, %s tag:function:line as far as the
+            // site has them, or the record length if none, %% a percent
+            const char *prefix = DEFAULT_PREFIX;
+            TimeFormat timeFormat = LOCAL_TIME;
+            // Longest %s argument stored, a longer one is cut and ends with
+            // StringFormat::TRUNCATION_MARK. 0 stores what the record holds.
+            // %#s stores only the pointer, for strings that outlive the log.
+            uint32_t maxStringLength = 0;
+        };
+
         typedef uint32_t Marker;
 
+        enum RecordState {
+            RECORD_VALID,
+            RECORD_PENDING,
+            RECORD_INVALID,
+        };
+
         struct Trailer {
             uint32_t id;
             uint32_t pattern;
         };
 
+        // Format, function, line and tag live in the SiteCatalog entry
         struct Header {
             Log::Marker pattern;
-            uint32_t location; // optional
-            uint32_t id; // optional
-            const char *format;
-            const char *functionName;
-            uint16_t lineNumber;
-            uint16_t length; // optional
-            char tag;
-            char unused[3];
-            struct timespec timestamp;
+            uint32_t id;
+            uint32_t site;
+            uint16_t length;
+            uint16_t unused;
+            uint64_t timestamp; // raw Clock value, 0 if not stamped
             char stack[0];
         };
 
         void traceVargs(bool withTs, const char *functionName, uint32_t lineNumber, char tag, const char *format, ...);
 
-        uint32_t dumpRange(uint32_t start, uint32_t end, bool continueOnFailure, std::shared_ptr<Stream> stream);
+        // site is an id from SiteCatalog::global(). A format other than the one
+        // of the site is recorded under a site of its own.
+        void traceSite(uint32_t site, const char *format, ...);
+
+        // Compile-time parsed alternative to traceVargs, format must come from FMT()
+        template<Level level, typename Literal, typename... Args>
+        void log(StaticFormat::Format<Literal> format, const Args &... args);
+
+        // Expansion of the level macros, emit is called only if the site is enabled
+        template<Level level, typename Resolve, typename Emit>
+        inline void traceLazy(Resolve resolve, Emit emit) {
+            if constexpr (level >= MIN_LEVEL) {
+                const Site *site = resolve();
+                if (__builtin_expect(__atomic_load_n(&site->enabled, __ATOMIC_RELAXED), 1)) {
+                    emit(this, site->id);
+                }
+            }
+        }
+
+        // Runtime switches, sites are process wide so they apply to every Log
+        void setLevel(Level level);
+
+        void setFunctionEnabled(const char *functionName, bool enable);
+
+        void setSiteEnabled(uint32_t site, bool enable);
+
+        static constexpr char levelTag(Level level) {
+            switch (level) {
+                case debug:
+                    return 'D';
+                case info:
+                    return 'I';
+                case warn:
+                    return 'W';
+                case error:
+                    return 'E';
+                case fatal:
+                    return 'F';
+                case trace:
+                    return 'T';
+                default:
+                    return '-';
+            }
+        }
+
+        static constexpr Level tagLevel(char tag) {
+            switch (tag) {
+                case 'T':
+                    return trace;
+                case 'D':
+                    return debug;
+                case 'W':
+                    return warn;
+                case 'E':
+                    return error;
+                case 'F':
+                    return fatal;
+                default:
+                    return info;
+            }
+        }
+
+        // A collecting caller stops at the first record not committed yet
+        uint64_t dumpRange(uint64_t start, uint64_t end, bool collecting, std::shared_ptr<Stream> stream);
 
         void dump(std::shared_ptr<Stream> stream = nullptr, bool detail = false);
 
+        // Print the logs left in ringFile by a previous session that the
+        // collector did not write out, as binary frames if binary. Return false if
+        // there is no valid session.
+        static bool recover(const char *ringFile, std::shared_ptr<Stream> stream = nullptr, bool binary = false);
+
+        // Render a file written in binary mode as text. Return false if it is
+        // not one or it is truncated.
+        static bool decode(FILE *file, std::shared_ptr<Stream> stream = nullptr);
+
+        // Records of a binary file to decode, timestamps in wall clock
+        // nanoseconds, ids and sites of the writing process
+        struct Range {
+            uint64_t fromNsec = 0;
+            uint64_t toNsec = UINT64_MAX;
+            uint32_t fromId = 0;
+            uint32_t toId = UINT32_MAX;
+            // Any site if INVALID_ID
+            uint32_t site = SiteCatalog::INVALID_ID;
+        };
+
+        // Decode only the records in range, seeking with the segment indexes.
+        // file must be seekable.
+        static bool decode(FILE *file, const Range &range, std::shared_ptr<Stream> stream = nullptr);
+
+        // Print the summary of every segment of a binary file
+        static bool listSegments(FILE *file, std::shared_ptr<Stream> stream = nullptr);
+
         void dumpState(char *buffer, int bufferLen) const;
 
         void printState() const;
@@ -84,19 +338,60 @@ namespace memlog {
             bool enableCollect = true,
             bool redirectStd = false);
 
+        explicit Log(const Options &options);
+
         ~Log();
 
     private:
         uint64_t marker_;
         uint32_t version_;
         std::shared_ptr<Collect> collect_;
+        std::shared_ptr<CollectorPool> collectorPool_;
+        std::shared_ptr<FormatPool> formatPool_;
         std::shared_ptr<RingBuffer> ringBuffer_;
         std::shared_ptr<Stream> stream_;
         bool redirectStd_;
         FILE *fileHandle_;
         char filename_[1000];
         uint32_t globalId_;
-        uint32_t bufLastWrittenIndex_;
+
+        struct Shard {
+            std::shared_ptr<RingBuffer> ringBuffer;
+            // A record committed at or past this index wakes the collector
+            uint64_t wakeIndex;
+            // Private shards only, ids taken from globalId_ and not used yet
+            uint32_t nextId;
+            uint32_t idLimit;
+        };
+
+        // Slot of a record between reserve() and commit()
+        struct Reservation {
+            Shard *shard;
+            RingBuffer *ring;
+            RingBuffer::Location location;
+            uint32_t id;
+        };
+
+        struct MergeCursor {
+            RingBuffer *ring;
+            uint64_t index;
+            uint64_t end;
+            bool ready;
+            // Collecting only, stopped at a record not committed yet
+            bool blocked;
+            Header hdr;
+        };
+
+        std::unique_ptr<Shard[]> shards_;
+        uint32_t shardCount_;
+        uint32_t shardsClaimed_;
+        uint32_t shardFallbackCount_;
+        uint64_t serial_;
+        // Futex word, 1 while the collector sleeps. A pooled collector
+        // wakes the pool instead.
+        uint32_t collectorSleeping_;
+        Overrun overrun_;
+        uint64_t blockNsec_;
 
         // Counters for debugging
         uint32_t getStringCorruptedCount;
@@ -122,51 +417,327 @@ namespace memlog {
         uint32_t hdrPatErr;
         uint32_t hdrLenErr;
         uint32_t hdrTailErr;
-        uint32_t debugIndex_;
+        uint32_t hdrSiteErr;
+        uint64_t pendingCount_;
+        uint32_t abandonedCount_;
+        uint32_t oversizeCount_;
+        uint64_t droppedCount_;
+        uint64_t blockedCount_;
+        uint64_t blockTimeoutCount_;
+        // Waits cut to blockUsec because no collector was running
+        uint64_t unattendedCount_;
+        uint64_t debugIndex_;
         Log::Trailer debugTrailer_;
         Header debugHdr_;
 
         std::shared_ptr<StringFormat> stringFormat_;
+        uint32_t maxStringLength_;
+        SiteCatalog *catalog_;
+        std::shared_ptr<Clock> clock_;
+
+        // Literal text, then a field of the prefix unless 0
+        struct PrefixStep {
+            std::string literal;
+            char field;
+        };
+        std::vector<PrefixStep> prefix_;
+        TimeFormat timeFormat_;
+
+        // Kept in the user control of the first ring in the ring file
+        struct Control {
+            uint64_t marker;
+            uint32_t version;
+            uint32_t shards;
+            uint32_t clockMode;
+            uint32_t pid;
+            Clock::Calibration calibration;
+        };
+        static_assert(sizeof(Control) <= RingBuffer::USER_CONTROL_SIZE, "Log control does not fit");
+
+        Rotation rotation_;
+        uint64_t fileOpenNsec_;
+        // Stream offset at the last writeback, and the file range started then
+        uint64_t syncMark_;
+        uint64_t syncStart_;
+        uint64_t syncEnd_;
+        uint32_t rotateCount_;
+        uint32_t rotateFailCount_;
+        uint32_t retainDeleteCount_;
+        uint32_t syncCount_;
+        int fileErrno_;
+
+        // NULL unless the rings are in a file
+        Control *control_;
+        int ringFileErrno_;
+        // Sites the records of the ring file refer to, written while this lives
+        std::string sitesFile_;
+
+        // Binary file layout: frames of a type and a payload length. A session
+        // starts with FRAME_SESSION, each site is described before its first record.
+        static constexpr uint64_t BINARY_MAGIC = 0x0a31474f4c4d454dLL;
+        static constexpr uint32_t BINARY_VERSION = 1;
+
+        enum FrameType : uint16_t {
+            FRAME_SESSION = 1,
+            FRAME_SITE,
+            // Header with the timestamp in wall clock nanoseconds, then the arguments
+            FRAME_RECORD,
+            // Text of the collector, such as discarded logs
+            FRAME_NOTE,
+            // Closes a segment, see SegmentIndex
+            FRAME_INDEX,
+        };
+
+        struct Frame {
+            uint16_t type;
+            uint16_t length;
+        };
+
+        struct SessionFrame {
+            uint64_t magic;
+            uint32_t version;
+            uint32_t headerSize;
+            uint32_t pid;
+            uint32_t unused;
+        };
+
+        // Followed by the function name and the format, not terminated
+        struct SiteFrame {
+            uint32_t id;
+            uint32_t lineNumber;
+            uint16_t functionLength;
+            uint16_t formatLength;
+            char tag;
+            uint8_t level;
+            uint16_t unused;
+        };
+
+        // The binary stream is cut in segments of about SEGMENT_SIZE bytes.
+        // Each starts with its own session frame and site descriptions, so it
+        // decodes on its own, and ends with an index frame: the segment
+        // summary, an entry every INDEX_INTERVAL bytes and an IndexTail, so
+        // the last index is found from the end of the file.
+        static constexpr uint32_t SEGMENT_SIZE = 1024 * 1024;
+        static constexpr uint32_t INDEX_INTERVAL = 64 * 1024;
+        static constexpr uint32_t MAX_INDEX_ENTRIES = SEGMENT_SIZE / INDEX_INTERVAL + 1;
+        static constexpr uint32_t INDEX_MAGIC = 0x5844494d;
+        static constexpr uint64_t NO_SEGMENT = UINT64_MAX;
+        // How far back from the end of a file an index is looked for
+        static constexpr uint32_t INDEX_SEARCH_LIMIT = 4 * SEGMENT_SIZE;
+
+        struct SegmentIndex {
+            // Session frame of the segment
+            uint64_t offset;
+            // Index frame of the previous segment, NO_SEGMENT if none
+            uint64_t previous;
+            uint64_t minTimestamp;
+            uint64_t maxTimestamp;
+            uint32_t minId;
+            uint32_t maxId;
+            uint32_t records;
+            uint32_t entries;
+            // Site ids present, modulo 256
+            uint64_t siteMask[4];
+        };
+
+        // Maxima of the records of the segment before offset
+        struct IndexEntry {
+            uint64_t offset;
+            uint64_t maxTimestamp;
+            uint32_t maxId;
+            uint32_t unused;
+        };
+
+        struct IndexTail {
+            // Of the whole index frame
+            uint32_t length;
+            uint32_t magic;
+        };
+
+        struct Span;
+        struct Decoder;
+
+        bool binary_;
+        SegmentIndex segment_;
+        std::vector<IndexEntry> entries_;
+        uint64_t lastEntry_;
+        uint64_t lastIndex_;
+        // Sites below this id are described in the binary stream, 0 before the session frame
+        uint32_t describedSites_;
+
+        // Reader over the rings of a previous session
+        Log(const std::vector<std::shared_ptr<RingBuffer>> &rings, SiteCatalog *catalog,
+            std::shared_ptr<Clock> clock, std::shared_ptr<Stream> stream = nullptr, bool binary = false);
+
+        bool createFileRings(const Options &options, std::vector<std::shared_ptr<RingBuffer>> *rings);
+
+        void setRings(const std::vector<std::shared_ptr<RingBuffer>> &rings);
+
+        void saveClock();
+
+        // Keep the raw clock to wall time mapping fresh, also without a collector
+        void refreshClock();
+
+        uint64_t dumpRings(std::shared_ptr<Stream> stream, bool uncollected);
 
         char *getTraceFilename() const;
 
         FILE *createTracefile(const char *filename, bool redirStd);
 
-        uint32_t getLastWrittenIndex();
-
         std::shared_ptr<Stream> getStream() { return stream_; }
 
-        uint32_t allocateId();
+        // Rotation, writeback and retention, on the collector thread
+        void maintainFile();
+
+        bool rotate();
+
+        void startFile();
+
+        void closeFile(FILE *file);
+
+        void paceWriteback();
+
+        void enforceRetention();
+
+        uint32_t allocateId(Shard *shard);
+
+        void encodeVargs(uint32_t site, bool withTs, const char *format, va_list va);
 
-        void setLastWrittenIndex(uint32_t index);
+        void encodeStaged(const Reservation &reservation, uint32_t site, bool withTs, const char *format,
+                          va_list va);
 
-        uint32_t setHeader(char *dst, const char *function_name, uint16_t lineNumber,
-                           char tag, const char *s, bool withTs,
+        void encodeTruncated(uint32_t site, bool withTs, const char *format, va_list va,
+                             const StringFormat::StringRoom &strings, uint32_t length);
+
+        char *reserve(uint32_t length, Reservation *reservation);
+
+        bool reserveBounded(RingBuffer *ring, uint32_t length, RingBuffer::Location *location);
+
+        uint32_t seal(char *record, char *dst, uint32_t site, bool withTs, uint32_t id);
+
+        void commit(const Reservation &reservation);
+
+        void wakeCollector();
+
+        void stage(const Reservation &reservation, char *buffer, char *dst, uint32_t site, bool withTs);
+
+        void publish(char *buffer, char *dst, uint32_t site, bool withTs);
+
+        Shard *getShard();
+
+        template<typename Literal, size_t... I, typename... Args>
+        static char *encodeArgs(char *dst, char *end, uint32_t limit, std::index_sequence<I...>, const Args &... args);
+
+        template<typename Literal, size_t... I, typename... Args>
+        static uint32_t sizeArgs(uint32_t limit, std::index_sequence<I...>, const Args &... args);
+
+        template<typename Literal, typename... Args>
+        void logStaged(uint32_t site, const Reservation *reservation, const Args &... args);
+
+        uint32_t setHeader(char *dst, uint32_t site, bool withTs,
                            uint16_t length, // optional
-                           uint32_t location, // optional
                            uint32_t id // optional
         );
 
 
         uint32_t indexInc(uint32_t index, uint32_t v);
 
-        bool getLog(uint32_t index, char *buf);
+        static inline uint32_t commitPattern(uint64_t index) { return START_PATTERN ^ (uint32_t) index; }
+
+        bool isOverwritten(RingBuffer *ring, uint64_t index);
+
+        // Check of a record that failed, counted by getLog()
+        enum RecordFault {
+            FAULT_NONE,
+            FAULT_PATTERN,
+            FAULT_LENGTH,
+            FAULT_SITE,
+            FAULT_COPY,
+            FAULT_TRAILER,
+        };
+
+        RecordState getLog(RingBuffer *ring, uint64_t index, char *buf, const char **record = nullptr);
+
+        RecordState readLog(RingBuffer *ring, uint64_t index, char *buf, const char **record = nullptr,
+                            RecordFault *fault = nullptr);
 
-        bool isEntryValid(uint32_t index, char *buf);
+        bool isEntryValid(RingBuffer *ring, uint64_t index, char *buf);
 
-        uint32_t getNextHeader(uint32_t index, char *buf);
+        uint64_t getNextHeader(RingBuffer *ring, uint64_t index, uint64_t end, char *buf);
 
-        uint32_t getNextHeaderIndex(uint32_t index);
+        uint64_t getNextHeaderIndex(RingBuffer *ring, uint64_t index, uint64_t end);
+
+        uint64_t findNextHeader(RingBuffer *ring, uint64_t index, uint64_t end, char *buf);
 
         int cmpHeader(Header *entry1, Header *entry2);
 
-        int printAtIndex(uint32_t index, char *dst, uint32_t *next_index,
-                         bool retry,
+        int printAtIndex(RingBuffer *ring, uint64_t index, char *dst, uint64_t *next_index,
                          Header *printed_header, int *string_length);
 
-        unsigned int firstLine(void);
+        int formatRecord(Header *hdr, uint8_t *record, char *dst, int *stringLength);
+
+        inline bool isBinary(const std::shared_ptr<Stream> &stream) const { return binary_ && stream == stream_; }
+
+        // Text records go through the format pool, within a stagePass()
+        inline bool isStaged(const std::shared_ptr<Stream> &stream) const {
+            return formatPool_ && !isBinary(stream);
+        }
+
+        std::unique_lock<std::mutex> stagePass(const std::shared_ptr<Stream> &stream);
+
+        int formatAtIndex(RingBuffer *ring, uint64_t index, char *dst, uint64_t *nextIndex,
+                          Header *printedHeader, int *length, const std::shared_ptr<Stream> &stream);
+
+        int encodeAtIndex(RingBuffer *ring, uint64_t index, char *dst, uint64_t *nextIndex,
+                          Header *printedHeader, int *length, const std::shared_ptr<Stream> &stream);
+
+        int stageAtIndex(RingBuffer *ring, uint64_t index, char *dst, uint64_t *nextIndex,
+                         Header *printedHeader, int *length);
+
+        void describe(uint32_t site, const std::shared_ptr<Stream> &stream);
+
+        void writeFrame(const std::shared_ptr<Stream> &stream, FrameType type, const void *payload, uint32_t length);
+
+        void writeNote(const std::shared_ptr<Stream> &stream, char *text, int length);
+
+        void writeRecord(const std::shared_ptr<Stream> &stream, char *buf, int length);
+
+        void indexRecord(const Header &hdr);
+
+        void closeSegment(const std::shared_ptr<Stream> &stream);
 
-        uint32_t getTime(struct timespec *ts, char *ts_buf, unsigned int ts_buf_size);
+        static bool recover(const char *ringFile, std::shared_ptr<Stream> stream, bool binary, uint64_t *lastIndex);
+
+        static bool readIndex(FILE *file, uint64_t offset, Span *span);
+
+        static uint64_t findLastIndex(FILE *file, uint64_t end);
+
+        static bool readSpans(FILE *file, std::vector<Span> *spans);
+
+        static bool matches(const SegmentIndex &index, const Range &range);
+
+        static bool decodeFrames(Decoder *decoder, uint64_t end, bool records);
+
+        uint64_t firstLine(RingBuffer *ring);
+
+        uint64_t findFirstLine(RingBuffer *ring, char *buf);
+
+        uint64_t dumpRange(RingBuffer *ring, uint64_t start, uint64_t end, bool collecting,
+                           std::shared_ptr<Stream> stream);
+
+        uint64_t skipAbandoned(RingBuffer *ring, uint64_t index, std::shared_ptr<Stream> stream);
+
+        int writeDiscarded(uint64_t newIndex, Header *hdr, Header *printedHeader, char *traceBuffer);
+
+        bool peekShard(MergeCursor *cursor, bool collecting, Header *printedHeader, std::shared_ptr<Stream> stream);
+
+        void dumpShards(uint64_t *starts, const uint64_t *ends, bool collecting, std::shared_ptr<Stream> stream);
+
+        void compilePrefix(const char *prefix);
+
+        char *formatPrefix(const Header *hdr, const Site *site, char *dst);
+
+        char *formatTime(uint64_t timestamp, char *dst);
 
 
     };
@@ -174,12 +745,10 @@ namespace memlog {
     class Log::Collect {
     public:
         static constexpr int DEFAULT_BUFFER_THRESHOLD_PCT = 0;
-        // Sleep time is 100ms
-        static constexpr int SLEEP_USEC = 100000;
-        // Spin sleep time is 10ms
-        static constexpr int SPIN_USEC = 100000;
-        static constexpr int SPINS = 10;
-        static constexpr int FLUSH_IN_SEC = 10;
+        // Longest sleep of the backoff while every ring is empty
+        static constexpr int MAX_IDLE_USEC = 1000000;
+        // How long a record may stay reserved before the collector skips it
+        static constexpr uint64_t ABANDON_NSEC = 1000000000ULL;
 
         bool getEnable() const;
 
@@ -187,39 +756,420 @@ namespace memlog {
 
         void resetBookmark();
 
-        uint32_t collect();
+        // Return the number of bytes consumed
+        uint64_t collect();
+
+        // One pass without sleeping, woken if a producer ended the last
+        // sleep. Return how long the collector may sleep, 0 none.
+        uint32_t step(bool woken);
+
+        // Mark the collector asleep until a producer wakes it. Return false
+        // if a record crossed a watermark already, the collector is woken.
+        bool park();
+
+        bool woken() const;
+
+        // End of the sleep, return true if a producer ended it
+        bool unpark();
+
+        // Share of the rings not collected yet
+        uint32_t occupancyPct();
+
+        uint32_t getMaxLatencyUsec() const;
 
         void dumpState(char *buffer, int bufferLen) const;
 
-        Collect(Log *log, bool enable = false);
+        Collect(Log *log, bool enable = false, uint32_t maxLatencyUsec = 10000, uint32_t wakeWatermarkPct = 50,
+                uint32_t priority = 1);
 
         ~Collect();
 
     private:
         Log *log_;
         pthread_t collectorThread_;
-        uint32_t collectorBookmark_;
+        uint64_t collectorBookmark_;
         uint32_t bufferThresholdPct_;
-        uint32_t prevCollectRangeStart_;
-        uint32_t prevCollectRangeEnd_;
+        // Shard mode only, entry 0 mirrors collectorBookmark_
+        std::vector<uint64_t> shardBookmarks_;
+        uint64_t prevCollectRangeStart_;
+        uint64_t prevCollectRangeEnd_;
+
+        // Record a ring is blocked on, and since when
+        struct Stall {
+            uint64_t index;
+            uint64_t sinceNsec;
+        };
+        std::vector<Stall> stalls_;
 
         bool enable_;
-        unsigned int streamLastFlush_;
-        unsigned int lastFlushCounter_;
+        uint32_t maxLatencyUsec_;
+        uint32_t wakeWatermarkPct_;
+        uint32_t priority_;
+        // The last sleep waited for the first record
+        bool quiet_;
+        // Current sleep of the idle backoff
+        uint32_t idleUsec_;
+        // Collected since the stream was last flushed
+        bool unflushed_;
+        uint64_t producerWakeups_;
+        uint64_t timeoutWakeups_;
 
         uint32_t getBufferThreshold();
 
-        void idle();
+        uint64_t pending();
+
+        void arm(uint32_t watermarkPct);
+
+        bool wait(uint32_t usec);
+
+        uint32_t idle();
 
         void setBufferThresholdPct(uint32_t value);
 
         bool shallCollect();
 
+        uint64_t collectShards();
+
+        uint64_t checkStall(uint32_t shard, uint64_t index, uint64_t end);
+
+        void markCollected();
+
+        void release();
+
         void workerThread();
 
         void flush(void);
 
         static void *executeWorkerThread(void *ctx);
     };
+
+    // Collector threads shared by the Logs registered with the pool. Each
+    // pass of a thread collects one due Log, no other thread collects it
+    // meanwhile. A Log overdue by more than its latency bound goes first,
+    // the earliest due, otherwise the one of highest priority x occupancy.
+    class Log::CollectorPool {
+    public:
+        static constexpr uint32_t DEFAULT_THREADS = 2;
+        // Longest sleep of a thread with nothing due
+        static constexpr uint64_t MAX_SLEEP_NSEC = 1000000000ULL;
+
+        // Process wide pool of DEFAULT_THREADS, created on first use and
+        // released with the last Log using it
+        static std::shared_ptr<CollectorPool> global();
+
+        void add(Collect *collect, uint32_t priority);
+
+        // Waits for a pass collecting it to end
+        void remove(Collect *collect);
+
+        // A producer woke a parked collector
+        void wake();
+
+        void dumpState(char *buffer, int bufferLen) const;
+
+        explicit CollectorPool(uint32_t threads = DEFAULT_THREADS);
+
+        ~CollectorPool();
+
+    private:
+        struct Entry {
+            Collect *collect;
+            uint32_t priority;
+            uint64_t dueNsec;
+            bool busy;
+        };
+
+        mutable std::mutex mutex_;
+        std::condition_variable idleCond_;
+        std::list<Entry> entries_;
+        std::vector<std::thread> threads_;
+        // Futex word, bumped by each wakeup
+        uint32_t sequence_;
+        bool stop_;
+        uint64_t passCount_;
+        uint64_t overdueCount_;
+        uint64_t wakeCount_;
+
+        Entry *pick(uint64_t now, uint64_t *sleepNsec);
+
+        void workerThread();
+    };
+
+    // The collector copies the records of a pass into chunks, formatter
+    // threads turn each chunk into text, and the chunks are written to the
+    // stream in the order they were filled
+    class Log::FormatPool {
+    public:
+        static constexpr uint32_t CHUNK_SIZE = 256 * 1024;
+
+        // A copy of a record, header to trailer
+        void addRecord(const char *record, int length);
+
+        // Text between records, such as a note on discarded records
+        void addNote(const char *text, int length);
+
+        // Stage for stream until the returned lock is released, one pass at
+        // a time. The pass drains before it releases it.
+        std::unique_lock<std::mutex> begin(const std::shared_ptr<Stream> &stream);
+
+        // Write out every chunk to the stream of the pass, waiting for the formatters
+        void drain();
+
+        void dumpState(char *buffer, int bufferLen) const;
+
+        FormatPool(Log *log, uint32_t threads);
+
+        ~FormatPool();
+
+    private:
+        enum ItemType : uint32_t {
+            ITEM_RECORD,
+            ITEM_NOTE,
+        };
+
+        struct Item {
+            ItemType type;
+            uint32_t length;
+        };
+
+        struct Chunk {
+            std::vector<char> staged;
+            uint32_t stagedLength;
+            std::vector<char> output;
+            uint32_t outputLength;
+            uint32_t failures;
+            bool done;
+        };
+
+        Log *log_;
+        std::mutex passMutex_;
+        Stream *stream_;
+        std::mutex mutex_;
+        std::condition_variable cond_;
+        // Filled, in order, and the ones waiting for a formatter
+        std::deque<Chunk *> chunks_;
+        std::deque<Chunk *> queue_;
+        std::vector<std::unique_ptr<Chunk>> all_;
+        std::vector<Chunk *> free_;
+        Chunk *current_;
+        std::vector<std::thread> threads_;
+        bool stop_;
+        uint64_t chunkCount_;
+        uint64_t waitCount_;
+        uint64_t formatFailCount_;
+
+        void add(ItemType type, const char *data, int length);
+
+        void submit();
+
+        void write(std::unique_lock<std::mutex> &lock, bool all);
+
+        void format(Chunk *chunk);
+
+        void workerThread();
+    };
+
+    // Reads the records still in the rings without formatting them, merged
+    // across the shards by timestamp. The query is tested on the header of
+    // each record before any argument is decoded. Records committed after the
+    // cursor was created are not returned.
+    class Log::Cursor {
+    public:
+        // Rings read backwards in windows of this many bytes
+        static constexpr uint32_t WINDOW_SIZE = 64 * 1024;
+
+        enum Order {
+            NEWEST_FIRST,
+            OLDEST_FIRST,
+        };
+
+        struct Query {
+            Order order = NEWEST_FIRST;
+            // Sites of at least level, and of tag and functionName if set
+            Level level = all;
+            char tag = 0;
+            const char *functionName = nullptr;
+            uint32_t fromId = 0;
+            uint32_t toId = UINT32_MAX;
+            // Wall clock nanoseconds
+            uint64_t fromNsec = 0;
+            uint64_t toNsec = UINT64_MAX;
+            // Only the newest last records, in order. 0 for all of them.
+            uint32_t last = 0;
+        };
+
+        // A record in place in the ring, or in the cursor if the ring is not
+        // mapped twice. Valid until the next call to next().
+        struct Record {
+            const Header *header;
+            const Site *site;
+            // Wall clock nanoseconds, 0 if not stamped
+            uint64_t nsec;
+            // Encoded arguments of site->format
+            const uint8_t *args;
+            uint32_t argsLength;
+        };
+
+        // Return false once every record of the query was returned
+        bool next(Record *record);
+
+        // Whether the last record returned was not overwritten since, to
+        // check after reading it in place
+        bool intact() const;
+
+        // Text of record as in the trace file. dst holds 2 * LOG_MAX_LOG_TRACE_LINE
+        // bytes. Return the length, -1 if the record is corrupted.
+        int format(const Record &record, char *dst) const;
+
+        Cursor(Log *log, const Query &query);
+
+    private:
+        // Position of one ring in [begin, end). Newest first, the matching
+        // records of the window below windowStart are read forward and
+        // returned from the back.
+        struct RingCursor {
+            RingBuffer *ring;
+            uint64_t begin;
+            uint64_t index;
+            uint64_t end;
+            uint64_t windowStart;
+            std::vector<uint64_t> window;
+            bool ready;
+            Header hdr = {};
+        };
+
+        // Verdict of the site part of the query, by site id
+        enum Match : uint8_t {
+            MATCH_UNKNOWN,
+            MATCH_YES,
+            MATCH_NO,
+        };
+
+        Log *log_;
+        Query query_;
+        std::vector<RingCursor> rings_;
+        std::vector<Match> sites_;
+        // Oldest first with last, the positions found newest first
+        std::vector<std::pair<RingBuffer *, uint64_t>> collected_;
+        bool reversed_;
+        uint32_t returned_;
+        RingBuffer *lastRing_;
+        uint64_t lastIndex_;
+        bool lastInPlace_;
+        char buffer_[LOG_MAX_LOG_TRACE_LINE * 2];
+
+        bool matches(const Header &hdr);
+
+        bool peekForward(RingCursor *cursor);
+
+        bool peekBackward(RingCursor *cursor);
+
+        void readWindow(RingCursor *cursor);
+
+        bool advance(RingBuffer **ring, uint64_t *index);
+
+        bool load(RingBuffer *ring, uint64_t index, Record *record);
+    };
+
+    // Copy of the rings taken without stopping the producers: a bulk copy of
+    // each ring, then the records near the head the collector had not seen
+    // committed are copied again one by one. The copy ends before the first
+    // record not committed yet, and is written out or queried at leisure.
+    class Log::Snapshot {
+    public:
+        // Copies of a ring tried while producers overwrite its oldest records
+        static constexpr uint32_t ATTEMPTS = 3;
+
+        // Write the records as the trace file has them, binary frames if binary
+        void write(std::shared_ptr<Stream> stream, bool binary = false);
+
+        // Reader over the copy, for a Cursor
+        inline Log *log() { return reader_.get(); }
+
+        // Bytes copied from the rings
+        inline uint64_t size() const { return size_; }
+
+        // Only the newest bytes of each ring if not 0
+        explicit Snapshot(Log *log, uint32_t bytes = 0);
+
+    private:
+        std::vector<std::shared_ptr<RingBuffer>> rings_;
+        std::unique_ptr<Log> reader_;
+        uint64_t size_;
+
+        uint64_t copyRing(Log *log, RingBuffer *source, RingBuffer *copy, uint32_t bytes, bool *lapped);
+    };
+
+    template<typename Literal, size_t... I, typename... Args>
+    char *Log::encodeArgs(char *dst, char *end, uint32_t limit, std::index_sequence<I...>, const Args &... args) {
+        constexpr StaticFormat::Spec spec = StaticFormat::parse(Literal::str());
+        static_assert(!spec.overflow, "Too many conversions in format");
+        static_assert(spec.count == sizeof...(Args), "Argument count does not match the format");
+        static_assert((StaticFormat::accepts<Args>(spec.kinds[I]) && ...),
+                      "Argument type does not match its conversion");
+
+        ((dst = StaticFormat::encode<spec.kinds[I]>(dst, end, limit, args)), ...);
+        return dst;
+    }
+
+    template<typename Literal, size_t... I, typename... Args>
+    uint32_t Log::sizeArgs(uint32_t limit, std::index_sequence<I...>, const Args &... args) {
+        constexpr StaticFormat::Spec spec = StaticFormat::parse(Literal::str());
+        return (0 + ... + StaticFormat::size<spec.kinds[I]>(args, limit));
+    }
+
+    // Encode in a buffer, for a slot that wraps around the end of the ring, or
+    // for a record that needs its strings truncated (reservation is NULL)
+    template<typename Literal, typename... Args>
+    __attribute__((noinline))
+    void Log::logStaged(uint32_t site, const Reservation *reservation, const Args &... args) {
+        char buffer[LOG_MAX_LOG_TRACE_LINE + 1];
+        char *dst = buffer + sizeof(Log::Header);
+
+        dst = encodeArgs<Literal>(dst, buffer + LOG_MAX_LOG_TRACE_LINE - sizeof(Log::Trailer), maxStringLength_,
+                                  std::index_sequence_for<Args...>{}, args...);
+        if (reservation) {
+            stage(*reservation, buffer, dst, site, true);
+        } else {
+            publish(buffer, dst, site, true);
+        }
+    }
+
+    template<Log::Level level, typename Literal, typename... Args>
+    void Log::log(StaticFormat::Format<Literal> format, const Args &... args) {
+        if constexpr (level < MIN_LEVEL) {
+            return;
+        }
+
+        static const Site *descriptor = SiteCatalog::global().addSite(format.str(), format.functionName,
+                                                                      format.lineNumber, levelTag(level), level);
+        if (!__atomic_load_n(&descriptor->enabled, __ATOMIC_RELAXED)) {
+            return;
+        }
+
+        const uint32_t site = descriptor->id;
+        uint32_t length = sizeof(Log::Header) +
+                          sizeArgs<Literal>(maxStringLength_, std::index_sequence_for<Args...>{}, args...) +
+                          sizeof(Log::Trailer);
+        Reservation reservation;
+
+        if (length > LOG_MAX_LOG_TRACE_LINE) {
+            logStaged<Literal>(site, nullptr, args...);
+            return;
+        }
+
+        char *record = reserve(length, &reservation);
+        if (!record) {
+            if (reservation.ring) {
+                logStaged<Literal>(site, &reservation, args...);
+            }
+            return;
+        }
+
+        char *dst = encodeArgs<Literal>(record + sizeof(Log::Header), record + length - sizeof(Log::Trailer),
+                                        maxStringLength_, std::index_sequence_for<Args...>{}, args...);
+        seal(record, dst, site, true, reservation.id);
+        commit(reservation);
+    }
 }
 #endif
@@ -17,163 +17,502 @@ limitations under the License.
 //
 // RingBuffer class
 //
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
 #include <cstring>
+#include <new>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include "ringbuffer.h"
 
 using namespace memlog;
 
-RingBuffer::RingBuffer(unsigned int size, bool threadSafe)
-        : size_(size), buffer_(new uint8_t[size]()), marker_(MARKER), version_(VERSION), threadSafe_(threadSafe) {
+#define RING_MPOL_BIND 2
+
+static uint32_t roundUpPowerOfTwo(uint32_t size) {
+    uint32_t power = RingBuffer::MIN_SIZE;
+
+    while (power < size && power < 0x80000000u) {
+        power <<= 1;
+    }
+    return power;
+}
+
+RingBuffer::RingBuffer(unsigned int size, bool threadSafe) : RingBuffer(size, threadSafe, Allocation()) {
+}
+
+RingBuffer::RingBuffer(unsigned int size, bool threadSafe, const Allocation &allocation)
+        : marker_(MARKER), version_(VERSION), buffer_(nullptr), size_(roundUpPowerOfTwo(size)),
+          mask_(size_ - 1), control_(&localControl_), localControl_(), threadSafe_(threadSafe), mapped_(false),
+          hugePages_(HUGE_PAGES_NONE), prefaulted_(false), locked_(false), lockErrno_(0),
+          numaNode_(NUMA_ANY), numaErrno_(0), released_(0) {
+    localControl_.marker = MARKER;
+    localControl_.version = VERSION;
+    localControl_.size = size_;
+    if (size_ < MIN_MAPPED_SIZE || !map(allocation)) {
+        allocatePlain(allocation);
+    }
+    place(allocation);
+}
+
+RingBuffer::RingBuffer(unsigned int size, bool threadSafe, int fd, uint64_t offset)
+        : marker_(MARKER), version_(VERSION), buffer_(nullptr), size_(size),
+          mask_(size_ - 1), control_(&localControl_), localControl_(), threadSafe_(threadSafe), mapped_(false),
+          hugePages_(HUGE_PAGES_NONE), prefaulted_(false), locked_(false), lockErrno_(0),
+          numaNode_(NUMA_ANY), numaErrno_(0), released_(0) {
+    mapFile(fd, offset);
 }
 
 RingBuffer::~RingBuffer() {
     if (buffer_) {
-        delete[] buffer_;
+        munmap(buffer_, mappedLength());
         buffer_ = nullptr;
     }
+    if (isFileBacked()) {
+        munmap(control_, CONTROL_SIZE);
+        control_ = &localControl_;
+    }
 }
 
-RingBuffer::Stats RingBuffer::getStats() const {
-    return stats_;
-}
-
-// Allocate a space in ring buffer
-uint32_t RingBuffer::allocate(unsigned int bufferLen)
-{
-    uint32_t ret;
-
-    // For performance reason, check the wrap around index only when it is about to wrap around.
-    if (isIndexRollingOver(currentIndex_)) {
-        if (threadSafe_) {
-            bool writeSuccess = false;
-            uint32_t new_wrap_count = stats_.indexWrapAroundCount + 1;
-            while (isIndexRollingOver(currentIndex_) && !writeSuccess) {
-                uint32_t currentIndex = currentIndex_;
-                uint32_t currentIndexNormalized = normalize(currentIndex);
-                writeSuccess = __sync_bool_compare_and_swap(&(currentIndex_), currentIndex, currentIndexNormalized);
-                if (writeSuccess) {
-                    stats_.indexWrapAroundCount = new_wrap_count;
-                }
+uint64_t RingBuffer::fileLength(unsigned int size) {
+    return CONTROL_SIZE + (uint64_t) roundUpPowerOfTwo(size);
+}
+
+std::shared_ptr<RingBuffer> RingBuffer::create(int fd, uint64_t offset, unsigned int size, bool threadSafe,
+                                               const Allocation &allocation) {
+    std::shared_ptr<RingBuffer> ring(new RingBuffer(roundUpPowerOfTwo(size), threadSafe, fd, offset));
+
+    if (!ring->buffer_) {
+        return nullptr;
+    }
+
+    // The file is zeroed, head and collected start at 0
+    ring->control_->size = ring->size_;
+    ring->control_->version = VERSION;
+    __atomic_store_n(&ring->control_->marker, MARKER, __ATOMIC_RELEASE);
+    ring->place(allocation);
+    return ring;
+}
+
+std::shared_ptr<RingBuffer> RingBuffer::attach(int fd, uint64_t offset) {
+    Control control;
+
+    if (pread(fd, &control, sizeof(control), offset) != (ssize_t) sizeof(control) ||
+        control.marker != MARKER || control.version != VERSION ||
+        control.size < MIN_SIZE || (control.size & (control.size - 1)) != 0 ||
+        control.collected > control.head) {
+        return nullptr;
+    }
+
+    std::shared_ptr<RingBuffer> ring(new RingBuffer(control.size, true, fd, offset));
+    if (!ring->buffer_) {
+        return nullptr;
+    }
+    return ring;
+}
+
+// Control page at offset, followed by the data
+bool RingBuffer::mapFile(int fd, uint64_t offset) {
+    long pageSize = sysconf(_SC_PAGESIZE);
+
+    if (pageSize <= 0 || offset % pageSize || CONTROL_SIZE % pageSize || size_ % pageSize) {
+        return false;
+    }
+
+    void *control = mmap(nullptr, CONTROL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+    if (control == MAP_FAILED) {
+        return false;
+    }
+    control_ = (Control *) control;
+
+    if (size_ >= MIN_MAPPED_SIZE && mapTwice(fd, offset + CONTROL_SIZE, pageSize)) {
+        return true;
+    }
+
+    void *buffer = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset + CONTROL_SIZE);
+    if (buffer == MAP_FAILED) {
+        return false;
+    }
+    buffer_ = (uint8_t *) buffer;
+    return true;
+}
+
+size_t RingBuffer::mappedLength() const {
+    return mapped_ ? 2 * (size_t) size_ : size_;
+}
+
+// Map the same memfd twice back to back. Return false if the kernel does not
+// support it, the caller falls back to a plain buffer.
+bool RingBuffer::map(const Allocation &allocation) {
+    long pageSize = sysconf(_SC_PAGESIZE);
+    size_t length = size_;
+
+    if (pageSize <= 0 || length % pageSize) {
+        return false;
+    }
+
+    if (allocation.hugePages && length % HUGE_PAGE_SIZE == 0) {
+        int fd = memfd_create("memlog-ring", MFD_CLOEXEC | MFD_HUGETLB);
+        if (fd >= 0) {
+            if (ftruncate(fd, length) == 0 && mapTwice(fd, 0, HUGE_PAGE_SIZE)) {
+                hugePages_ = HUGE_PAGES_HUGETLB;
+            }
+            // The mappings keep the memory alive
+            close(fd);
+            if (mapped_) {
+                return true;
+            }
+        }
+    }
+
+    int fd = memfd_create("memlog-ring", MFD_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    if (ftruncate(fd, length) == 0) {
+        mapTwice(fd, 0, pageSize);
+    }
+    close(fd);
+    return mapped_;
+}
+
+bool RingBuffer::mapTwice(int fd, uint64_t offset, size_t alignment) {
+    size_t length = size_;
+    size_t reserved = 2 * length + alignment;
+
+    // Reserve both halves first so the second mapping cannot land on
+    // something else, with room to align the start
+    auto reservation = (uint8_t *) mmap(nullptr, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (reservation == MAP_FAILED) {
+        return false;
+    }
+
+    auto base = (uint8_t *) (((uintptr_t) reservation + alignment - 1) & ~(uintptr_t) (alignment - 1));
+    if (base > reservation) {
+        munmap(reservation, base - reservation);
+    }
+    munmap(base + 2 * length, reservation + reserved - (base + 2 * length));
+
+    if (mmap(base, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED ||
+        mmap(base + length, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED) {
+        munmap(base, 2 * length);
+        return false;
+    }
+
+    buffer_ = base;
+    mapped_ = true;
+    return true;
+}
+
+void RingBuffer::allocatePlain(const Allocation &allocation) {
+    void *buffer = MAP_FAILED;
+
+    if (allocation.hugePages && size_ % HUGE_PAGE_SIZE == 0) {
+        buffer = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (buffer != MAP_FAILED) {
+            hugePages_ = HUGE_PAGES_HUGETLB;
+        }
+    }
+
+    if (buffer == MAP_FAILED) {
+        buffer = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+
+    if (buffer == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+    buffer_ = (uint8_t *) buffer;
+}
+
+// Bind, advise and fault in the ring before the first record, in that order
+// so the pages land where they were asked for
+void RingBuffer::place(const Allocation &allocation) {
+    size_t length = mappedLength();
+
+    if (allocation.numaNode != NUMA_ANY) {
+        unsigned int cpu, node = 0;
+        unsigned long nodeMask[16] = {};
+
+        if (allocation.numaNode == NUMA_LOCAL) {
+            syscall(SYS_getcpu, &cpu, &node, nullptr);
+        } else {
+            node = allocation.numaNode;
+        }
+
+        if (node < sizeof(nodeMask) * 8) {
+            nodeMask[node / (sizeof(unsigned long) * 8)] |= 1UL << (node % (sizeof(unsigned long) * 8));
+            if (syscall(SYS_mbind, buffer_, length, RING_MPOL_BIND, nodeMask, sizeof(nodeMask) * 8 + 1, 0) == 0) {
+                numaNode_ = node;
+            } else {
+                numaErrno_ = errno;
             }
         } else {
-            currentIndex_ = normalize(currentIndex_);
-            stats_.indexWrapAroundCount++;
+            numaErrno_ = EINVAL;
         }
     }
 
+    if (allocation.hugePages && hugePages_ == HUGE_PAGES_NONE &&
+        madvise(buffer_, length, MADV_HUGEPAGE) == 0) {
+        hugePages_ = HUGE_PAGES_TRANSPARENT;
+    }
+
+    if (allocation.prefault || allocation.lock) {
+#ifdef MADV_POPULATE_WRITE
+        prefaulted_ = madvise(buffer_, length, MADV_POPULATE_WRITE) == 0;
+#endif
+        if (!prefaulted_) {
+            long pageSize = sysconf(_SC_PAGESIZE);
+            for (size_t offset = 0; offset < length; offset += pageSize) {
+                __atomic_store_n(&buffer_[offset], 0, __ATOMIC_RELAXED);
+            }
+            prefaulted_ = true;
+        }
+    }
+
+    if (allocation.lock) {
+        if (mlock(buffer_, length) == 0) {
+            locked_ = true;
+        } else {
+            lockErrno_ = errno;
+        }
+    }
+}
+
+void RingBuffer::dumpState(char *buffer, int bufferLen) const {
+    static const char *hugePagesNames[] = { "none", "hugetlb", "transparent" };
+    char *bufferNext = buffer;
+
+    bufferNext += sprintf(bufferNext, "Mapped twice: %u\n", mapped_);
+    bufferNext += sprintf(bufferNext, "File backed: %u\n", isFileBacked());
+    bufferNext += sprintf(bufferNext, "Huge pages: %s\n", hugePagesNames[hugePages_]);
+    bufferNext += sprintf(bufferNext, "Prefaulted: %u\n", prefaulted_);
+    bufferNext += sprintf(bufferNext, "Locked: %u errno: %d\n", locked_, lockErrno_);
+    if (numaNode_ == NUMA_ANY) {
+        bufferNext += sprintf(bufferNext, "NUMA node: any errno: %d\n", numaErrno_);
+    } else {
+        bufferNext += sprintf(bufferNext, "NUMA node: %d\n", numaNode_);
+    }
+}
+
+RingBuffer::Stats RingBuffer::getStats() const {
+    Stats stats;
+    stats.laps = getCurrentIndex() / size();
+    return stats;
+}
+
+// Allocate a space in ring buffer. The 64-bit index never wraps around, so
+// it also tells apart laps of the same buffer position.
+RingBuffer::Location RingBuffer::allocate(unsigned int bufferLen)
+{
+    Location ret;
+
     if (threadSafe_) {
-        ret = __sync_fetch_and_add(&(currentIndex_), bufferLen);
+        ret = __sync_fetch_and_add(&(control_->head), (Location) bufferLen);
     } else {
-        ret = currentIndex_;
-        currentIndex_ += bufferLen;
+        ret = control_->head;
+        __atomic_store_n(&control_->head, ret + bufferLen, __ATOMIC_RELAXED);
     }
 
     return ret;
 }
 
-uint32_t RingBuffer::getCurrentIndex() const
+bool RingBuffer::tryAllocate(unsigned int bufferLen, Location *location)
+{
+    Location head = __atomic_load_n(&control_->head, __ATOMIC_RELAXED);
+
+    do {
+        if (head + bufferLen - __atomic_load_n(&released_, __ATOMIC_ACQUIRE) > size_) {
+            return false;
+        }
+        if (!threadSafe_) {
+            __atomic_store_n(&control_->head, head + bufferLen, __ATOMIC_RELAXED);
+            break;
+        }
+    } while (!__atomic_compare_exchange_n(&control_->head, &head, head + bufferLen, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    *location = head;
+    return true;
+}
+
+void RingBuffer::release(Location index)
+{
+    __atomic_store_n(&released_, index, __ATOMIC_RELEASE);
+}
+
+RingBuffer::Location RingBuffer::getReleased() const
+{
+    return __atomic_load_n(&released_, __ATOMIC_RELAXED);
+}
+
+RingBuffer::Location RingBuffer::getCurrentIndex() const
 {
-    return currentIndex_;
+    return __atomic_load_n(&control_->head, __ATOMIC_RELAXED);
+}
+
+void RingBuffer::setCurrentIndex(Location index)
+{
+    __atomic_store_n(&control_->head, index, __ATOMIC_RELAXED);
+}
+
+// Records before the collected index were committed when the collector read
+// them, a reader of the bookmark may rely on it
+RingBuffer::Location RingBuffer::getCollected() const
+{
+    return __atomic_load_n(&control_->collected, __ATOMIC_ACQUIRE);
+}
+
+void RingBuffer::setCollected(Location index)
+{
+    __atomic_store_n(&control_->collected, index, __ATOMIC_RELEASE);
 }
 
 bool RingBuffer::hasWrappedAround() const
 {
-    return stats_.indexWrapAroundCount > 0;
+    return getCurrentIndex() > size();
 }
 
 // Get a byte array from the stack
-void RingBuffer::get (uint8_t *dst, uint32_t srcIndex, unsigned int length)
+void RingBuffer::get (uint8_t *dst, Location srcIndex, unsigned int length)
 {
-    srcIndex = normalize(srcIndex);
+    uint32_t index = normalize(srcIndex);
 
     // Non-wrap around case
-    if (srcIndex + length <= size()) {
-        memcpy(dst, &(buffer_[srcIndex]), length);
+    if (mapped_ || index + length <= size()) {
+        memcpy(dst, &(buffer_[index]), length);
         return;
     }
 
     // Wrap around case
-    uint32_t copyLength = size() - srcIndex;
-    memcpy(dst, &(buffer_[srcIndex]), copyLength);
+    uint32_t copyLength = size() - index;
+    memcpy(dst, &(buffer_[index]), copyLength);
     memcpy(dst + copyLength, &(buffer_[0]), length - copyLength);
 }
 
-uint8_t RingBuffer::getByte(uint32_t dstIndex)
+void RingBuffer::copy(RingBuffer &source, Location start, Location end)
+{
+    assert(source.size() == size() && end - start <= size());
+    uint32_t index = normalize(start);
+    uint32_t length = (uint32_t) (end - start);
+    uint32_t copyLength = std::min(length, size() - index);
+
+    memcpy(&buffer_[index], &source.buffer_[index], copyLength);
+    memcpy(buffer_, source.buffer_, length - copyLength);
+}
+
+void RingBuffer::erase(Location start, Location end)
+{
+    uint32_t index = normalize(start);
+    uint32_t length = (uint32_t) std::min<uint64_t>(end - start, size());
+    uint32_t eraseLength = std::min(length, size() - index);
+
+    memset(&buffer_[index], 0, eraseLength);
+    memset(buffer_, 0, length - eraseLength);
+}
+
+uint32_t RingBuffer::loadAcquire(Location index)
 {
-    dstIndex = normalize(dstIndex);
-    return buffer_[dstIndex];
+    return __atomic_load_n((uint32_t *) &(buffer_[normalize(index)]), __ATOMIC_ACQUIRE);
 }
 
-uint32_t RingBuffer::getInt(uint32_t dstIndex)
+void RingBuffer::storeRelease(Location index, uint32_t value)
+{
+    __atomic_store_n((uint32_t *) &(buffer_[normalize(index)]), value, __ATOMIC_RELEASE);
+}
+
+uint8_t RingBuffer::getByte(Location dstIndex)
+{
+    return buffer_[normalize(dstIndex)];
+}
+
+uint32_t RingBuffer::getInt(Location dstIndex)
 {
     uint32_t u32;
     get((uint8_t *)&u32, dstIndex, sizeof(u32));
     return u32;
 }
 
-double RingBuffer::getDouble(uint32_t dstIndex)
+double RingBuffer::getDouble(Location dstIndex)
 {
     double d;
     get((uint8_t *)&d, dstIndex, sizeof(d));
     return d;
 }
 
-void * RingBuffer::getPtr(uint32_t dstIndex)
+void * RingBuffer::getPtr(Location dstIndex)
 {
     void *ptr;
     get((uint8_t *)&ptr, dstIndex, sizeof(ptr));
     return ptr;
 }
 
-uint64_t RingBuffer::getLong64(uint32_t dstIndex)
+uint64_t RingBuffer::getLong64(Location dstIndex)
 {
     uint64_t u64;
     get((uint8_t *)&u64, dstIndex, sizeof(u64));
     return u64;
 }
 
-uint32_t RingBuffer::getString(uint32_t bufferIndex, char *dst)
+uint32_t RingBuffer::getString(Location bufferIndex, char *dst)
 {
     uint32_t di = 0;
-    bufferIndex = normalize(bufferIndex);
+    uint32_t index = normalize(bufferIndex);
 
-    while (buffer_[bufferIndex] != 0 && di < size()) {
-        dst[di] = buffer_[bufferIndex];
+    while (buffer_[index] != 0 && di < size()) {
+        dst[di] = buffer_[index];
         di++;
-        bufferIndex++;
-        bufferIndex = normalize(bufferIndex);
+        index++;
+        index = normalize(index);
     }
     return di;
 }
 
 // Copy bytes into the circular buffer
-void RingBuffer::set(uint32_t dstIndex, uint8_t *src, unsigned int length) {
-    dstIndex = normalize(dstIndex);
+void RingBuffer::set(Location dstIndex, uint8_t *src, unsigned int length) {
+    uint32_t index = normalize(dstIndex);
     // Non-wrap around
-    if (dstIndex + length <= size()) {
-        memcpy(&(buffer_[dstIndex]), src, length);
+    if (mapped_ || index + length <= size()) {
+        memcpy(&(buffer_[index]), src, length);
         return;
     }
     // Wrap around
-    uint32_t copyLength = size() - dstIndex;
-    memcpy(&(buffer_[dstIndex]), src, copyLength);
+    uint32_t copyLength = size() - index;
+    memcpy(&(buffer_[index]), src, copyLength);
     memcpy(&(buffer_[0]), src+copyLength, length - copyLength);
 }
 
+// Write access for producers encoding a record in place
+uint8_t *RingBuffer::contiguous(Location index, unsigned int length) {
+    uint32_t start = normalize(index);
+
+    if (!mapped_ && start + length > size()) {
+        return nullptr;
+    }
+    return &(buffer_[start]);
+}
+
 // Compare bytes from the circular buffer
-int RingBuffer::compare(uint32_t bufferIndex, uint8_t *p, unsigned int length)
+int RingBuffer::compare(Location bufferIndex, uint8_t *p, unsigned int length)
 {
     uint32_t di = 0;
-    bufferIndex = normalize(bufferIndex);
+    uint32_t index = normalize(bufferIndex);
+
+    if (mapped_ && length <= size()) {
+        return memcmp(&(buffer_[index]), p, length) ? -1 : 0;
+    }
 
     while (length) {
-        if (buffer_[bufferIndex] != p[di]) {
+        if (buffer_[index] != p[di]) {
             return -1;
         }
         length--;
         di++;
-        bufferIndex++;
-        bufferIndex = normalize(bufferIndex);
+        index++;
+        index = normalize(index);
     }
     return 0;
 }
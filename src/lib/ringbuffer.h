@@ -16,11 +16,20 @@ limitations under the License.
 //
 // Thread-safe RingBuffer class
 //
+// The size is a power of two, so indices reduce to a mask. A size that is not
+// one is rounded up to the next, up to twice the memory asked for, and size()
+// returns the rounded size. The buffer is a memfd mapped twice back to back
+// when possible: any record, wrapped or not, is then one contiguous span.
+//
+// A ring can also live in a file, a control page followed by the data, so
+// that its content survives the process and can be attached to later.
+//
 
 #ifndef MEMLOG_RINGBUFFER_H
 #define MEMLOG_RINGBUFFER_H
 
 #include <stdint.h>
+#include <memory>
 
 namespace memlog {
 
@@ -28,46 +37,145 @@ namespace memlog {
     class RingBuffer {
     public:
         static constexpr uint64_t MARKER = 0xfeedf000faeef0feLL;
-        static constexpr uint32_t VERSION = 1;
-        typedef uint32_t Location;
+        static constexpr uint32_t VERSION = 4;
+        static constexpr uint32_t MIN_SIZE = 4096;
+        // Smaller rings use a plain buffer, so that reads running a little past
+        // a record never leave the double mapping
+        static constexpr uint32_t MIN_MAPPED_SIZE = 64 * 1024;
+        // Index of a byte since the ring was created, normalize() maps it into the buffer
+        typedef uint64_t Location;
         struct Stats {
-            uint32_t indexWrapAroundCount;
+            uint64_t laps;
         };
 
+        static constexpr uint32_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+        static constexpr int NUMA_ANY = -1;
+        // Node of the CPU constructing the ring
+        static constexpr int NUMA_LOCAL = -2;
+
+        // Placement of the ring memory
+        struct Allocation {
+            // MAP_HUGETLB when the size is a multiple of HUGE_PAGE_SIZE and the
+            // pool has pages, transparent huge pages otherwise
+            bool hugePages = false;
+            // Fault every page in at construction instead of on the first lap
+            bool prefault = false;
+            // mlock the ring, implies prefault
+            bool lock = false;
+            // NUMA node the ring is bound to, NUMA_ANY leaves it to first touch
+            int numaNode = NUMA_ANY;
+        };
+
+        static constexpr uint32_t CONTROL_SIZE = 4096;
+        static constexpr uint32_t USER_CONTROL_SIZE = 1024;
+
+        // First page of a ring in a file, also kept in memory for other rings
+        struct Control {
+            uint64_t marker;
+            uint32_t version;
+            uint32_t size;
+            alignas(64) Location head;
+            // Records before this index were written out by the collector
+            alignas(64) Location collected;
+            // Owner data, see getUserControl()
+            alignas(64) uint8_t user[USER_CONTROL_SIZE];
+        };
+
+        enum HugePages {
+            HUGE_PAGES_NONE,
+            HUGE_PAGES_HUGETLB,
+            HUGE_PAGES_TRANSPARENT,
+        };
+
+
+        Location allocate(unsigned int bufferLen);
+
+        // Allocate unless it would overwrite bytes the consumer has not
+        // released, return false then
+        bool tryAllocate(unsigned int bufferLen, Location *location);
+
+        // The consumer is done with the bytes before index
+        void release(Location index);
+
+        Location getReleased() const;
+
+        void get(uint8_t *dst, Location srcIndex, unsigned int length);
+
+        void set(Location dstIndex, uint8_t *src, unsigned int length);
+
+        // Bulk copy [start, end) of a ring of the same size to the same indexes
+        void copy(RingBuffer &source, Location start, Location end);
+
+        // Zero [start, end), the bytes no longer hold a record
+        void erase(Location start, Location end);
+
+        // Storage of [index, index + length) if it is contiguous, NULL otherwise
+        uint8_t *contiguous(Location index, unsigned int length);
 
-        uint32_t allocate(unsigned int bufferLen);
+        // Storage at index, valid up to size() bytes if isMapped()
+        inline uint8_t *span(Location index) const { return &buffer_[normalize(index)]; }
 
-        void get(uint8_t *dst, uint32_t srcIndex, unsigned int length);
+        inline bool isMapped() const { return mapped_; }
 
-        void set(uint32_t dstIndex, uint8_t *src, unsigned int length);
+        int compare(Location bufIndex, uint8_t *p, unsigned int length);
 
-        int compare(uint32_t bufIndex, uint8_t *p, unsigned int length);
+        // 4-byte aligned word access used to publish and observe records
+        uint32_t loadAcquire(Location index);
 
-        uint8_t getByte(uint32_t dstIndex);
+        void storeRelease(Location index, uint32_t value);
 
-        uint32_t getInt(uint32_t dstIndex);
+        uint8_t getByte(Location dstIndex);
 
-        uint64_t getLong64(uint32_t dstIndex);
+        uint32_t getInt(Location dstIndex);
 
-        double getDouble(uint32_t dstIndex);
+        uint64_t getLong64(Location dstIndex);
 
-        void *getPtr(uint32_t dstIndex);
+        double getDouble(Location dstIndex);
 
-        uint32_t getString(uint32_t bufferIndex, char *dst);
+        void *getPtr(Location dstIndex);
 
-        uint32_t getCurrentIndex() const;
+        uint32_t getString(Location bufferIndex, char *dst);
+
+        Location getCurrentIndex() const;
+
+        // Only for a ring no producer uses, such as a copy
+        void setCurrentIndex(Location index);
+
+        Location getCollected() const;
+
+        void setCollected(Location index);
+
+        // Room for the owner to keep its own state next to the ring
+        inline void *getUserControl() { return control_->user; }
+
+        inline bool isFileBacked() const { return control_ != &localControl_; }
 
         bool hasWrappedAround() const;
 
         Stats getStats() const;
 
+        void dumpState(char *buffer, int bufferLen) const;
+
+        // The size asked for rounded up to a power of two
         inline uint32_t size() const { return size_; }
 
-        inline uint32_t normalize(uint32_t index) { return index % size(); }
+        inline uint32_t normalize(Location index) const { return index & mask_; }
 
 
         RingBuffer(unsigned int size, bool threadSafe = true);
 
+        RingBuffer(unsigned int size, bool threadSafe, const Allocation &allocation);
+
+        // Bytes a ring of size takes in a file
+        static uint64_t fileLength(unsigned int size);
+
+        // Create a ring at offset of a zeroed file, NULL if it can not be mapped
+        static std::shared_ptr<RingBuffer> create(int fd, uint64_t offset, unsigned int size, bool threadSafe,
+                                                  const Allocation &allocation);
+
+        // Map the ring left at offset by another process, NULL if it is not valid
+        static std::shared_ptr<RingBuffer> attach(int fd, uint64_t offset);
+
         ~RingBuffer();
 
     private:
@@ -75,11 +183,33 @@ namespace memlog {
         uint32_t version_;
         uint8_t *buffer_;
         uint32_t size_;
-        uint32_t currentIndex_;
+        uint32_t mask_;
+        Control *control_;
+        Control localControl_;
         bool threadSafe_;
-        Stats stats_;
+        bool mapped_;
+        HugePages hugePages_;
+        bool prefaulted_;
+        bool locked_;
+        int lockErrno_;
+        int numaNode_;
+        int numaErrno_;
+        // Read by producers of a bounded ring, off the cache line of head
+        alignas(64) Location released_;
+
+        RingBuffer(unsigned int size, bool threadSafe, int fd, uint64_t offset);
+
+        bool map(const Allocation &allocation);
+
+        bool mapTwice(int fd, uint64_t offset, size_t alignment);
+
+        bool mapFile(int fd, uint64_t offset);
+
+        void allocatePlain(const Allocation &allocation);
+
+        void place(const Allocation &allocation);
 
-        inline bool isIndexRollingOver(uint32_t index) const { return (index > (UINT32_MAX - 10240)); }
+        size_t mappedLength() const;
     };
 }
 #endif //ASYNCLOG_RINGBUFFER_H
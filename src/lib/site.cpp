@@ -0,0 +1,391 @@
+/* Copyright 2019 memlog Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+//
+// SiteCatalog class
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include "site.h"
+
+using namespace memlog;
+
+SiteCatalog &SiteCatalog::global() {
+    static SiteCatalog catalog;
+    return catalog;
+}
+
+SiteCatalog::SiteCatalog()
+        : count_(1), overflowCount_(0), writeErrorCount_(0), writeErrno_(0), minLevel_(0), overflowSite_() {
+    memset(chunks_, 0, sizeof(chunks_));
+    memset(lookupCache_, 0, sizeof(lookupCache_));
+    overflowSite_.label = "";
+}
+
+SiteCatalog::~SiteCatalog() {
+    for (auto &persisted : persistFds_) {
+        close(persisted.second);
+    }
+    persistFds_.clear();
+    for (auto &chunk : chunks_) {
+        delete[] chunk;
+        chunk = nullptr;
+    }
+}
+
+uint32_t SiteCatalog::addLocked(const char *format, const char *functionName, uint32_t lineNumber,
+                                char tag, uint8_t level) {
+    uint32_t id = count_;
+    uint32_t chunk = id / CHUNK_SIZE;
+
+    if (chunk >= MAX_CHUNKS) {
+        overflowCount_++;
+        return INVALID_ID;
+    }
+
+    if (!chunks_[chunk]) {
+        chunks_[chunk] = new Site[CHUNK_SIZE]();
+    }
+
+    Site &site = chunks_[chunk][id % CHUNK_SIZE];
+    site.id = id;
+    site.format = format;
+    site.functionName = functionName;
+    site.lineNumber = lineNumber;
+    site.tag = tag;
+    site.level = level;
+    site.enabled = isEnabledLocked(site);
+
+    std::string label;
+    if (functionName) {
+        label = std::string(1, tag) + ":" + functionName + ":" + std::to_string(lineNumber);
+    } else if (lineNumber) {
+        label = std::string(1, tag) + ":" + std::to_string(lineNumber);
+    } else if (tag) {
+        label = std::string(1, tag);
+    }
+    strings_.push_back(std::move(label));
+    site.label = strings_.back().c_str();
+    site.labelLength = strings_.back().size();
+
+    // Publish the descriptor before the id becomes visible to find()
+    __atomic_store_n(&count_, id + 1, __ATOMIC_RELEASE);
+
+    for (auto &persisted : persistFds_) {
+        writeLocked(site, persisted.second);
+    }
+    return id;
+}
+
+uint32_t SiteCatalog::add(const char *format, const char *functionName, uint32_t lineNumber,
+                          char tag, uint8_t level) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return addLocked(format, functionName, lineNumber, tag, level);
+}
+
+const Site *SiteCatalog::addSite(const char *format, const char *functionName, uint32_t lineNumber,
+                                 char tag, uint8_t level) {
+    const Site *site = find(add(format, functionName, lineNumber, tag, level));
+    return site ? site : &overflowSite_;
+}
+
+uint32_t SiteCatalog::lookupSlot(const char *format, const char *functionName, uint32_t lineNumber, char tag) {
+    uint64_t hash = ((uintptr_t) format >> 3) ^ ((uintptr_t) functionName << 7) ^ ((uint64_t) lineNumber << 40) ^
+                    (uint64_t) (uint8_t) tag;
+    return (uint32_t) ((hash * 0x9e3779b97f4a7c15ULL) >> 40);
+}
+
+// Open addressing on the key, the sites are immutable once published so a
+// slot is compared without the lock. The map stays the complete index.
+uint32_t SiteCatalog::lookup(const char *format, const char *functionName, uint32_t lineNumber,
+                             char tag, uint8_t level) {
+    uint32_t slot = lookupSlot(format, functionName, lineNumber, tag);
+
+    for (uint32_t probe = 0; probe < LOOKUP_CACHE_PROBES; probe++) {
+        uint32_t id = __atomic_load_n(&lookupCache_[(slot + probe) & (LOOKUP_CACHE_SIZE - 1)], __ATOMIC_ACQUIRE);
+        if (id == INVALID_ID) {
+            break;
+        }
+        const Site *site = find(id);
+        if (site->format == format && site->functionName == functionName && site->lineNumber == lineNumber &&
+            site->tag == tag) {
+            return id;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    Key key(format, functionName, lineNumber, tag);
+
+    auto it = dynamicSites_.find(key);
+    if (it != dynamicSites_.end()) {
+        return it->second;
+    }
+
+    uint32_t id = addLocked(format, functionName, lineNumber, tag, level);
+    if (id == INVALID_ID) {
+        return id;
+    }
+    dynamicSites_[key] = id;
+    for (uint32_t probe = 0; probe < LOOKUP_CACHE_PROBES; probe++) {
+        uint32_t &entry = lookupCache_[(slot + probe) & (LOOKUP_CACHE_SIZE - 1)];
+        if (entry == INVALID_ID) {
+            __atomic_store_n(&entry, id, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    return id;
+}
+
+const Site *SiteCatalog::find(uint32_t id) const {
+    if (id == INVALID_ID || id >= __atomic_load_n(&count_, __ATOMIC_ACQUIRE)) {
+        return nullptr;
+    }
+    return &chunks_[id / CHUNK_SIZE][id % CHUNK_SIZE];
+}
+
+Site *SiteCatalog::get(uint32_t id) {
+    return const_cast<Site *>(find(id));
+}
+
+bool SiteCatalog::isEnabledLocked(const Site &site) const {
+    if (site.level < minLevel_) {
+        return false;
+    }
+    return !site.functionName || !disabledFunctions_.count(site.functionName);
+}
+
+void SiteCatalog::setLevel(uint8_t minLevel) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    minLevel_ = minLevel;
+    for (uint32_t id = 1; id < size(); id++) {
+        Site *site = get(id);
+        __atomic_store_n(&site->enabled, isEnabledLocked(*site), __ATOMIC_RELAXED);
+    }
+}
+
+void SiteCatalog::setFunctionEnabled(const char *functionName, bool enable) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (enable) {
+        disabledFunctions_.erase(functionName);
+    } else {
+        disabledFunctions_.insert(functionName);
+    }
+
+    for (uint32_t id = 1; id < size(); id++) {
+        Site *site = get(id);
+        if (site->functionName && strcmp(site->functionName, functionName) == 0) {
+            __atomic_store_n(&site->enabled, isEnabledLocked(*site), __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void SiteCatalog::setEnabled(uint32_t id, bool enable) {
+    Site *site = get(id);
+
+    if (site) {
+        __atomic_store_n(&site->enabled, enable, __ATOMIC_RELAXED);
+    }
+}
+
+uint32_t SiteCatalog::size() const {
+    return __atomic_load_n(&count_, __ATOMIC_ACQUIRE);
+}
+
+void SiteCatalog::dump(std::shared_ptr<Stream> stream) const {
+    char line[4096];
+
+    for (uint32_t id = 1; id < size(); id++) {
+        const Site *site = find(id);
+        int length = snprintf(line, sizeof(line), "[%u:%c:%s:%u] ",
+                              site->id, site->tag ? site->tag : '-',
+                              site->functionName ? site->functionName : "",
+                              site->lineNumber);
+
+        // One site per line, escape line breaks of the format
+        for (const char *s = site->format; *s && length < (int) sizeof(line) - 3; s++) {
+            if (*s == '\n') {
+                line[length++] = '\\';
+                line[length++] = 'n';
+            } else {
+                line[length++] = *s;
+            }
+        }
+        line[length++] = '\n';
+        stream->write(line, length);
+    }
+}
+
+void SiteCatalog::dumpState(char *buffer, int bufferLen) const {
+    char *bufferNext = buffer;
+
+    bufferNext += sprintf(bufferNext, "Registered sites: %u overflow: %u\n", size() - 1, overflowCount_);
+    bufferNext += sprintf(bufferNext, "Site files: %zu write errors: %u errno: %d\n", persistFds_.size(),
+                          writeErrorCount_, writeErrno_);
+}
+
+// One site per line: id, tag, level, line, function and format separated by
+// tabs, with tabs, line breaks and backslashes escaped
+static int escape(char *dst, int room, const char *src) {
+    int length = 0;
+
+    for (; src && *src && length < room - 2; src++) {
+        switch (*src) {
+            case '\t':
+                dst[length++] = '\\';
+                dst[length++] = 't';
+                break;
+            case '\n':
+                dst[length++] = '\\';
+                dst[length++] = 'n';
+                break;
+            case '\\':
+                dst[length++] = '\\';
+                dst[length++] = '\\';
+                break;
+            default:
+                dst[length++] = *src;
+                break;
+        }
+    }
+    return length;
+}
+
+static std::string unescape(const char *src, const char *end) {
+    std::string dst;
+
+    for (; src < end; src++) {
+        if (*src == '\\' && src + 1 < end) {
+            src++;
+            dst += *src == 't' ? '\t' : *src == 'n' ? '\n' : *src;
+        } else {
+            dst += *src;
+        }
+    }
+    return dst;
+}
+
+void SiteCatalog::writeLocked(const Site &site, int fd) {
+    char line[LINE_SIZE];
+    int length = snprintf(line, sizeof(line), "%u\t%u\t%u\t%u\t", site.id, (uint8_t) site.tag, site.level,
+                          site.lineNumber);
+
+    length += escape(line + length, sizeof(line) - length - 1, site.functionName);
+    line[length++] = '\t';
+    length += escape(line + length, sizeof(line) - length - 1, site.format);
+    line[length++] = '\n';
+
+    // Single write with O_APPEND, a crash leaves whole lines
+    ssize_t written = write(fd, line, length);
+    if (written != length) {
+        writeErrorCount_++;
+        writeErrno_ = written < 0 ? errno : ENOSPC;
+    }
+}
+
+bool SiteCatalog::persist(const char *path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    unpersistLocked(path);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+
+    for (uint32_t id = 1; id < size(); id++) {
+        writeLocked(*find(id), fd);
+    }
+    persistFds_[path] = fd;
+    return true;
+}
+
+void SiteCatalog::unpersist(const char *path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    unpersistLocked(path);
+}
+
+void SiteCatalog::unpersistLocked(const char *path) {
+    auto persisted = persistFds_.find(path);
+    if (persisted != persistFds_.end()) {
+        close(persisted->second);
+        persistFds_.erase(persisted);
+    }
+}
+
+bool SiteCatalog::load(const char *path) {
+    FILE *file = fopen(path, "r");
+    char *line = nullptr;
+    size_t room = 0;
+    ssize_t length;
+
+    if (!file) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    while ((length = getline(&line, &room, file)) > 0) {
+        const char *fields[6];
+        const char *end = line + length - (line[length - 1] == '\n' ? 1 : 0);
+        int count = 0;
+
+        fields[count++] = line;
+        for (const char *c = line; c < end && count < 6; c++) {
+            if (*c == '\t') {
+                fields[count++] = c + 1;
+            }
+        }
+        if (count < 6) {
+            continue;
+        }
+
+        restoreLocked(strtoul(fields[0], nullptr, 10), unescape(fields[5], end), unescape(fields[4], fields[5] - 1),
+                      strtoul(fields[3], nullptr, 10), (char) strtoul(fields[1], nullptr, 10),
+                      (uint8_t) strtoul(fields[2], nullptr, 10));
+    }
+
+    free(line);
+    fclose(file);
+    return true;
+}
+
+uint32_t SiteCatalog::restore(uint32_t id, const char *format, const char *functionName, uint32_t lineNumber,
+                              char tag, uint8_t level) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    return restoreLocked(id, format ? format : "", functionName ? functionName : "", lineNumber, tag, level);
+}
+
+uint32_t SiteCatalog::restoreLocked(uint32_t id, std::string format, std::string functionName, uint32_t lineNumber,
+                                    char tag, uint8_t level) {
+    if (id < count_) {
+        return INVALID_ID;
+    }
+
+    // Keep the ids of the writer, a gap is a site lost in a crash
+    while (count_ < id && addLocked("", nullptr, 0, 0, 0) != INVALID_ID) {
+    }
+
+    strings_.push_back(std::move(functionName));
+    const char *function = strings_.back().empty() ? nullptr : strings_.back().c_str();
+    strings_.push_back(std::move(format));
+
+    return addLocked(strings_.back().c_str(), function, lineNumber, tag, level);
+}
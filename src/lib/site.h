@@ -0,0 +1,168 @@
+/* Copyright 2019 memlog Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+//
+// Call site catalog
+//
+// Every log statement registers a Site descriptor once, and records only
+// carry the site id. Ids are dense and never reused, so the catalog is also
+// the complete list of log statements seen by the process.
+//
+// Each site also carries a runtime enable flag, switched by level, by
+// function or by id. The last switch applied to a site wins.
+//
+
+#ifndef MEMLOG_SITE_H
+#define MEMLOG_SITE_H
+
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <tuple>
+#include "stream.h"
+
+namespace memlog {
+
+    struct Site {
+        uint32_t id;
+        const char *format;
+        const char *functionName;
+        uint32_t lineNumber;
+        char tag;
+        uint8_t level;
+        // Read with a relaxed load on every call of the site
+        bool enabled;
+        // tag:function:line as far as known, for the prefix of text records.
+        // Empty if the site has none of them.
+        const char *label;
+        uint32_t labelLength;
+    };
+
+    class SiteCatalog {
+    public:
+        static constexpr uint32_t CHUNK_SIZE = 1024;
+        static constexpr uint32_t MAX_CHUNKS = 1024;
+        // Id 0 is never handed out and marks an invalid record
+        static constexpr uint32_t INVALID_ID = 0;
+        // Longest persisted site line
+        static constexpr uint32_t LINE_SIZE = 8192;
+        // Lock-free table of the sites lookup() registered, probed before the map
+        static constexpr uint32_t LOOKUP_CACHE_SIZE = 4096;
+        static constexpr uint32_t LOOKUP_CACHE_PROBES = 16;
+
+        static SiteCatalog &global();
+
+        // Register a new site. Callers keep the id in a function-local static.
+        uint32_t add(const char *format, const char *functionName, uint32_t lineNumber, char tag,
+                     uint8_t level);
+
+        // Same as add(), return the descriptor, a disabled placeholder once the
+        // catalog is full
+        const Site *addSite(const char *format, const char *functionName, uint32_t lineNumber, char tag,
+                            uint8_t level);
+
+        // Find or register a site for callers without a static slot (traceVargs).
+        // A site seen before is found without the lock.
+        uint32_t lookup(const char *format, const char *functionName, uint32_t lineNumber, char tag,
+                        uint8_t level);
+
+        // Enable the sites of level minLevel and above, disable the others
+        void setLevel(uint8_t minLevel);
+
+        // Also applies to sites of the function registered later
+        void setFunctionEnabled(const char *functionName, bool enable);
+
+        void setEnabled(uint32_t id, bool enable);
+
+        // Lock free, safe to call concurrently with add()
+        const Site *find(uint32_t id) const;
+
+        uint32_t size() const;
+
+        void dump(std::shared_ptr<Stream> stream) const;
+
+        void dumpState(char *buffer, int bufferLen) const;
+
+        // Write every site to path, and append the sites registered later, so
+        // records can be decoded without this process. Each file-backed Log
+        // has its own file, every one of them gets the new sites.
+        bool persist(const char *path);
+
+        // Stop appending to path
+        void unpersist(const char *path);
+
+        // Register the sites persisted by another process, with the same ids
+        bool load(const char *path);
+
+        // Register a site of another process under its id, the strings are copied
+        uint32_t restore(uint32_t id, const char *format, const char *functionName, uint32_t lineNumber, char tag,
+                         uint8_t level);
+
+        SiteCatalog();
+
+        ~SiteCatalog();
+
+    private:
+        typedef std::tuple<const char *, const char *, uint32_t, char> Key;
+
+        std::mutex mutex_;
+        Site *chunks_[MAX_CHUNKS];
+        uint32_t count_;
+        std::map<Key, uint32_t> dynamicSites_;
+        // Ids of dynamicSites_ by hash of the key, 0 for a free slot. Only
+        // filled with the lock held.
+        uint32_t lookupCache_[LOOKUP_CACHE_SIZE];
+        uint32_t overflowCount_;
+        // Failed writes to the persisted files, and the errno of the last one
+        uint32_t writeErrorCount_;
+        int writeErrno_;
+        uint8_t minLevel_;
+        std::set<std::string> disabledFunctions_;
+        Site overflowSite_;
+        // Descriptor of each persisted file by path
+        std::map<std::string, int> persistFds_;
+        // Strings of loaded sites and the labels
+        std::deque<std::string> strings_;
+
+        uint32_t addLocked(const char *format, const char *functionName, uint32_t lineNumber, char tag,
+                           uint8_t level);
+
+        bool isEnabledLocked(const Site &site) const;
+
+        static uint32_t lookupSlot(const char *format, const char *functionName, uint32_t lineNumber, char tag);
+
+        void writeLocked(const Site &site, int fd);
+
+        void unpersistLocked(const char *path);
+
+        uint32_t restoreLocked(uint32_t id, std::string format, std::string functionName, uint32_t lineNumber,
+                               char tag, uint8_t level);
+
+        Site *get(uint32_t id);
+    };
+}
+
+// Lambda resolving the site of the expanding statement once, and keeping it
+// in a function-local static. Nothing is registered until it is called.
+#define MEMLOG_SITE(tag, level, msg) [memlogFunction = __func__, memlogFormat = (const char *)(msg)]() { \
+        static const ::memlog::Site *site = ::memlog::SiteCatalog::global().addSite(memlogFormat, \
+                memlogFunction, __LINE__, tag, level); \
+        return site; }
+
+#endif //MEMLOG_SITE_H
@@ -0,0 +1,107 @@
+/* Copyright 2019 memlog Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+//
+// Snapshot class
+//
+
+#include <cstring>
+#include <algorithm>
+#include "log.h"
+
+using namespace std;
+using namespace memlog;
+
+Log::Snapshot::Snapshot(Log *log, uint32_t bytes) : size_(0) {
+    log->refreshClock();
+    for (uint32_t s = 0; s <= log->shardCount_; s++) {
+        RingBuffer *source = log->shards_[s].ringBuffer.get();
+        auto copy = make_shared<RingBuffer>(source->size(), false);
+        uint64_t copied = 0;
+        bool lapped = true;
+
+        // Start over if the producers lapped the oldest records while they
+        // were copied, the last attempt keeps what is left
+        for (uint32_t attempt = 0; attempt < ATTEMPTS && lapped; attempt++) {
+            copied = copyRing(log, source, copy.get(), bytes, &lapped);
+        }
+        size_ += copied;
+        rings_.push_back(copy);
+    }
+    reader_.reset(new Log(rings_, log->catalog_, log->clock_, nullptr));
+    // Lines as the trace file of log has them
+    reader_->prefix_ = log->prefix_;
+    reader_->timeFormat_ = log->timeFormat_;
+}
+
+// Return the bytes copied, 0 if none is left. The copy has its head at the
+// end of the last record and its collected index at the first byte still
+// valid. lapped tells if records from start were overwritten meanwhile.
+uint64_t Log::Snapshot::copyRing(Log *log, RingBuffer *source, RingBuffer *copy, uint32_t bytes, bool *lapped) {
+    char buf[LOG_MAX_LOG_TRACE_LINE * 2];
+    uint64_t end = source->getCurrentIndex();
+    uint64_t size = std::min<uint64_t>(bytes ? bytes : source->size(), source->size());
+    uint64_t start = end > size ? end - size : 0;
+
+    // Everything below the collected index was committed before the copy,
+    // the rest may have been copied while a producer was writing it
+    uint64_t committed = source->getCollected();
+    copy->copy(*source, start, end);
+
+    // Lapped by the producers while it was copied
+    uint64_t current = source->getCurrentIndex();
+    uint64_t begin = std::max(start, current > source->size() ? current - source->size() : 0);
+    copy->erase(start, begin);
+    *lapped = begin > start;
+
+    uint64_t index = std::max(begin, committed);
+    if (index < end) {
+        index = log->findNextHeader(source, index, end, buf);
+    }
+    while (index < end) {
+        const char *record;
+        RecordState state = log->readLog(source, index, buf, &record);
+
+        if (state == RECORD_PENDING) {
+            end = index;
+            break;
+        }
+        if (state != RECORD_VALID) {
+            index = log->findNextHeader(source, index + LOG_RECORD_ALIGN, end, buf);
+            continue;
+        }
+
+        Header hdr;
+        memcpy(&hdr, buf, sizeof(Header));
+        copy->set(index, (uint8_t *) record, hdr.length);
+        index += LOG_MEM_ALIGN(hdr.length);
+    }
+
+    copy->setCurrentIndex(end);
+    copy->setCollected(std::min(begin, end));
+    return end > begin ? end - begin : 0;
+}
+
+void Log::Snapshot::write(shared_ptr<Stream> stream, bool binary) {
+    reader_->stream_ = stream;
+    reader_->binary_ = binary;
+    reader_->dumpRings(stream, true);
+    if (binary) {
+        reader_->closeSegment(stream);
+    }
+    reader_->binary_ = false;
+    reader_->stream_ = nullptr;
+    stream->flush();
+}
@@ -0,0 +1,323 @@
+/* Copyright 2019 memlog Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+//
+// StaticFormat class
+//
+// Compile-time counterpart of StringFormat::encodeToArgsBuffer. A format
+// literal wrapped with FMT() is parsed by the compiler, the argument types
+// are checked against the conversions, and every argument is stored with
+// the same layout StringFormat::decodeFromArgsBuffer expects.
+//
+
+#ifndef MEMLOG_STATICFORMAT_H
+#define MEMLOG_STATICFORMAT_H
+
+#include <stdint.h>
+#include <cstring>
+#include <type_traits>
+#include "stringformat.h"
+
+namespace memlog {
+
+// Wrap a format literal so it can be parsed at compile time, e.g.
+// log->log<Log::info>(FMT("Hello world %d!\n"), i);
+#define FMT(s) ::memlog::StaticFormat::make([] { \
+        struct Literal { static constexpr const char *str() { return s; } }; \
+        return Literal{}; }(), __func__, __LINE__)
+
+    class StaticFormat {
+    public:
+        static constexpr uint32_t MAX_ARGS = 32;
+
+        // Encoded size class of a conversion, must match decodeFromArgsBuffer
+        enum Kind : uint8_t {
+            none,
+            byte,
+            word,
+            int32,
+            long32,
+            long64,
+            real,
+            pointer,
+            string,
+            // %#s, only the pointer is stored
+            staticString,
+        };
+
+        struct Spec {
+            Kind kinds[MAX_ARGS];
+            uint32_t count;
+            bool overflow;
+        };
+
+        // Call site of a FMT() literal. Literal::str() is usable in constant
+        // expressions, functionName and lineNumber are filled at the call site.
+        template<typename Literal>
+        struct Format {
+            const char *functionName;
+            uint32_t lineNumber;
+
+            static constexpr const char *str() { return Literal::str(); }
+        };
+
+        template<typename Literal>
+        static constexpr Format<Literal> make(Literal, const char *functionName, uint32_t lineNumber) {
+            return Format<Literal>{ functionName, lineNumber };
+        }
+
+        static constexpr bool isDigit(char c) {
+            return c >= '0' && c <= '9';
+        }
+
+        // Mirror of the conversion grammar of StringFormat::decodeFromArgsBuffer
+        static constexpr Spec parse(const char *format) {
+            Spec spec{};
+            uint32_t i = 0;
+
+            while (format[i] != 0) {
+                Kind kind = none;
+
+                if (format[i] != '%') {
+                    i++;
+                    continue;
+                }
+                uint32_t start = i;
+                bool alternate = false;
+                i++;
+
+                // %#x or %-2.2d or %+2.2x
+                if (format[i] == '0' || format[i] == ' ' || format[i] == '#' ||
+                    format[i] == '-' || format[i] == '+') {
+                    alternate = format[i] == '#';
+                    i++;
+                }
+
+                // %2.2x
+                while (isDigit(format[i])) {
+                    i++;
+                }
+                if (format[i] == '.') {
+                    i++;
+                }
+                while (isDigit(format[i])) {
+                    i++;
+                }
+
+                switch (format[i]) {
+                    case 'h':
+                        i++;
+                        switch (format[i]) {
+                            case 'd':
+                            case 'u':
+                            case 'x':
+                            case 'X':
+                            case 'o':
+                            case 'i':
+                                i++;
+                                kind = word;
+                                break;
+                            case 'h':
+                                i++;
+                                if (format[i] == 'x' || format[i] == 'X' ||
+                                    format[i] == 'u' || format[i] == 'o') {
+                                    i++;
+                                    kind = word;
+                                }
+                                break;
+                            default:
+                                break;
+                        }
+                        break;
+
+                    case 'c':
+                        i++;
+                        kind = byte;
+                        break;
+
+                    case 'd':
+                    case 'u':
+                    case 'i':
+                    case 'x':
+                    case 'X':
+                        i++;
+                        kind = int32;
+                        break;
+
+                    case 'f':
+                        i++;
+                        kind = real;
+                        break;
+
+                    case 'p':
+                        i++;
+                        kind = pointer;
+                        break;
+
+                    case 's':
+                        i++;
+                        kind = alternate ? staticString : string;
+                        break;
+
+                    case 'l':
+                        i++;
+                        switch (format[i]) {
+                            case 'l':
+                                i++;
+                                if (format[i] == 'd' || format[i] == 'i' || format[i] == 'x' ||
+                                    format[i] == 'u' || format[i] == 'X') {
+                                    i++;
+                                    kind = long64;
+                                }
+                                break;
+                            case 'd':
+                            case 'u':
+                            case 'i':
+                            case 'x':
+                            case 'X':
+                                i++;
+                                kind = long32;
+                                break;
+                            case 'f':
+                                i++;
+                                kind = real;
+                                break;
+                            default:
+                                break;
+                        }
+                        break;
+
+                    case '%':
+                        i++;
+                        continue;
+
+                    default:
+                        break;
+                }
+
+                if (kind == none) {
+                    // Not a conversion, the decoder copies the '%' verbatim
+                    i = start + 1;
+                    continue;
+                }
+
+                if (spec.count == MAX_ARGS) {
+                    spec.overflow = true;
+                    return spec;
+                }
+                spec.kinds[spec.count++] = kind;
+            }
+            return spec;
+        }
+
+        // Size of the fixed-width part of an encoded argument
+        static constexpr uint32_t fixedSize(Kind kind) {
+            switch (kind) {
+                case byte:
+                    return sizeof(uint8_t);
+                case word:
+                    return sizeof(uint16_t);
+                case int32:
+                case long32:
+                    return sizeof(uint32_t);
+                case long64:
+                    return sizeof(uint64_t);
+                case real:
+                    return sizeof(double);
+                case pointer:
+                case staticString:
+                    return sizeof(void *);
+                default:
+                    return 0;
+            }
+        }
+
+        template<typename T>
+        static constexpr bool accepts(Kind kind) {
+            typedef typename std::decay<T>::type U;
+            constexpr bool isInteger = std::is_integral<U>::value || std::is_enum<U>::value;
+
+            switch (kind) {
+                case byte:
+                case word:
+                    return isInteger && sizeof(U) <= sizeof(uint32_t);
+                case int32:
+                    return isInteger && sizeof(U) <= sizeof(uint32_t);
+                case long32:
+                case long64:
+                    return isInteger && sizeof(U) <= sizeof(uint64_t);
+                case real:
+                    return std::is_same<U, double>::value || std::is_same<U, float>::value;
+                case pointer:
+                    return std::is_pointer<U>::value || std::is_same<U, std::nullptr_t>::value;
+                case string:
+                case staticString:
+                    return std::is_convertible<U, const char *>::value;
+                default:
+                    return false;
+            }
+        }
+
+        // Encoded size of one argument, limit caps strings as in encode()
+        template<Kind kind, typename T>
+        static inline uint32_t size(const T &arg, uint32_t limit) {
+            if constexpr (kind == string) {
+                return StringFormat::captureSize(arg, limit);
+            } else {
+                return fixedSize(kind);
+            }
+        }
+
+        // Store one argument, return the next write position. Strings are cut
+        // to limit (0 for none) and to end.
+        template<Kind kind, typename T>
+        static inline char *encode(char *dst, char *end, uint32_t limit, const T &arg) {
+            if constexpr (kind == byte) {
+                uint8_t u8 = (uint8_t) arg;
+                memcpy(dst, &u8, sizeof(u8));
+                return dst + sizeof(u8);
+            } else if constexpr (kind == word) {
+                uint16_t u16 = (uint16_t) arg;
+                memcpy(dst, &u16, sizeof(u16));
+                return dst + sizeof(u16);
+            } else if constexpr (kind == int32 || kind == long32) {
+                uint32_t u32 = (uint32_t) arg;
+                memcpy(dst, &u32, sizeof(u32));
+                return dst + sizeof(u32);
+            } else if constexpr (kind == long64) {
+                uint64_t u64 = (uint64_t) arg;
+                memcpy(dst, &u64, sizeof(u64));
+                return dst + sizeof(u64);
+            } else if constexpr (kind == real) {
+                double d = arg;
+                memcpy(dst, &d, sizeof(d));
+                return dst + sizeof(d);
+            } else if constexpr (kind == pointer || kind == staticString) {
+                const void *ptr = arg;
+                memcpy(dst, &ptr, sizeof(ptr));
+                return dst + sizeof(ptr);
+            } else {
+                // Truncate rather than overflow the record
+                auto room = (uint32_t) std::max<ptrdiff_t>(end - dst - 1, 0);
+                if (!room) {
+                    *dst = 0;
+                    return dst + 1;
+                }
+                return dst + StringFormat::capture(dst, arg, limit ? std::min(limit, room) : room);
+            }
+        }
+    };
+}
+#endif //MEMLOG_STATICFORMAT_H
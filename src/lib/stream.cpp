@@ -17,15 +17,27 @@ limitations under the License.
 // Stream implementation
 //
 
+#include <algorithm>
 #include <cstring>
 #include <cstdlib>
+#include <cinttypes>
 #include <exception>
 #include <memory>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <zlib.h>
+#include "clock.h"
 #include "stream.h"
 
 using namespace memlog;
 
-Stream::Stream() : fileHandle_(nullptr) {
+Stream::Stream() : fileHandle_(nullptr), offset_(0) {
 }
 
 
@@ -52,6 +64,7 @@ void Stream::write(char *s, unsigned len) {
     if (written != len || ferror(fileHandle_)) {
         stats.ioWriteError++;
     }
+    offset_ += len;
 }
 
 void Stream::cleanup() {
@@ -69,9 +82,17 @@ int Stream::setFile(FILE *file) {
     }
     fileHandle_ = file;
 
+    // Not seekable, such as a pipe, counts from 0
+    off_t position = file ? ftello(file) : -1;
+    offset_ = position > 0 ? position : 0;
+
     return 0;
 }
 
+void Stream::close() {
+    cleanup();
+}
+
 Stream::Stats Stream::getStats() {
     return stats;
 }
@@ -88,6 +109,10 @@ Stream::~Stream() {
 }
 
 std::shared_ptr<Stream> Stream::create(FILE *file, Stream::CompressedMode mode) {
+    return create(file, mode, UringOptions());
+}
+
+std::shared_ptr<Stream> Stream::create(FILE *file, Stream::CompressedMode mode, const UringOptions &uring) {
     int ret;
     std::shared_ptr<Stream> ctx;
 
@@ -106,6 +131,20 @@ std::shared_ptr<Stream> Stream::create(FILE *file, Stream::CompressedMode mode)
                 return nullptr;
             }
             break;
+
+        case BUFFERED_COMPRESS:
+            ctx = std::make_shared<CompressedBuffered>();
+            if (!ctx) {
+                return nullptr;
+            }
+            break;
+
+        case BUFFERED_URING:
+            ctx = std::make_shared<UringBuffered>(uring);
+            if (!ctx) {
+                return nullptr;
+            }
+            break;
     }
 
     // Set FILE
@@ -183,6 +222,7 @@ void StreamBuffered::write(char *s, unsigned len) {
 
     memcpy(&buffer[bufferIdx], s, len);
     bufferIdx += len;
+    offset_ += len;
 }
 
 int StreamBuffered::empty() {
@@ -190,14 +230,600 @@ int StreamBuffered::empty() {
 }
 
 
+CompressedBuffered::CompressedBuffered()
+        : compressedBuffer(new char[LOG_STREAM_COMPRESSED_BUFFER_SIZE]),
+          compressedBufferSize(LOG_STREAM_COMPRESSED_BUFFER_SIZE), zstream_(new z_stream()),
+          busy_(false), stop_(false), members_(0), compressedBytes_(0), fileBase_(0) {
+    memset(&stats, 0, sizeof(stats));
+
+    // Window of 15 bits plus 16 for a gzip header
+    int ret = deflateInit2(zstream_, COMPRESSION_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        stats.zlibErrorNo = ret;
+        stats.zlibError++;
+        stats.zlibDeflateInitError++;
+    }
+
+    current_ = { std::unique_ptr<char[]>(new char[LOG_STREAM_BUFFER_SIZE]), 0 };
+    for (unsigned int i = 0; i < QUEUE_DEPTH; i++) {
+        free_.push_back({ std::unique_ptr<char[]>(new char[LOG_STREAM_BUFFER_SIZE]), 0 });
+    }
+    worker_ = std::thread(&CompressedBuffered::workerThread, this);
+}
+
+CompressedBuffered::~CompressedBuffered() {
+    cleanup();
+}
+
+void CompressedBuffered::write(char *s, unsigned len) {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    if (!fileHandle_) {
+        return;
+    }
+
+    offset_ += len;
+    while (len) {
+        unsigned int room = LOG_STREAM_BUFFER_SIZE - current_.length;
+        unsigned int length = len < room ? len : room;
+
+        memcpy(current_.data.get() + current_.length, s, length);
+        current_.length += length;
+        s += length;
+        len -= length;
+
+        if (current_.length == LOG_STREAM_BUFFER_SIZE) {
+            submit(lock);
+        }
+    }
+}
+
+// Queue the current buffer, waiting for a free one if the worker is behind
+void CompressedBuffered::submit(std::unique_lock<std::mutex> &lock) {
+    cond_.wait(lock, [this] { return !free_.empty(); });
+
+    pending_.push_back(std::move(current_));
+    current_ = std::move(free_.back());
+    current_.length = 0;
+    free_.pop_back();
+    cond_.notify_all();
+}
+
+int CompressedBuffered::flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    if (!fileHandle_) {
+        return 0;
+    }
+
+    if (current_.length) {
+        submit(lock);
+    }
+    cond_.wait(lock, [this] { return pending_.empty() && !busy_; });
+    lock.unlock();
+
+    stats.flushWriteCount++;
+    if (fflush(fileHandle_) != 0) {
+        stats.ioWriteError++;
+        return -1;
+    }
+    return 0;
+}
+
+void CompressedBuffered::compress(const Chunk &chunk) {
+    int ret = deflateReset(zstream_);
+
+    if (ret != Z_OK) {
+        stats.zlibErrorNo = ret;
+        stats.zlibError++;
+        stats.compressError++;
+        return;
+    }
+
+    zstream_->next_in = (Bytef *) chunk.data.get();
+    zstream_->avail_in = chunk.length;
+
+    do {
+        zstream_->next_out = (Bytef *) compressedBuffer;
+        zstream_->avail_out = compressedBufferSize;
+
+        ret = deflate(zstream_, Z_FINISH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            stats.zlibErrorNo = ret;
+            stats.zlibError++;
+            stats.zlibDeflateError++;
+            stats.compressError++;
+            return;
+        }
+
+        size_t length = compressedBufferSize - zstream_->avail_out;
+        if (fwrite(compressedBuffer, 1, length, fileHandle_) != length || ferror(fileHandle_)) {
+            stats.ioWriteError++;
+        }
+        __atomic_store_n(&compressedBytes_, compressedBytes_ + length, __ATOMIC_RELAXED);
+    } while (ret != Z_STREAM_END);
+
+    members_++;
+}
+
+void CompressedBuffered::workerThread() {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    while (true) {
+        cond_.wait(lock, [this] { return stop_ || !pending_.empty(); });
+        if (pending_.empty()) {
+            break;
+        }
+
+        Chunk chunk = std::move(pending_.front());
+        pending_.pop_front();
+        busy_ = true;
+
+        lock.unlock();
+        if (fileHandle_) {
+            compress(chunk);
+        }
+        lock.lock();
+
+        busy_ = false;
+        free_.push_back(std::move(chunk));
+        cond_.notify_all();
+    }
+}
+
+uint64_t CompressedBuffered::fileBytes() const {
+    return __atomic_load_n(&compressedBytes_, __ATOMIC_RELAXED) - fileBase_;
+}
+
+// Setting the file flushes, what is compressed from here on goes to file
+int CompressedBuffered::setFile(FILE *file) {
+    int ret = Stream::setFile(file);
+
+    fileBase_ = compressedBytes_ - offset_;
+    return ret;
+}
+
+void CompressedBuffered::dumpState(char *buffer, int length) const {
+    Stream::dumpState(buffer, length);
+    buffer += strlen(buffer);
+
+    buffer += sprintf(buffer, "Compressed members: %" PRIu64 "\n", members_);
+    buffer += sprintf(buffer, "Compressed bytes: %" PRIu64 " of %" PRIu64 "\n", compressedBytes_, offset_);
+}
+
 void CompressedBuffered::cleanup() {
+    flush();
+
+    if (worker_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cond_.notify_all();
+        worker_.join();
+    }
+
+    if (zstream_) {
+        deflateEnd(zstream_);
+        delete zstream_;
+        zstream_ = nullptr;
+    }
     if (compressedBuffer) {
         delete[] compressedBuffer;
         compressedBuffer = nullptr;
     }
+    fileHandle_ = nullptr;
 }
 
-CompressedBuffered::CompressedBuffered()
-        : compressedBuffer(new char[LOG_STREAM_COMPRESSED_BUFFER_SIZE]),
-          compressedBufferSize(LOG_STREAM_COMPRESSED_BUFFER_SIZE) {
+
+UringBuffered::UringBuffered(const UringOptions &options)
+        : options_(options), fd_(-1), fdFlags_(0), seekable_(false), direct_(false), registered_(false),
+          current_(0), ringFd_(-1), sqRing_(nullptr), cqRing_(nullptr), sqRingSize_(0), cqRingSize_(0),
+          sqHead_(nullptr), sqTail_(nullptr), sqMask_(nullptr), sqArray_(nullptr), sqes_(nullptr), sqesSize_(0),
+          cqHead_(nullptr), cqTail_(nullptr), cqMask_(nullptr), cqes_(nullptr), inFlight_(0), maxInFlight_(0),
+          submits_(0), completions_(0), shortWrites_(0), waits_(0), latencyNsec_(0), maxLatencyNsec_(0),
+          setupErrno_(0), registerErrno_(0), directErrno_(0) {
+    memset(&stats, 0, sizeof(stats));
+
+    if (options_.depth < 2) {
+        options_.depth = 2;
+    }
+    for (unsigned int i = 0; i < options_.depth; i++) {
+        // Aligned for O_DIRECT
+        char *data = (char *) aligned_alloc(DIRECT_BLOCK_SIZE, LOG_STREAM_BUFFER_SIZE);
+        if (!data) {
+            throw new std::exception();
+        }
+        buffers_.push_back({ data, 0, 0, 0, 0, 0, false, 0 });
+    }
+}
+
+UringBuffered::~UringBuffered() {
+    cleanup();
+    for (auto &buffer : buffers_) {
+        free(buffer.data);
+    }
+}
+
+int UringBuffered::setFile(FILE *file) {
+    struct stat st;
+
+    if (file == fileHandle_) {
+        return 0;
+    }
+    if (fd_ >= 0) {
+        // Switching files, such as on rotation: finish the previous one and
+        // keep the ring
+        flush();
+        if (seekable_) {
+            fcntl(fd_, F_SETFL, fdFlags_);
+        }
+        fd_ = -1;
+        direct_ = false;
+        buffers_[current_].length = buffers_[current_].start = 0;
+    }
+
+    Stream::setFile(file);
+    if (!file) {
+        return 0;
+    }
+
+    fd_ = fileno(file);
+    seekable_ = fstat(fd_, &st) == 0 && S_ISREG(st.st_mode);
+    if (!seekable_) {
+        // Pipes and terminals are written in order, one buffer at a time
+        return 0;
+    }
+
+    // Writes go to explicit offsets, an O_APPEND write would ignore them
+    fdFlags_ = fcntl(fd_, F_GETFL);
+    int flags = fdFlags_ & ~O_APPEND;
+    if (options_.direct) {
+        if (fcntl(fd_, F_SETFL, flags | O_DIRECT) == 0) {
+            direct_ = true;
+        } else {
+            directErrno_ = errno;
+        }
+    }
+    if (!direct_) {
+        fcntl(fd_, F_SETFL, flags);
+    }
+
+    Buffer &buffer = buffers_[current_];
+    buffer.offset = st.st_size;
+    if (direct_) {
+        // Start on a block boundary with the partial block already in the file
+        unsigned int carry = st.st_size % DIRECT_BLOCK_SIZE;
+        buffer.offset -= carry;
+        if (carry && pread(fd_, buffer.data, DIRECT_BLOCK_SIZE, buffer.offset) < carry) {
+            stats.ioErrorNo = errno;
+            stats.ioReadError++;
+        }
+        buffer.length = buffer.start = carry;
+    }
+
+    if (ringFd_ < 0 && !setupErrno_) {
+        setupErrno_ = setupRing();
+    }
+    return 0;
+}
+
+int UringBuffered::setupRing() {
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    ringFd_ = (int) syscall(__NR_io_uring_setup, options_.depth, &params);
+    if (ringFd_ < 0) {
+        return errno;
+    }
+
+    sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+    }
+
+    sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_,
+                   IORING_OFF_SQ_RING);
+    if (sqRing_ == MAP_FAILED) {
+        sqRing_ = nullptr;
+        closeRing();
+        return errno;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cqRing_ = sqRing_;
+    } else {
+        cqRing_ = mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_,
+                       IORING_OFF_CQ_RING);
+        if (cqRing_ == MAP_FAILED) {
+            cqRing_ = nullptr;
+            closeRing();
+            return errno;
+        }
+    }
+    sqesSize_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_ = (struct io_uring_sqe *) mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                         ringFd_, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED) {
+        sqes_ = nullptr;
+        closeRing();
+        return errno;
+    }
+
+    char *sq = (char *) sqRing_;
+    sqHead_ = (unsigned int *) (sq + params.sq_off.head);
+    sqTail_ = (unsigned int *) (sq + params.sq_off.tail);
+    sqMask_ = (unsigned int *) (sq + params.sq_off.ring_mask);
+    sqArray_ = (unsigned int *) (sq + params.sq_off.array);
+    char *cq = (char *) cqRing_;
+    cqHead_ = (unsigned int *) (cq + params.cq_off.head);
+    cqTail_ = (unsigned int *) (cq + params.cq_off.tail);
+    cqMask_ = (unsigned int *) (cq + params.cq_off.ring_mask);
+    cqes_ = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    if (options_.registerBuffers) {
+        // Pinned once instead of on every write, may exceed RLIMIT_MEMLOCK
+        std::vector<struct iovec> iovecs;
+        for (auto &buffer : buffers_) {
+            iovecs.push_back({ buffer.data, LOG_STREAM_BUFFER_SIZE });
+        }
+        if (syscall(__NR_io_uring_register, ringFd_, IORING_REGISTER_BUFFERS, iovecs.data(),
+                    (unsigned int) iovecs.size()) == 0) {
+            registered_ = true;
+        } else {
+            registerErrno_ = errno;
+        }
+    }
+    return 0;
+}
+
+void UringBuffered::closeRing() {
+    if (sqes_) {
+        munmap(sqes_, sqesSize_);
+        sqes_ = nullptr;
+    }
+    if (cqRing_ && cqRing_ != sqRing_) {
+        munmap(cqRing_, cqRingSize_);
+    }
+    cqRing_ = nullptr;
+    if (sqRing_) {
+        munmap(sqRing_, sqRingSize_);
+        sqRing_ = nullptr;
+    }
+    if (ringFd_ >= 0) {
+        ::close(ringFd_);
+        ringFd_ = -1;
+    }
+    registered_ = false;
+}
+
+void UringBuffered::write(char *s, unsigned len) {
+    if (fd_ < 0) {
+        return;
+    }
+
+    offset_ += len;
+    while (len) {
+        Buffer &buffer = buffers_[current_];
+        unsigned int room = LOG_STREAM_BUFFER_SIZE - buffer.length;
+        unsigned int length = len < room ? len : room;
+
+        memcpy(buffer.data + buffer.length, s, length);
+        buffer.length += length;
+        s += length;
+        len -= length;
+
+        if (buffer.length == LOG_STREAM_BUFFER_SIZE) {
+            submit(current_);
+            advance();
+        }
+    }
+}
+
+// Move to the next buffer, waiting for its write to complete
+void UringBuffered::advance() {
+    Buffer &previous = buffers_[current_];
+    // A partial block under O_DIRECT is written again with what follows
+    unsigned int carry = direct_ ? previous.length % DIRECT_BLOCK_SIZE : 0;
+    unsigned int next = (current_ + 1) % buffers_.size();
+
+    if (buffers_[next].busy) {
+        waits_++;
+        do {
+            reap(true);
+        } while (buffers_[next].busy);
+    }
+
+    Buffer &buffer = buffers_[next];
+    memcpy(buffer.data, previous.data + previous.length - carry, carry);
+    buffer.offset = previous.offset + previous.length - carry;
+    buffer.length = buffer.start = carry;
+    current_ = next;
+}
+
+void UringBuffered::submit(unsigned int index) {
+    Buffer &buffer = buffers_[index];
+
+    buffer.submitted = buffer.length;
+    if (direct_) {
+        // Whole blocks, the padding is cut by the next flush
+        buffer.submitted = (buffer.length + DIRECT_BLOCK_SIZE - 1) & ~(DIRECT_BLOCK_SIZE - 1);
+        memset(buffer.data + buffer.length, 0, buffer.submitted - buffer.length);
+    }
+    buffer.written = 0;
+    buffer.busy = true;
+    buffer.submitNsec = Clock::monotonicNsec();
+
+    submits_++;
+    inFlight_++;
+    if (inFlight_ > maxInFlight_) {
+        maxInFlight_ = inFlight_;
+    }
+
+    if (ringFd_ < 0) {
+        writeSync(index);
+        return;
+    }
+    queue(index);
+}
+
+void UringBuffered::queue(unsigned int index) {
+    Buffer &buffer = buffers_[index];
+    unsigned int tail = *sqTail_;
+    unsigned int slot = tail & *sqMask_;
+    struct io_uring_sqe *sqe = &sqes_[slot];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = registered_ ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = fd_;
+    sqe->addr = (uint64_t) (uintptr_t) (buffer.data + buffer.written);
+    sqe->len = buffer.submitted - buffer.written;
+    sqe->off = buffer.offset + buffer.written;
+    sqe->buf_index = registered_ ? index : 0;
+    sqe->user_data = index;
+    sqArray_[slot] = slot;
+    __atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE);
+
+    int ret;
+    do {
+        ret = (int) syscall(__NR_io_uring_enter, ringFd_, 1, 0, 0, nullptr, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        // Not consumed, take the entry back and write it here
+        __atomic_store_n(sqTail_, tail, __ATOMIC_RELEASE);
+        stats.ioErrorNo = errno;
+        stats.ioError++;
+        writeSync(index);
+    }
+}
+
+void UringBuffered::writeSync(unsigned int index) {
+    Buffer &buffer = buffers_[index];
+
+    while (buffer.written < buffer.submitted) {
+        ssize_t ret;
+        char *data = buffer.data + buffer.written;
+        size_t length = buffer.submitted - buffer.written;
+
+        if (seekable_) {
+            ret = pwrite(fd_, data, length, buffer.offset + buffer.written);
+        } else {
+            ret = ::write(fd_, data, length);
+        }
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            stats.ioErrorNo = ret < 0 ? errno : EIO;
+            stats.ioWriteError++;
+            break;
+        }
+        buffer.written += ret;
+    }
+    retire(index);
+}
+
+// Completion of a write submitted to the ring
+void UringBuffered::complete(unsigned int index, int result) {
+    Buffer &buffer = buffers_[index];
+
+    if (result <= 0) {
+        stats.ioErrorNo = result < 0 ? -result : EIO;
+        stats.ioWriteError++;
+    } else {
+        buffer.written += result;
+        if (buffer.written < buffer.submitted) {
+            shortWrites_++;
+            queue(index);
+            return;
+        }
+    }
+    retire(index);
+}
+
+void UringBuffered::retire(unsigned int index) {
+    Buffer &buffer = buffers_[index];
+    uint64_t latency = Clock::monotonicNsec() - buffer.submitNsec;
+    latencyNsec_ += latency;
+    if (latency > maxLatencyNsec_) {
+        maxLatencyNsec_ = latency;
+    }
+    completions_++;
+    inFlight_--;
+    buffer.busy = false;
+}
+
+void UringBuffered::reap(bool wait) {
+    if (wait) {
+        int ret;
+        do {
+            ret = (int) syscall(__NR_io_uring_enter, ringFd_, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        } while (ret < 0 && errno == EINTR);
+    }
+
+    unsigned int head = *cqHead_;
+    while (head != __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &cqes_[head & *cqMask_];
+        unsigned int index = (unsigned int) cqe->user_data;
+        int result = cqe->res;
+
+        head++;
+        __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+        complete(index, result);
+    }
+}
+
+int UringBuffered::flush() {
+    if (fd_ < 0) {
+        return 0;
+    }
+
+    Buffer &buffer = buffers_[current_];
+    if (buffer.length > buffer.start) {
+        submit(current_);
+        advance();
+    }
+    while (inFlight_) {
+        reap(true);
+    }
+
+    stats.flushWriteCount++;
+    if (direct_) {
+        Buffer &last = buffers_[current_];
+        if (ftruncate(fd_, last.offset + last.length) != 0) {
+            stats.ioErrorNo = errno;
+            stats.ioError++;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void UringBuffered::dumpState(char *buffer, int length) const {
+    Stream::dumpState(buffer, length);
+    buffer += strlen(buffer);
+
+    buffer += sprintf(buffer, "Uring: %s%s%s\n", ringFd_ >= 0 ? "on" : "off (pwrite)",
+                      direct_ ? ", direct" : "", registered_ ? ", registered buffers" : "");
+    buffer += sprintf(buffer, "Uring setup error no: %d\n", setupErrno_);
+    buffer += sprintf(buffer, "Uring register error no: %d\n", registerErrno_);
+    buffer += sprintf(buffer, "Uring direct error no: %d\n", directErrno_);
+    buffer += sprintf(buffer, "Uring writes: %" PRIu64 " completed %" PRIu64 "\n", submits_, completions_);
+    buffer += sprintf(buffer, "Uring short writes: %" PRIu64 "\n", shortWrites_);
+    buffer += sprintf(buffer, "Uring in flight: %u max %u of %u\n", inFlight_, maxInFlight_, options_.depth);
+    buffer += sprintf(buffer, "Uring waits for a buffer: %" PRIu64 "\n", waits_);
+    buffer += sprintf(buffer, "Uring completion latency usec: avg %" PRIu64 " max %" PRIu64 "\n",
+                      completions_ ? latencyNsec_ / completions_ / 1000 : 0, maxLatencyNsec_ / 1000);
+}
+
+void UringBuffered::cleanup() {
+    flush();
+    closeRing();
+
+    if (fd_ >= 0 && seekable_) {
+        // Back to appending for whoever writes the file next
+        fcntl(fd_, F_SETFL, fdFlags_);
+    }
+    fd_ = -1;
+    fileHandle_ = nullptr;
 }
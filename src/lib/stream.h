@@ -23,8 +23,17 @@ limitations under the License.
 #include <stdint.h>
 #include <stdio.h>
 #include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <vector>
 #include "stream.h"
 
+struct z_stream_s;
+struct io_uring_sqe;
+struct io_uring_cqe;
+
 namespace memlog {
 
     class Stream {
@@ -44,6 +53,10 @@ namespace memlog {
         enum CompressedMode {
             UNCOMPRESSED,
             BUFFERED_UNCOMPRESS,
+            // gzip, one member per buffer
+            BUFFERED_COMPRESS,
+            // Aligned buffers written through io_uring, several in flight
+            BUFFERED_URING,
             DEFAULT = UNCOMPRESSED
         };
 
@@ -62,26 +75,51 @@ namespace memlog {
         };
         Stream::Stats stats;
 
+        // Settings of the BUFFERED_URING writer
+        struct UringOptions {
+            // Buffers of LOG_STREAM_BUFFER_SIZE bytes, each one write in flight
+            uint32_t depth = 4;
+            // O_DIRECT, the last partial block is padded and written again
+            // with the data that follows
+            bool direct = false;
+            bool registerBuffers = true;
+        };
+
         static std::shared_ptr<Stream> create(FILE *file, Stream::CompressedMode mode = UNCOMPRESSED);
 
+        static std::shared_ptr<Stream> create(FILE *file, Stream::CompressedMode mode, const UringOptions &uring);
+
         virtual void write(char *s, unsigned len);
 
         virtual int flush();
 
         Stream::Stats getStats();
 
+        // Offset in the file of the next byte written, counted from the file
+        // position when it was set
+        inline uint64_t tell() const { return offset_; }
+
+        // Size of the file as far as written, as tell() unless the stream
+        // compresses
+        virtual uint64_t fileBytes() const { return offset_; }
+
         virtual void dumpState(char *buffer, int length) const;
 
+        // Write out what is buffered and detach the file, the caller closes it
+        void close();
+
+        // Write out what is buffered to the current file and go on with file
+        virtual int setFile(FILE *file);
+
         Stream();
 
-        ~Stream();
+        virtual ~Stream();
 
     protected:
         FILE *fileHandle_;
+        uint64_t offset_;
 
         virtual void cleanup();
-
-        int setFile(FILE *file);
     };
 
     class StreamBuffered : public Stream {
@@ -110,17 +148,160 @@ namespace memlog {
     };
 
 
+    // Writes are gathered in buffers of LOG_STREAM_BUFFER_SIZE bytes, each
+    // compressed by a worker thread into its own gzip member. Members decompress
+    // independently, so a truncated file stays readable up to its last member.
     class CompressedBuffered : public Stream {
     public:
+        static constexpr int COMPRESSION_LEVEL = 1;
+        // Buffers waiting for the worker before write() blocks
+        static constexpr unsigned int QUEUE_DEPTH = 4;
+
+        void write(char *s, unsigned len) override;
+
+        // Compress what is buffered and wait until it is written
+        int flush() override;
+
+        void dumpState(char *buffer, int length) const override;
+
+        // Compressed bytes written to the file, behind tell() by what the
+        // worker has not compressed yet
+        uint64_t fileBytes() const override;
+
+        int setFile(FILE *file) override;
+
         CompressedBuffered();
 
+        ~CompressedBuffered() override;
+
     protected:
         void cleanup() override;
 
         char *compressedBuffer;
 
     private:
+        struct Chunk {
+            std::unique_ptr<char[]> data;
+            unsigned int length;
+        };
+
         unsigned int compressedBufferSize;
+        z_stream_s *zstream_;
+        std::mutex mutex_;
+        std::condition_variable cond_;
+        Chunk current_;
+        std::deque<Chunk> pending_;
+        std::vector<Chunk> free_;
+        bool busy_;
+        bool stop_;
+        std::thread worker_;
+        uint64_t members_;
+        uint64_t compressedBytes_;
+        // compressedBytes_ less the file position when the file was set
+        uint64_t fileBase_;
+
+        void submit(std::unique_lock<std::mutex> &lock);
+
+        void compress(const Chunk &chunk);
+
+        void workerThread();
+    };
+
+
+    // Writes are gathered in aligned buffers of LOG_STREAM_BUFFER_SIZE bytes and
+    // submitted to an io_uring at explicit file offsets, so the collector goes
+    // on formatting while earlier buffers are written. The stream owns the end
+    // of the file, nothing else may append to it. Falls back to pwrite() when
+    // io_uring is not available.
+    class UringBuffered : public Stream {
+    public:
+        static constexpr unsigned int DIRECT_BLOCK_SIZE = 4096;
+
+        void write(char *s, unsigned len) override;
+
+        // Submit what is buffered and wait until every write completed
+        int flush() override;
+
+        void dumpState(char *buffer, int length) const override;
+
+        explicit UringBuffered(const UringOptions &options);
+
+        ~UringBuffered() override;
+
+        int setFile(FILE *file) override;
+
+    protected:
+        void cleanup() override;
+
+    private:
+        struct Buffer {
+            char *data;
+            // File offset of data[0]
+            uint64_t offset;
+            unsigned int length;
+            // Bytes at the start already in the file, the carried partial block
+            unsigned int start;
+            // Bytes of the write in flight, and completed so far
+            unsigned int submitted;
+            unsigned int written;
+            bool busy;
+            uint64_t submitNsec;
+        };
+
+        UringOptions options_;
+        int fd_;
+        int fdFlags_;
+        bool seekable_;
+        bool direct_;
+        bool registered_;
+        std::vector<Buffer> buffers_;
+        unsigned int current_;
+
+        int ringFd_;
+        void *sqRing_;
+        void *cqRing_;
+        size_t sqRingSize_;
+        size_t cqRingSize_;
+        unsigned int *sqHead_;
+        unsigned int *sqTail_;
+        unsigned int *sqMask_;
+        unsigned int *sqArray_;
+        io_uring_sqe *sqes_;
+        size_t sqesSize_;
+        unsigned int *cqHead_;
+        unsigned int *cqTail_;
+        unsigned int *cqMask_;
+        io_uring_cqe *cqes_;
+
+        unsigned int inFlight_;
+        unsigned int maxInFlight_;
+        uint64_t submits_;
+        uint64_t completions_;
+        uint64_t shortWrites_;
+        uint64_t waits_;
+        uint64_t latencyNsec_;
+        uint64_t maxLatencyNsec_;
+        int setupErrno_;
+        int registerErrno_;
+        int directErrno_;
+
+        int setupRing();
+
+        void closeRing();
+
+        void submit(unsigned int index);
+
+        void queue(unsigned int index);
+
+        void writeSync(unsigned int index);
+
+        void complete(unsigned int index, int result);
+
+        void retire(unsigned int index);
+
+        void reap(bool wait);
+
+        void advance();
     };
 }
 #endif //ASYNCLOG_STREAM_H
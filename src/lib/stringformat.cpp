@@ -19,7 +19,9 @@ limitations under the License.
 #include <cstdint>
 #include <cstdarg>
 #include <assert.h>
+#include <algorithm>
 #include <cctype>
+#include <cmath>
 #include <cstring>
 #include <cstdio>
 #include "stringformat.h"
@@ -27,17 +29,131 @@ limitations under the License.
 
 using namespace memlog;
 
+static_assert((StringFormat::CACHE_SIZE & (StringFormat::CACHE_SIZE - 1)) == 0, "Cache size is a power of two");
+
+static const char DIGIT_PAIRS[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+
+static const uint64_t POWERS_OF_10[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+                                         1000000000 };
+
+// Widest width or precision rendered without sprintf()
+static constexpr int MAX_FAST_WIDTH = 64;
+
+// Write the digits of value backwards from end, return the first one
+static char *toDigits(uint64_t value, char conversion, char *end) {
+    char *p = end;
+
+    switch (conversion) {
+        case 'x':
+        case 'X': {
+            const char *hex = conversion == 'x' ? "0123456789abcdef" : "0123456789ABCDEF";
+            do {
+                *--p = hex[value & 0xf];
+                value >>= 4;
+            } while (value);
+            break;
+        }
+
+        case 'o':
+            do {
+                *--p = (char) ('0' + (value & 7));
+                value >>= 3;
+            } while (value);
+            break;
+
+        default:
+            while (value >= 100) {
+                p -= 2;
+                memcpy(p, &DIGIT_PAIRS[(value % 100) * 2], 2);
+                value /= 100;
+            }
+            if (value >= 10) {
+                p -= 2;
+                memcpy(p, &DIGIT_PAIRS[value * 2], 2);
+            } else {
+                *--p = (char) ('0' + value);
+            }
+            break;
+    }
+    return p;
+}
+
+// Sign or prefix, zeros, then body, padded to width as printf() does
+static char *pad(char *dst, int width, bool left, bool zeroPad, const char *prefix, int prefixLength,
+                 int zeros, const char *body, int bodyLength) {
+    int length = prefixLength + zeros + bodyLength;
+    int padding = width > length ? width - length : 0;
+
+    if (zeroPad) {
+        zeros += padding;
+        padding = 0;
+    }
+    if (!left && padding) {
+        memset(dst, ' ', padding);
+        dst += padding;
+    }
+    memcpy(dst, prefix, prefixLength);
+    dst += prefixLength;
+    memset(dst, '0', zeros);
+    dst += zeros;
+    memcpy(dst, body, bodyLength);
+    dst += bodyLength;
+    if (left && padding) {
+        memset(dst, ' ', padding);
+        dst += padding;
+    }
+    return dst;
+}
+
+char *StringFormat::formatDecimal(char *dst, uint64_t value, int width) {
+    char digits[24];
+    char *end = digits + sizeof(digits);
+    char *first = toDigits(value, 'd', end);
+
+    return pad(dst, width, false, true, "", 0, 0, first, (int) (end - first));
+}
+
+StringFormat::StringFormat()
+        : getStringCorruptedCount(0), maxStringLength_(0), staticStrings_(STATIC_POINTER),
+          cache_(new std::atomic<Program *>[CACHE_SIZE]), uncachedCount_(0) {
+    for (uint32_t i = 0; i < CACHE_SIZE; i++) {
+        cache_[i].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+StringFormat::~StringFormat() {
+    for (uint32_t i = 0; i < CACHE_SIZE; i++) {
+        delete cache_[i].load(std::memory_order_relaxed);
+    }
+}
+
 // Store variable length arguments into args buffer
-void StringFormat::encodeToArgsBuffer(const char *format, va_list args, char **argsBuffer) {
+void StringFormat::encodeToArgsBuffer(const char *format, va_list args, char **argsBuffer, StringRoom *room) {
+    *argsBuffer += walkArgs(format, args, *argsBuffer, room);
+}
+
+// Size of the encoded arguments, args is consumed
+uint32_t StringFormat::getArgsBufferSize(const char *format, va_list args, StringRoom *strings) {
+    return walkArgs(format, args, nullptr, strings);
+}
+
+// Encode the arguments into argsBuffer, or only size them if argsBuffer is
+// NULL. Return the encoded length.
+uint32_t StringFormat::walkArgs(const char *format, va_list args, char *argsBuffer, StringRoom *room) {
     int i{ 0 };
     bool insidePercent{ false };
+    bool alternate{ false };
     uint8_t u8;
     uint16_t u16;
     uint32_t u32;
     uint64_t u64;
     double d;
     void *ptr;
-    char *dst{ *argsBuffer };
+    uint32_t length{ 0 };
+    auto dst = [argsBuffer, &length]() { return argsBuffer ? argsBuffer + length : nullptr; };
 
     while (format[i] != 0) {
         if (format[i] == '%') {
@@ -46,6 +162,7 @@ void StringFormat::encodeToArgsBuffer(const char *format, va_list args, char **a
                 goto next;
             }
             insidePercent = true;
+            alternate = false;
             goto next;
         }
 
@@ -60,13 +177,13 @@ void StringFormat::encodeToArgsBuffer(const char *format, va_list args, char **a
                         case 'X':
                         case 'u':
                             u16 = va_arg(args, unsigned int);
-                            dst += memSetWord(dst, u16);
+                            length += memSetWord(dst(), u16);
                             break;
 
                         case 'd':
                         case 'i':
                             u16 = va_arg(args, int);
-                            dst += memSetWord(dst, u16);
+                            length += memSetWord(dst(), u16);
                             break;
 
                         case 'h':
@@ -75,7 +192,7 @@ void StringFormat::encodeToArgsBuffer(const char *format, va_list args, char **a
                                 (format[i+2] == 'u') ||
                                 (format[i+2] == 'o')) {
                                 u16 = va_arg(args, unsigned int);
-                                dst += memSetWord(dst, u16);
+                                length += memSetWord(dst(), u16);
                                 continue;
                             }
                             break;
@@ -87,7 +204,7 @@ void StringFormat::encodeToArgsBuffer(const char *format, va_list args, char **a
 
                 case 'c':
                     u8 = va_arg(args, int);
-                    dst += memSetByte(dst, u8);
+                    length += memSetByte(dst(), u8);
                     break;
 
                 case 'd':
@@ -96,22 +213,26 @@ void StringFormat::encodeToArgsBuffer(const char *format, va_list args, char **a
                 case 'x':
                 case 'X':
                     u32 = va_arg(args, unsigned int);
-                    dst += memSetInt(dst, u32);
+                    length += memSetInt(dst(), u32);
                     break;
 
                 case 'f':
                     d = va_arg(args, double);
-                    dst += memSetDouble(dst, d);
+                    length += memSetDouble(dst(), d);
                     break;
 
                 case 'p':
                     ptr = va_arg(args, void *);
-                    dst += memSetPtr(dst, ptr);
+                    length += memSetPtr(dst(), ptr);
                     break;
 
                 case 's':
                     ptr = va_arg(args, char *);
-                    dst += memSetString(dst, (const char *) ptr);
+                    if (alternate) {
+                        length += memSetStatic(dst(), (const char *) ptr);
+                    } else {
+                        length += memSetString(dst(), (const char *) ptr, room);
+                    }
                     break;
 
                 case 'l':
@@ -124,7 +245,7 @@ void StringFormat::encodeToArgsBuffer(const char *format, va_list args, char **a
                                 (format[i+2] == 'u')) {
                                 i += 2;
                                 u64 = va_arg(args, long long);
-                                dst += memSetLong64(dst, u64);
+                                length += memSetLong64(dst(), u64);
                                 continue;
                             }
                             break;
@@ -135,12 +256,12 @@ void StringFormat::encodeToArgsBuffer(const char *format, va_list args, char **a
                         case 'i':
                         case 'u':
                             u32 = va_arg(args, unsigned int);
-                            dst += memSetInt(dst, u32);
+                            length += memSetInt(dst(), u32);
                             break;
 
                         case 'f':
                             d = va_arg(args, double);
-                            dst += memSetDouble(dst, d);
+                            length += memSetDouble(dst(), d);
                             break;
 
                         default:
@@ -153,6 +274,7 @@ void StringFormat::encodeToArgsBuffer(const char *format, va_list args, char **a
                     if (format[i] == '-' || format[i] == '+' || format[i] == ' ' || format[i] == '#' ||
                         format[i] == '.' || (isdigit(format[i]))) {
                         insidePercent = true;
+                        alternate |= format[i] == '#';
                         goto next;
                     }
 
@@ -167,7 +289,7 @@ void StringFormat::encodeToArgsBuffer(const char *format, va_list args, char **a
         i++;
     }
 
-    *argsBuffer = dst;
+    return length;
 }
 
 uint32_t StringFormat::indexInc(uint32_t index, uint32_t v) {
@@ -202,6 +324,542 @@ uint32_t StringFormat::decodeFromArgsBuffer(const char *format,
                                             char *outputString,
                                             int outputStringMaxLength,
                                             int *outputStringLength) {
+    const Program *program = getProgram(format);
+
+    if (!program) {
+        return interpret(format, argsBuffer, argsBufferIndexPtr, outputString, outputStringMaxLength,
+                         outputStringLength);
+    }
+    return execute(*program, argsBuffer, argsBufferIndexPtr, outputString, outputStringMaxLength,
+                   outputStringLength);
+}
+
+// Open addressing on the format pointer, programs are only added
+const StringFormat::Program *StringFormat::getProgram(const char *format) {
+    uint32_t slot = (uint32_t) ((((uintptr_t) format >> 3) * 0x9e3779b97f4a7c15ULL) >> 40);
+    Program *compiled = nullptr;
+
+    for (uint32_t probe = 0; probe < CACHE_PROBES; probe++) {
+        std::atomic<Program *> &entry = cache_[(slot + probe) & (CACHE_SIZE - 1)];
+        Program *program = entry.load(std::memory_order_acquire);
+
+        if (!program) {
+            if (!compiled) {
+                compiled = compile(format);
+            }
+            if (entry.compare_exchange_strong(program, compiled, std::memory_order_acq_rel)) {
+                return compiled;
+            }
+            // Another thread took the slot, program is its entry
+        }
+        if (program->format == format) {
+            delete compiled;
+            return program;
+        }
+    }
+
+    delete compiled;
+    uncachedCount_.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+}
+
+// Same grammar as interpret(), a token it does not consume is literal text
+StringFormat::Program *StringFormat::compile(const char *format) {
+    auto *program = new Program{ format, std::string(), std::vector<Step>(), false };
+    uint32_t i = 0;
+    uint32_t literalOffset = 0;
+
+    while (format[i] != 0) {
+        uint32_t start = i;
+        ArgType arg = ARG_NONE;
+        bool percent = false;
+
+        if (format[i] == '%') {
+            i++;
+            if (format[i] == '0' || format[i] == ' ' || format[i] == '#' || format[i] == '-' || format[i] == '+') {
+                i++;
+            }
+            while (isdigit(format[i])) {
+                i++;
+            }
+            if (format[i] == '.') {
+                i++;
+            }
+            while (isdigit(format[i])) {
+                i++;
+            }
+
+            switch (format[i]) {
+                case 'h':
+                    i++;
+                    switch (format[i]) {
+                        case 'd':
+                        case 'u':
+                        case 'x':
+                        case 'X':
+                        case 'o':
+                        case 'i':
+                            i++;
+                            arg = ARG_WORD;
+                            break;
+                        case 'h':
+                            i++;
+                            if (format[i] == 'x' || format[i] == 'X' || format[i] == 'u' || format[i] == 'o') {
+                                i++;
+                                arg = ARG_WORD;
+                            }
+                            break;
+                    }
+                    break;
+
+                case 'c':
+                    i++;
+                    arg = ARG_BYTE;
+                    break;
+
+                case 'd':
+                case 'u':
+                case 'i':
+                case 'x':
+                case 'X':
+                    i++;
+                    arg = ARG_INT;
+                    break;
+
+                case 'f':
+                    i++;
+                    arg = ARG_DOUBLE;
+                    break;
+
+                case 'p':
+                    i++;
+                    arg = ARG_PTR;
+                    break;
+
+                case 's':
+                    i++;
+                    arg = ARG_STRING;
+                    break;
+
+                case 'l':
+                    i++;
+                    switch (format[i]) {
+                        case 'l':
+                            i++;
+                            if (format[i] == 'd' || format[i] == 'i' || format[i] == 'x' || format[i] == 'u' ||
+                                format[i] == 'X') {
+                                i++;
+                                arg = ARG_LONG64;
+                            }
+                            break;
+                        case 'd':
+                        case 'u':
+                        case 'i':
+                        case 'x':
+                        case 'X':
+                            i++;
+                            arg = ARG_INT;
+                            break;
+                        case 'f':
+                            i++;
+                            arg = ARG_DOUBLE;
+                            break;
+                    }
+                    break;
+
+                case '%':
+                    i++;
+                    percent = true;
+                    break;
+            }
+        }
+
+        if (percent) {
+            program->literals += '%';
+            continue;
+        }
+        if (arg == ARG_NONE) {
+            i = start;
+            program->literals += format[i];
+            i++;
+            continue;
+        }
+
+        Step step{};
+        step.literalOffset = literalOffset;
+        step.literalLength = program->literals.size() - literalOffset;
+        literalOffset = program->literals.size();
+        step.arg = arg;
+        step.conversion = format[i - 1];
+        size_t specLength = std::min<size_t>(i - start, sizeof(step.spec) - 1);
+        memcpy(step.spec, &format[start], specLength);
+        step.spec[specLength] = 0;
+
+        // The token as printf() reads it, a width may start with more zeros
+        const char *t = &format[start + 1];
+        for (; *t && strchr("-0+ #", *t); t++) {
+            step.flags |= *t == '-' ? FLAG_LEFT : *t == '0' ? FLAG_ZERO : *t == '+' ? FLAG_PLUS :
+                          *t == ' ' ? FLAG_SPACE : FLAG_ALT;
+        }
+        for (; isdigit(*t); t++) {
+            step.width = std::min(step.width * 10 + (*t - '0'), MAX_FAST_WIDTH + 1);
+        }
+        step.precision = -1;
+        if (*t == '.') {
+            step.precision = 0;
+            for (t++; isdigit(*t); t++) {
+                step.precision = std::min(step.precision * 10 + (*t - '0'), MAX_FAST_WIDTH + 1);
+            }
+        }
+        for (; *t == 'h'; t++) {
+            step.halves++;
+        }
+        for (; *t == 'l'; t++) {
+            step.longs++;
+        }
+        if (arg == ARG_STRING && (step.flags & FLAG_ALT)) {
+            step.arg = ARG_STATIC;
+            program->hasStatic = true;
+        }
+
+        bool plain = !step.flags && !step.width && step.precision < 0;
+        step.fast = i - start < sizeof(step.spec) && step.width <= MAX_FAST_WIDTH &&
+                    step.precision <= MAX_FAST_WIDTH;
+        if (arg == ARG_BYTE || arg == ARG_PTR) {
+            step.fast = step.fast && plain;
+        }
+        program->steps.push_back(step);
+    }
+
+    if (program->literals.size() > literalOffset || program->steps.empty()) {
+        Step step{};
+        step.literalOffset = literalOffset;
+        step.literalLength = program->literals.size() - literalOffset;
+        step.arg = ARG_NONE;
+        program->steps.push_back(step);
+    }
+    return program;
+}
+
+char *StringFormat::formatInteger(char *dst, const Step &step, uint64_t magnitude, bool negative) {
+    char digits[24];
+    char *end = digits + sizeof(digits);
+    char *first = end;
+    char prefix[2];
+    int prefixLength = 0;
+
+    if (magnitude || step.precision != 0) {
+        first = toDigits(magnitude, step.conversion, end);
+    }
+    int length = (int) (end - first);
+    int zeros = step.precision > length ? step.precision - length : 0;
+
+    if (step.conversion == 'd' || step.conversion == 'i') {
+        if (negative) {
+            prefix[prefixLength++] = '-';
+        } else if (step.flags & FLAG_PLUS) {
+            prefix[prefixLength++] = '+';
+        } else if (step.flags & FLAG_SPACE) {
+            prefix[prefixLength++] = ' ';
+        }
+    } else if (step.flags & FLAG_ALT) {
+        if (step.conversion == 'o' && !zeros && (!length || *first != '0')) {
+            zeros = 1;
+        } else if ((step.conversion == 'x' || step.conversion == 'X') && magnitude) {
+            prefix[prefixLength++] = '0';
+            prefix[prefixLength++] = step.conversion;
+        }
+    }
+
+    bool zeroPad = (step.flags & FLAG_ZERO) && !(step.flags & FLAG_LEFT) && step.precision < 0;
+    return pad(dst, step.width, step.flags & FLAG_LEFT, zeroPad, prefix, prefixLength, zeros, first, length);
+}
+
+// Exact %f of a value below 2^63 with up to 9 decimals, rounded half to even
+// as printf() does. Return NULL for sprintf() to render it.
+char *StringFormat::formatFixed(char *dst, const Step &step, double d) {
+    int precision = step.precision < 0 ? 6 : step.precision;
+
+    if (!std::isfinite(d) || std::fabs(d) >= 0x1p63 || precision > 9) {
+        return nullptr;
+    }
+
+    // |d| = mantissa * 2^exponent exactly
+    int exponent;
+    double fraction = std::frexp(std::fabs(d), &exponent);
+    auto mantissa = (uint64_t) std::ldexp(fraction, 53);
+    exponent -= 53;
+
+    uint64_t scale = POWERS_OF_10[precision];
+    unsigned __int128 scaled = (unsigned __int128) mantissa * scale;
+    unsigned __int128 rounded;
+    if (exponent >= 0) {
+        rounded = scaled << exponent;
+    } else if (exponent < -100) {
+        // Below 2^-17, rounds to zero at 9 decimals
+        rounded = 0;
+    } else {
+        unsigned __int128 half = (unsigned __int128) 1 << (-exponent - 1);
+        unsigned __int128 rest = scaled & ((half << 1) - 1);
+        rounded = scaled >> -exponent;
+        if (rest > half || (rest == half && (rounded & 1))) {
+            rounded++;
+        }
+    }
+
+    char body[48];
+    char *end = body + sizeof(body);
+    char *first = end;
+    if (precision) {
+        first = toDigits((uint64_t) (rounded % scale), 'd', end);
+        while (end - first < precision) {
+            *--first = '0';
+        }
+    }
+    if (precision || (step.flags & FLAG_ALT)) {
+        *--first = '.';
+    }
+    first = toDigits((uint64_t) (rounded / scale), 'd', first);
+
+    char prefix[1];
+    int prefixLength = 0;
+    if (std::signbit(d)) {
+        prefix[prefixLength++] = '-';
+    } else if (step.flags & FLAG_PLUS) {
+        prefix[prefixLength++] = '+';
+    } else if (step.flags & FLAG_SPACE) {
+        prefix[prefixLength++] = ' ';
+    }
+
+    bool zeroPad = (step.flags & FLAG_ZERO) && !(step.flags & FLAG_LEFT);
+    return pad(dst, step.width, step.flags & FLAG_LEFT, zeroPad, prefix, prefixLength, 0, first, (int) (end - first));
+}
+
+// Text of a %#s pointer, cut so that the line stays within
+// LOG_MAX_LOG_TRACE_LINE after written bytes
+char *StringFormat::formatStatic(char *dst, const char *s, size_t written) {
+    if (staticStrings_ == STATIC_FOREIGN) {
+        return dst + sprintf(dst, "(static %p)", s);
+    }
+
+    size_t room = written < LOG_MAX_LOG_TRACE_LINE ? LOG_MAX_LOG_TRACE_LINE - written : 0;
+    auto limit = (uint32_t) std::min<size_t>(MAX_STATIC_STRING, std::max<size_t>(room, 1));
+    return dst + capture(dst, s, limit) - 1;
+}
+
+uint32_t StringFormat::inlineStatic(const char *format, const uint8_t *args, uint32_t length, char *dst,
+                                    uint32_t maxLength) {
+    const Program *program = getProgram(format);
+    std::unique_ptr<Program> uncached;
+
+    if (!program) {
+        uncached.reset(compile(format));
+        program = uncached.get();
+    }
+    if (!program->hasStatic || length > maxLength) {
+        length = std::min(length, maxLength);
+        memcpy(dst, args, length);
+        return length;
+    }
+
+    // What is left of args always fits, a pointer gives its room to the text
+    uint32_t index = 0;
+    uint32_t written = 0;
+    for (const Step &step : program->steps) {
+        uint32_t size = 0;
+
+        switch (step.arg) {
+            case ARG_NONE:
+                break;
+            case ARG_BYTE:
+                size = sizeof(uint8_t);
+                break;
+            case ARG_WORD:
+                size = sizeof(uint16_t);
+                break;
+            case ARG_INT:
+                size = sizeof(uint32_t);
+                break;
+            case ARG_LONG64:
+            case ARG_DOUBLE:
+                size = sizeof(uint64_t);
+                break;
+            case ARG_PTR:
+                size = sizeof(void *);
+                break;
+            case ARG_STRING:
+                size = (uint32_t) strnlen((const char *) args + index, length - index);
+                size += size < length - index;
+                break;
+            case ARG_STATIC: {
+                if (index + sizeof(void *) > length) {
+                    break;
+                }
+                const char *s;
+                memcpy(&s, args + index, sizeof(s));
+                index += sizeof(void *);
+
+                uint32_t room = maxLength - written - (length - index);
+                if (staticStrings_ == STATIC_FOREIGN) {
+                    char text[32];
+                    int textLength = snprintf(text, sizeof(text), "(static %p)", s);
+                    written += capture(dst + written, text, std::min<uint32_t>(textLength, room - 1));
+                } else {
+                    written += capture(dst + written, s, std::min(MAX_STATIC_STRING, room - 1));
+                }
+                continue;
+            }
+        }
+        size = std::min(size, length - index);
+        memcpy(dst + written, args + index, size);
+        index += size;
+        written += size;
+    }
+
+    // Bytes no conversion reads
+    memcpy(dst + written, args + index, length - index);
+    return written + length - index;
+}
+
+uint32_t StringFormat::execute(const Program &program, uint8_t *argsBuffer, uint32_t *argsBufferIndexPtr,
+                               char *outputString, int outputStringMaxLength, int *outputStringLength) {
+    char *startOutputString = outputString;
+    uint32_t argsBufferIndex = *argsBufferIndexPtr;
+    const char *literals = program.literals.data();
+
+    for (const Step &step : program.steps) {
+        memcpy(outputString, literals + step.literalOffset, step.literalLength);
+        outputString += step.literalLength;
+
+        bool isSigned = step.conversion == 'd' || step.conversion == 'i';
+        switch (step.arg) {
+            case ARG_NONE:
+                break;
+
+            case ARG_BYTE: {
+                uint8_t u8 = memGetByte(argsBuffer, argsBufferIndex);
+                argsBufferIndex = indexInc(argsBufferIndex, sizeof(u8));
+                if (step.fast) {
+                    *outputString++ = (char) u8;
+                } else {
+                    outputString += sprintf(outputString, step.spec, u8);
+                }
+                break;
+            }
+
+            case ARG_WORD: {
+                uint16_t u16 = memGetWord(argsBuffer, argsBufferIndex);
+                argsBufferIndex = indexInc(argsBufferIndex, sizeof(u16));
+                if (!step.fast) {
+                    outputString += sprintf(outputString, step.spec, u16);
+                } else if (step.halves == 2) {
+                    outputString = formatInteger(outputString, step, (uint8_t) u16, false);
+                } else if (isSigned) {
+                    auto value = (int16_t) u16;
+                    outputString = formatInteger(outputString, step, value < 0 ? -value : value, value < 0);
+                } else {
+                    outputString = formatInteger(outputString, step, u16, false);
+                }
+                break;
+            }
+
+            case ARG_INT: {
+                uint32_t u32 = memGetInt(argsBuffer, argsBufferIndex);
+                argsBufferIndex = indexInc(argsBufferIndex, sizeof(u32));
+                if (!step.fast) {
+                    outputString += sprintf(outputString, step.spec, u32);
+                } else if (isSigned && !step.longs) {
+                    int64_t value = (int32_t) u32;
+                    outputString = formatInteger(outputString, step, value < 0 ? -value : value, value < 0);
+                } else {
+                    // %ld gets the 32 bits zero extended
+                    outputString = formatInteger(outputString, step, u32, false);
+                }
+                break;
+            }
+
+            case ARG_LONG64: {
+                uint64_t u64 = memGetLong64(argsBuffer, argsBufferIndex);
+                argsBufferIndex = indexInc(argsBufferIndex, sizeof(u64));
+                if (!step.fast) {
+                    outputString += sprintf(outputString, step.spec, u64);
+                } else if (isSigned && (int64_t) u64 < 0) {
+                    outputString = formatInteger(outputString, step, 0 - u64, true);
+                } else {
+                    outputString = formatInteger(outputString, step, u64, false);
+                }
+                break;
+            }
+
+            case ARG_DOUBLE: {
+                double d = memGetDouble(argsBuffer, argsBufferIndex);
+                argsBufferIndex = indexInc(argsBufferIndex, sizeof(d));
+                char *end = step.fast ? formatFixed(outputString, step, d) : nullptr;
+                outputString = end ? end : outputString + sprintf(outputString, step.spec, d);
+                break;
+            }
+
+            case ARG_PTR: {
+                void *ptr = memGetPtr(argsBuffer, argsBufferIndex);
+                argsBufferIndex = indexInc(argsBufferIndex, sizeof(void *));
+                if (!step.fast) {
+                    outputString += sprintf(outputString, step.spec, ptr);
+                } else if (!ptr) {
+                    memcpy(outputString, "(nil)", 5);
+                    outputString += 5;
+                } else {
+                    char digits[24];
+                    char *first = toDigits((uintptr_t) ptr, 'x', digits + sizeof(digits));
+                    *outputString++ = '0';
+                    *outputString++ = 'x';
+                    memcpy(outputString, first, digits + sizeof(digits) - first);
+                    outputString += digits + sizeof(digits) - first;
+                }
+                break;
+            }
+
+            case ARG_STATIC:
+                if (staticStrings_ != STATIC_INLINE) {
+                    auto *s = (const char *) memGetPtr(argsBuffer, argsBufferIndex);
+                    argsBufferIndex = indexInc(argsBufferIndex, sizeof(void *));
+                    outputString = formatStatic(outputString, s, outputString - startOutputString);
+                    break;
+                }
+                // The text is in the record as for %s
+                // fallthrough
+
+            case ARG_STRING: {
+                // Width and precision do not apply, see interpret()
+                int maxString = ((outputStringMaxLength) - argsBufferIndex) - 1;
+                if (maxString < 0) {
+                    getStringCorruptedCount++;
+                    return -1;
+                }
+                uint32_t stringLength = memGetString(argsBuffer, argsBufferIndex, outputString, maxString);
+                outputString += stringLength;
+                argsBufferIndex = indexInc(argsBufferIndex, stringLength + 1);
+                break;
+            }
+        }
+    }
+    *outputString = 0;
+
+    if (outputString > startOutputString) {
+        *outputStringLength = ((int)(outputString - startOutputString));
+    }
+
+    *argsBufferIndexPtr = argsBufferIndex;
+
+    return 0;
+}
+
+// Parse format on every record, for the formats that are not cached
+uint32_t StringFormat::interpret(const char *format,
+                                 uint8_t *argsBuffer,
+                                 uint32_t *argsBufferIndexPtr,
+                                 char *outputString,
+                                 int outputStringMaxLength,
+                                 int *outputStringLength) {
     void *ptr;
     double d;
     char tempFormat[32];
@@ -327,6 +985,14 @@ uint32_t StringFormat::decodeFromArgsBuffer(const char *format,
                     // string
                     case 's':
                         i++;
+                        if (format[start + 1] == '#' && staticStrings_ != STATIC_INLINE) {
+                            ptr = memGetPtr(argsBuffer, argsBufferIndex);
+                            argsBufferIndex = indexInc(argsBufferIndex, sizeof(void *));
+                            outputString = formatStatic(outputString, (const char *) ptr,
+                                                        outputString - startOutputString);
+                            consumed = true;
+                            break;
+                        }
                         strlcpy(tempFormat, &format[start], i-start + 1);
                         //printf("%format\n", tempFormat);
 
@@ -424,50 +1090,88 @@ uint32_t StringFormat::decodeFromArgsBuffer(const char *format,
     return 0;
 }
 
+// Memory buffer utilities return the encoded size, and only size the value
+// if s is NULL
+
 // Write u8 into the non circular buffer
 uint32_t StringFormat::memSetByte(char *s, uint8_t u8) {
-    *(uint8_t *)s = u8;
+    if (s) {
+        *(uint8_t *)s = u8;
+    }
     return sizeof(u8);
 }
 
 //Write u16 into the circular buffer
 uint32_t StringFormat::memSetWord(char *s, uint16_t u16) {
-    memcpy(s, &u16, sizeof(u16));
+    if (s) {
+        memcpy(s, &u16, sizeof(u16));
+    }
     return sizeof(u16);
 }
 
 // Write u32 into the circular buffer
 uint32_t StringFormat::memSetInt(char *s, uint32_t u32) {
-    memcpy(s, &u32, sizeof(u32));
+    if (s) {
+        memcpy(s, &u32, sizeof(u32));
+    }
     return sizeof(u32);
 }
 
 uint32_t StringFormat::memSetLong64(char *s, uint64_t u64) {
-    memcpy(s, &u64, sizeof(u64));
+    if (s) {
+        memcpy(s, &u64, sizeof(u64));
+    }
     return sizeof(u64);
 }
 
 // Write double into the circular buffer
 uint32_t StringFormat::memSetDouble(char *s, double d) {
-    memcpy(s, &d, sizeof(d));
+    if (s) {
+        memcpy(s, &d, sizeof(d));
+    }
     return sizeof(d);
 }
 
 uint32_t StringFormat::memSetPtr(char *s, void *src) {
-    memcpy(s, &src, sizeof(void *));
+    if (s) {
+        memcpy(s, &src, sizeof(void *));
+    }
     return sizeof(void *);
 }
 
-uint32_t StringFormat::memSetString(char *s, const char *src) {
-    const char *NULL_STRING = "(null)";
-    if (!src) {
-        strcpy(s, NULL_STRING);
-        return strlen(NULL_STRING) + 1;
+// Cut to maxStringLength_, see capture(), and to the room left for the
+// strings of the record if room is set
+uint32_t StringFormat::memSetString(char *s, const char *src, StringRoom *room) {
+    uint32_t length;
+
+    if (!s) {
+        length = captureSize(src, maxStringLength_);
+        if (room) {
+            room->bytes += length;
+            room->strings++;
+        }
+        return length;
+    }
+    if (!room) {
+        return capture(s, src, maxStringLength_);
+    }
+
+    // A byte for each string after this one
+    uint32_t limit = room->bytes - room->strings;
+    if (!limit) {
+        *s = 0;
+        length = 1;
+    } else {
+        length = capture(s, src, maxStringLength_ ? std::min(maxStringLength_, limit) : limit);
     }
+    room->bytes -= length;
+    room->strings--;
+    return length;
+}
 
-    uint32_t str_size = strlen(src);
-    memcpy(s, src, str_size + 1);
-    return str_size + 1;
+// Only the pointer of a %#s string, read when the record is printed
+uint32_t StringFormat::memSetStatic(char *s, const char *src) {
+    return memSetPtr(s, (void *) src);
 }
 
 // Read from memory API
@@ -19,21 +19,177 @@ limitations under the License.
 #ifndef ASYNCLOG_STRINGFORMAT_H
 #define ASYNCLOG_STRINGFORMAT_H
 
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdarg>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
 namespace memlog {
     class StringFormat {
 
     public:
-        void encodeToArgsBuffer(const char *format, va_list args, char **argsBuffer);
-
+        // Formats compiled to a program, the others are parsed on every record
+        static constexpr uint32_t CACHE_SIZE = 4096;
+        static constexpr uint32_t CACHE_PROBES = 16;
+        // Ends a string cut to the capture limit
+        static constexpr const char *TRUNCATION_MARK = "...";
+        static constexpr const char *NULL_STRING = "(null)";
+        // Longest %#s string printed
+        static constexpr uint32_t MAX_STATIC_STRING = 1024;
+
+        // %#s stores only the pointer of a string that lives as long as the
+        // process, such as a literal. How a record holds it:
+        enum StaticStrings {
+            // The pointer, valid in this process
+            STATIC_POINTER,
+            // The text, written by inlineStatic()
+            STATIC_INLINE,
+            // The pointer of another process, printed as an address
+            STATIC_FOREIGN,
+        };
+
+        // Bytes a %s argument takes in a record, limit 0 captures all of it
+        static inline uint32_t captureSize(const char *s, uint32_t limit) {
+            if (!s) {
+                s = NULL_STRING;
+            }
+            return (uint32_t) (limit ? strnlen(s, limit) : strlen(s)) + 1;
+        }
+
+        // Copy a %s argument, cut to limit with TRUNCATION_MARK at the end.
+        // Return the bytes written, captureSize() of the same limit.
+        static inline uint32_t capture(char *dst, const char *s, uint32_t limit) {
+            if (!s) {
+                s = NULL_STRING;
+            }
+            size_t length = limit ? strnlen(s, limit + 1) : strlen(s);
+            if (limit && length > limit) {
+                length = limit;
+                size_t mark = std::min(strlen(TRUNCATION_MARK), length);
+                memcpy(dst, s, length - mark);
+                memcpy(dst + length - mark, TRUNCATION_MARK, mark);
+            } else {
+                memcpy(dst, s, length);
+            }
+            dst[length] = 0;
+            return (uint32_t) length + 1;
+        }
+
+        // The %s arguments of a record: their bytes and count once sized, the
+        // bytes they may take and the count left while they are encoded
+        struct StringRoom {
+            uint32_t bytes;
+            uint32_t strings;
+        };
+
+        void setMaxStringLength(uint32_t limit) { maxStringLength_ = limit; }
+
+        void setStaticStrings(StaticStrings mode) { staticStrings_ = mode; }
+
+        // With room, the %s arguments are cut to fit in room->bytes, each keeping
+        // at least its terminating byte, and end with TRUNCATION_MARK
+        void encodeToArgsBuffer(const char *format, va_list args, char **argsBuffer, StringRoom *room = nullptr);
+
+        // Adds the %s arguments to strings if set
+        uint32_t getArgsBufferSize(const char *format, va_list args, StringRoom *strings = nullptr);
+
+        // format is compiled on its first record and the program is kept by
+        // pointer, the format must not change for the life of the object.
+        // Safe to call from several threads.
         uint32_t decodeFromArgsBuffer(const char *format, uint8_t *argsBuffer, uint32_t *argsBufferIndexPtr,
                                       char *outputString, int outputStringMaxLength, int *outputStringLength);
 
+        // Copy the arguments of a record for a reader outside this process,
+        // with the %#s strings inline. Return the length of the copy, at most
+        // maxLength.
+        uint32_t inlineStatic(const char *format, const uint8_t *args, uint32_t length, char *dst,
+                              uint32_t maxLength);
+
+        // Decimal digits of value at dst, zero padded to width. Return the end.
+        static char *formatDecimal(char *dst, uint64_t value, int width = 0);
+
+        StringFormat();
+
+        ~StringFormat();
+
     private:
+        // Encoded argument of a conversion
+        enum ArgType : uint8_t {
+            ARG_NONE,
+            ARG_BYTE,
+            ARG_WORD,
+            ARG_INT,
+            ARG_LONG64,
+            ARG_DOUBLE,
+            ARG_PTR,
+            ARG_STRING,
+            ARG_STATIC,
+        };
+
+        enum Flag : uint8_t {
+            FLAG_LEFT = 1,
+            FLAG_ZERO = 2,
+            FLAG_PLUS = 4,
+            FLAG_SPACE = 8,
+            FLAG_ALT = 16,
+        };
+
+        // Literal text, then a conversion unless arg is ARG_NONE
+        struct Step {
+            uint32_t literalOffset;
+            uint32_t literalLength;
+            ArgType arg;
+            char conversion;
+            // Number of 'h' or 'l' modifiers
+            uint8_t halves;
+            uint8_t longs;
+            uint8_t flags;
+            int width;
+            // -1 if not given
+            int precision;
+            // Rendered by sprintf() with spec otherwise
+            bool fast;
+            char spec[32];
+        };
+
+        struct Program {
+            const char *format;
+            std::string literals;
+            std::vector<Step> steps;
+            bool hasStatic;
+        };
+
         uint32_t getStringCorruptedCount;
+        uint32_t maxStringLength_;
+        StaticStrings staticStrings_;
+        std::unique_ptr<std::atomic<Program *>[]> cache_;
+        std::atomic<uint32_t> uncachedCount_;
+
+        const Program *getProgram(const char *format);
+
+        static Program *compile(const char *format);
+
+        static char *formatInteger(char *dst, const Step &step, uint64_t magnitude, bool negative);
+
+        static char *formatFixed(char *dst, const Step &step, double d);
+
+        char *formatStatic(char *dst, const char *s, size_t written);
+
+        uint32_t execute(const Program &program, uint8_t *argsBuffer, uint32_t *argsBufferIndexPtr,
+                         char *outputString, int outputStringMaxLength, int *outputStringLength);
+
+        uint32_t interpret(const char *format, uint8_t *argsBuffer, uint32_t *argsBufferIndexPtr,
+                           char *outputString, int outputStringMaxLength, int *outputStringLength);
 
 
         void strlcpy(char *dst, const char *src, size_t siz);
 
+        uint32_t walkArgs(const char *format, va_list args, char *argsBuffer, StringRoom *room);
+
         uint32_t indexInc(uint32_t index, uint32_t v);
 
         /* Memory buffer utilities */
@@ -49,7 +205,9 @@ namespace memlog {
 
         uint32_t memSetPtr(char *s, void *src);
 
-        uint32_t memSetString(char *s, const char *src);
+        uint32_t memSetString(char *s, const char *src, StringRoom *room);
+
+        uint32_t memSetStatic(char *s, const char *src);
 
         uint8_t memGetByte(uint8_t *buf, uint32_t dstIndex);
 
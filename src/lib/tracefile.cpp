@@ -0,0 +1,240 @@
+/* Copyright 2019 memlog Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+//
+// Trace file rotation, preallocation, writeback and retention
+//
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "log.h"
+
+using namespace std;
+using namespace memlog;
+
+// Called by the collector after a pass, the stream holds whole records. Sizes
+// are those of the file, compressed ones for a gzip stream.
+void Log::maintainFile() {
+    if (!fileHandle_) {
+        return;
+    }
+
+    if (rotation_.syncBytes && stream_->fileBytes() - syncMark_ >= rotation_.syncBytes) {
+        paceWriteback();
+    }
+
+    bool full = rotation_.bytes && stream_->fileBytes() >= rotation_.bytes;
+    bool old = false;
+    if (rotation_.sec) {
+        uint64_t now = Clock::monotonicNsec();
+        old = now - fileOpenNsec_ >= (uint64_t) rotation_.sec * Clock::NSEC_PER_SEC;
+        if (old && stream_->tell() == 0) {
+            // Nothing to rotate, the period starts over
+            fileOpenNsec_ = now;
+            old = false;
+        }
+    }
+
+    if (full || old) {
+        rotate();
+    }
+}
+
+// The file keeps its name, the one written so far moves aside
+bool Log::rotate() {
+    char rotated[sizeof(filename_) + 64];
+    char stamp[32];
+    struct tm tm;
+
+    time_t now = time(nullptr);
+    localtime_r(&now, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+    int length = snprintf(rotated, sizeof(rotated), "%s.%s", filename_, stamp);
+    for (uint32_t n = 1; access(rotated, F_OK) == 0; n++) {
+        snprintf(rotated + length, sizeof(rotated) - length, ".%u", n);
+    }
+
+    if (binary_) {
+        // Each file decodes on its own
+        closeSegment(stream_);
+    }
+
+    if (rename(filename_, rotated) != 0) {
+        fileErrno_ = errno;
+        rotateFailCount_++;
+        fileOpenNsec_ = Clock::monotonicNsec();
+        return false;
+    }
+
+    FILE *file = createTracefile(filename_, redirectStd_);
+    if (!file) {
+        fileErrno_ = errno;
+        rotateFailCount_++;
+        rename(rotated, filename_);
+        fileOpenNsec_ = Clock::monotonicNsec();
+        return false;
+    }
+    fseeko(file, 0, SEEK_END);
+
+    // What is buffered goes to the previous file
+    FILE *previous = fileHandle_;
+    stream_->setFile(file);
+    fileHandle_ = file;
+    closeFile(previous);
+
+    lastIndex_ = NO_SEGMENT;
+    startFile();
+    rotateCount_++;
+    enforceRetention();
+    return true;
+}
+
+void Log::startFile() {
+    fileOpenNsec_ = Clock::monotonicNsec();
+    syncMark_ = stream_->fileBytes();
+    syncStart_ = syncEnd_ = stream_->fileBytes();
+
+    if (rotation_.bytes && rotation_.preallocate && stream_->fileBytes() < rotation_.bytes) {
+        // Blocks allocated up front stay contiguous and spare the writes the
+        // allocation, the size of the file is unchanged
+        if (fallocate(fileno(fileHandle_), FALLOC_FL_KEEP_SIZE, 0, rotation_.bytes) != 0) {
+            fileErrno_ = errno;
+        }
+    }
+}
+
+// The stream is detached from file already
+void Log::closeFile(FILE *file) {
+    struct stat st;
+    int fd = fileno(file);
+
+    fflush(file);
+    if (rotation_.bytes && rotation_.preallocate && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        // Truncating to the size frees the blocks preallocated past it
+        if (ftruncate(fd, st.st_size) != 0) {
+            fileErrno_ = errno;
+        }
+    }
+    if (rotation_.syncBytes && fdatasync(fd) != 0) {
+        fileErrno_ = errno;
+    }
+    fclose(file);
+}
+
+// Keep the dirty pages of the file to about two windows of syncBytes, so the
+// kernel never has a large writeback to do at once
+void Log::paceWriteback() {
+    struct stat st;
+    int fd = fileno(fileHandle_);
+
+    stream_->flush();
+    syncMark_ = stream_->fileBytes();
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return;
+    }
+
+    uint64_t end = st.st_size;
+    if (syncEnd_ > syncStart_) {
+        // Wait for the window started last time, then drop it from the cache
+        if (sync_file_range(fd, syncStart_, syncEnd_ - syncStart_,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) != 0) {
+            fileErrno_ = errno;
+        }
+        posix_fadvise(fd, syncStart_, syncEnd_ - syncStart_, POSIX_FADV_DONTNEED);
+    }
+    if (end > syncEnd_ && sync_file_range(fd, syncEnd_, end - syncEnd_, SYNC_FILE_RANGE_WRITE) != 0) {
+        fileErrno_ = errno;
+    }
+    syncStart_ = syncEnd_;
+    syncEnd_ = end;
+    syncCount_++;
+}
+
+// Rotated files are <filename>.<YYYYmmdd-HHMMSS>[.N]
+void Log::enforceRetention() {
+    struct Rotated {
+        string path;
+        uint64_t size;
+        struct timespec mtime;
+    };
+    vector<Rotated> files;
+    struct stat st;
+
+    if (!rotation_.retainBytes && !rotation_.retainSec) {
+        return;
+    }
+
+    string path(filename_);
+    size_t slash = path.rfind('/');
+    string dir = slash == string::npos ? "." : path.substr(0, slash ? slash : 1);
+    string prefix = (slash == string::npos ? path : path.substr(slash + 1)) + ".";
+
+    DIR *handle = opendir(dir.c_str());
+    if (!handle) {
+        fileErrno_ = errno;
+        return;
+    }
+
+    uint64_t total = 0;
+    if (fileHandle_ && fstat(fileno(fileHandle_), &st) == 0) {
+        total = st.st_size;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(handle)) != nullptr) {
+        const char *name = entry->d_name;
+        if (strncmp(name, prefix.c_str(), prefix.size()) != 0 || !isdigit((unsigned char) name[prefix.size()])) {
+            continue;
+        }
+        string rotated = dir + "/" + name;
+        if (stat(rotated.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        files.push_back({ rotated, (uint64_t) st.st_size, st.st_mtim });
+        total += st.st_size;
+    }
+    closedir(handle);
+
+    // A file is last written before the next one is started, the names of
+    // files rotated within the same second do not sort
+    sort(files.begin(), files.end(), [](const Rotated &a, const Rotated &b) {
+        if (a.mtime.tv_sec != b.mtime.tv_sec) {
+            return a.mtime.tv_sec < b.mtime.tv_sec;
+        }
+        return a.mtime.tv_nsec != b.mtime.tv_nsec ? a.mtime.tv_nsec < b.mtime.tv_nsec : a.path < b.path;
+    });
+
+    time_t now = time(nullptr);
+    for (auto &file : files) {
+        bool over = rotation_.retainBytes && total > rotation_.retainBytes;
+        bool expired = rotation_.retainSec && now - file.mtime.tv_sec > (time_t) rotation_.retainSec;
+        if (!over && !expired) {
+            continue;
+        }
+        if (unlink(file.path.c_str()) != 0) {
+            fileErrno_ = errno;
+            continue;
+        }
+        total -= file.size;
+        retainDeleteCount_++;
+    }
+}
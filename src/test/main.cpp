@@ -1,10 +1,24 @@
 #include <iostream>
 #include <chrono>
+#include <cmath>
+#include <cstdarg>
+#include <cstring>
+#include <ctime>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
 #include "log.h"
 
 using namespace std;
 using namespace memlog;
 
+static int failures = 0;
+
 void performance_test1(shared_ptr<Log> log) {
     chrono::high_resolution_clock::time_point t1 = chrono::high_resolution_clock::now();
     for ( auto i = 0; i < 1000000; i++) {
@@ -16,11 +30,1129 @@ void performance_test1(shared_ptr<Log> log) {
     cout << "1 millions write in " << duration << " microseconds" << endl;
 }
 
+static void expect(const char *what, const string &expected, const string &actual) {
+    if (expected != actual) {
+        cout << "FAIL " << what << ": expected \"" << expected << "\" got \"" << actual << "\"" << endl;
+        failures++;
+    }
+}
+
+static string readFile(const char *path) {
+    char buffer[64 * 1024];
+    string text;
+    size_t length;
+
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return text;
+    }
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        text.append(buffer, length);
+    }
+    fclose(file);
+    return text;
+}
+
+static vector<string> readLines(const char *path) {
+    string text = readFile(path);
+    vector<string> lines;
+    size_t start = 0;
+
+    for (size_t end; (end = text.find('\n', start)) != string::npos; start = end + 1) {
+        lines.push_back(text.substr(start, end - start));
+    }
+    return lines;
+}
+
+// dump() of the records in the rings, as text
+static void dumpToFile(Log &log, const char *path) {
+    FILE *file = fopen(path, "w");
+    log.dump(Stream::create(file));
+    fclose(file);
+}
+
+// Encode the arguments as a record does, decode them, and compare with vsnprintf
+static void checkFormat(StringFormat &stringFormat, const char *format, ...) {
+    char expected[LOG_MAX_LOG_TRACE_LINE];
+    char args[LOG_MAX_LOG_TRACE_LINE];
+    char output[LOG_MAX_LOG_TRACE_LINE];
+    char *end = args;
+    uint32_t index = 0;
+    int length = 0;
+    va_list va;
+
+    va_start(va, format);
+    vsnprintf(expected, sizeof(expected), format, va);
+    va_end(va);
+
+    va_start(va, format);
+    stringFormat.encodeToArgsBuffer(format, va, &end);
+    va_end(va);
+
+    stringFormat.decodeFromArgsBuffer(format, (uint8_t *) args, &index, output, (int) (end - args), &length);
+    expect(format, expected, string(output, length));
+}
+
+void number_format_test() {
+    StringFormat stringFormat;
+
+    // Widths, precision, sign and the 0 and - flags
+    checkFormat(stringFormat, "%d %d %d", 0, -1, 2147483647);
+    checkFormat(stringFormat, "[%5d] [%-5d] [%05d] [%+d] [% d]", 42, 42, -42, 42, 42);
+    checkFormat(stringFormat, "[%.3d] [%8.3d] [%-8.3d] [%08d]", 7, -7, 7, -123);
+    checkFormat(stringFormat, "[%u] [%x] [%X] [%i] [%08x] [%-6X]", 4294967295u, 0xbeefu, 0xbeefu, -5, 0xabu, 0xcdu);
+    // A record keeps 32 bits of a %ld, %lld keeps 64
+    checkFormat(stringFormat, "[%ld] [%lu] [%lx] [%6ld]", 123456L, 4000000000UL, 0xfadebeefUL, 1L);
+    checkFormat(stringFormat, "[%lld] [%llu] [%llx] [%20lld] [%-20llu]", -1234567890123LL, 18446744073709551615ULL,
+                0x123456789abcdefULL, 99LL, 7ULL);
+    checkFormat(stringFormat, "[%lld] [%lli] [%llX] [%020lld] [%+lld]", -9223372036854775807LL - 1, 0LL,
+                0xffffffffffffffffULL, -42LL, 42LL);
+    checkFormat(stringFormat, "[%c] [%5c] [%-3c]", 'a', 'b', 'c');
+    checkFormat(stringFormat, "[%s] [%d%%] [%s%d]", "str", 50, "", -1);
+
+    // %f edge values, rounding is half to even on the exact binary value
+    checkFormat(stringFormat, "%f %f %f %f", 0.0, -0.0, 1.0, -1.5);
+    checkFormat(stringFormat, "%.0f %.0f %.0f %.0f %.0f", 0.5, 1.5, 2.5, -2.5, 3.5);
+    checkFormat(stringFormat, "%.2f %.2f %.2f %.3f", 1.005, 2.675, 0.125, 9.9995);
+    checkFormat(stringFormat, "%.9f %.9f %.1f", 1e-10, 0.123456789123, 9.96);
+    checkFormat(stringFormat, "%f %f %f", 1e20, 9223372036854775808.0, -1e300);
+    checkFormat(stringFormat, "%.12f %.15f", 3.141592653589793, 2.718281828459045);
+    checkFormat(stringFormat, "[%10.3f] [%-10.3f] [%010.3f] [%+.2f] [% .2f]", 3.14159, 3.14159, -3.14159, 2.5, 2.5);
+    checkFormat(stringFormat, "%f %f %f %5.1f", (double) NAN, (double) INFINITY, (double) -INFINITY, (double) NAN);
+    checkFormat(stringFormat, "%lf %.3lf", 0.1, -1e-4);
+    checkFormat(stringFormat, "id %d %s value %.2f mask %lx end", 17, "name", 0.25, 0xf0UL);
+}
+
+// A record as the formatter before the compiled prefix laid it out
+static string oldPrefixFormat(uint64_t nsec, uint32_t id, const char *functionName, uint32_t lineNumber, char tag,
+                              uint32_t length, const char *message) {
+    char buffer[LOG_MAX_LOG_TRACE_LINE];
+    time_t sec = (time_t) (nsec / Clock::NSEC_PER_SEC);
+    struct tm tm;
+
+    localtime_r(&sec, &tm);
+    buffer[0] = '[';
+    strftime(&buffer[1], sizeof(buffer) - 1, "%Y %h %e %T", &tm);
+    sprintf(&buffer[21], ".%9.9ld", (long) (nsec % Clock::NSEC_PER_SEC));
+    char *next = buffer + strlen(buffer);
+    if (functionName) {
+        next += sprintf(next, ":%u:%c:%s:%u] ", id, tag, functionName, lineNumber);
+    } else if (lineNumber) {
+        next += sprintf(next, ":%u:%c:%u] ", id, tag, lineNumber);
+    } else if (tag) {
+        next += sprintf(next, ":%u:%c] ", id, tag);
+    } else {
+        next += sprintf(next, ":%u:%u] ", id, length);
+    }
+    return string(buffer, next) + message;
+}
+
+// Each kind of site, across a change of second between two records
+void prefix_format_test() {
+    struct Call {
+        const char *functionName;
+        uint32_t lineNumber;
+        char tag;
+    };
+    static const Call CALLS[] = {
+        { "prefix_format_test", 120, 'I' },
+        { nullptr, 121, 'W' },
+        { nullptr, 0, 'E' },
+        { nullptr, 0, 0 },
+    };
+    Log::Options options;
+    options.filename = "/tmp/memlogTest.txt";
+    options.enableCollect = false;
+    Log log(options);
+
+    // Start 2 ms before the next second and log until a while past it
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    long toNext = Clock::NSEC_PER_SEC - now.tv_nsec;
+    if (toNext > 2000000) {
+        usleep((useconds_t) ((toNext - 2000000) / 1000));
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    time_t firstSec = now.tv_sec;
+    vector<int> values;
+    for (int i = 0, after = 0; after < 8 && i < 100000; i++) {
+        const Call &call = CALLS[i % 4];
+        log.traceVargs(true, call.functionName, call.lineNumber, call.tag, "prefix test %d\n", i);
+        values.push_back(i);
+        usleep(100);
+        clock_gettime(CLOCK_REALTIME, &now);
+        after += now.tv_sec != firstSec;
+    }
+
+    Log::Cursor::Query query;
+    query.order = Log::Cursor::OLDEST_FIRST;
+    Log::Cursor cursor(&log, query);
+    Log::Cursor::Record record;
+    char text[LOG_MAX_LOG_TRACE_LINE * 2];
+    char message[64];
+    uint64_t lastSec = 0;
+    size_t count = 0;
+    int secondChanges = 0;
+
+    while (cursor.next(&record) && count < values.size()) {
+        const Call &call = CALLS[count % 4];
+        int length = cursor.format(record, text);
+        snprintf(message, sizeof(message), "prefix test %d\n", values[count]);
+        expect("prefix", oldPrefixFormat(record.nsec, record.header->id, call.functionName, call.lineNumber,
+                                         call.tag, record.header->length, message),
+               string(text, length < 0 ? 0 : length));
+
+        uint64_t sec = record.nsec / Clock::NSEC_PER_SEC;
+        secondChanges += count && sec != lastSec;
+        lastSec = sec;
+        count++;
+    }
+    unlink(options.filename);
+
+    if (count != values.size() || !secondChanges) {
+        cout << "FAIL prefix: " << count << " records, second changed " << secondChanges << " times" << endl;
+        failures++;
+    }
+}
+
+// Threads logging each on a shard of its own come out of dump() in timestamp
+// order, and each thread's records in the order it logged them
+void shard_merge_test() {
+    static const int THREADS = 4;
+    static const int RECORDS = 2000;
+    Log::Options options;
+    options.filename = "/tmp/memlogTest.txt";
+    options.enableCollect = false;
+    options.shards = THREADS;
+    options.shardSize = 1 << 20;
+    options.timeFormat = Log::EPOCH_NSEC;
+    options.prefix = "%t ";
+    Log log(options);
+
+    vector<thread> threads;
+    for (int t = 0; t < THREADS; t++) {
+        threads.emplace_back([&log, t] {
+            for (int i = 0; i < RECORDS; i++) {
+                log.traceVargs(true, nullptr, 0, 'I', "shard %d %d\n", t, i);
+                if (i % 100 == 0) {
+                    this_thread::yield();
+                }
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    dumpToFile(log, "/tmp/memlogTest.dump");
+
+    vector<int> next(THREADS, 0);
+    unsigned long long lastNsec = 0;
+    int outOfOrder = 0;
+    for (auto &line : readLines("/tmp/memlogTest.dump")) {
+        unsigned long long nsec;
+        int t, i;
+        if (sscanf(line.c_str(), "%llu shard %d %d", &nsec, &t, &i) != 3 || t < 0 || t >= THREADS) {
+            expect("shard line", "", line);
+            continue;
+        }
+        outOfOrder += nsec < lastNsec || i != next[t];
+        lastNsec = nsec;
+        next[t] = i + 1;
+    }
+    unlink(options.filename);
+    unlink("/tmp/memlogTest.dump");
+
+    for (int t = 0; t < THREADS; t++) {
+        expect("shard records", to_string(RECORDS), to_string(next[t]));
+    }
+    expect("shard order", "0", to_string(outOfOrder));
+}
+
+static uint64_t realtimeNsec() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t) now.tv_sec * Clock::NSEC_PER_SEC + now.tv_nsec;
+}
+
+// Converted TSC stamps land between the wall clock readings around them, a
+// clock after the first one of the process starts without measuring the rate
+void tsc_clock_test() {
+    static const uint64_t SLACK_NSEC = 2000000;
+    Clock first(Clock::TSC);
+
+    uint64_t start = Clock::monotonicNsec();
+    Clock clock(Clock::TSC);
+    uint64_t elapsed = Clock::monotonicNsec() - start;
+    if (elapsed >= (uint64_t) Clock::CALIBRATE_USEC * 1000) {
+        cout << "FAIL tsc: second clock took " << elapsed << " nsec" << endl;
+        failures++;
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        uint64_t before = realtimeNsec();
+        uint64_t nsec = clock.toNsec(clock.now());
+        uint64_t after = realtimeNsec();
+        if (nsec + SLACK_NSEC < before || nsec > after + SLACK_NSEC) {
+            cout << "FAIL tsc: " << nsec << " not in [" << before << ", " << after << "]" << endl;
+            failures++;
+        }
+
+        // Past the age of a calibration, refresh() renews it
+        if (pass == 0) {
+            usleep(Clock::RECALIBRATE_SEC * 1000000 + 100000);
+            if (!clock.refresh()) {
+                cout << "FAIL tsc: not recalibrated" << endl;
+                failures++;
+            }
+        }
+    }
+
+    Log::Options options;
+    options.filename = "/tmp/memlogTest.txt";
+    options.enableCollect = false;
+    options.clock = Clock::TSC;
+    Log log(options);
+    uint64_t before = realtimeNsec();
+    log.traceVargs(true, nullptr, 0, 'I', "tsc %d\n", 1);
+    uint64_t after = realtimeNsec();
+
+    Log::Cursor cursor(&log, Log::Cursor::Query());
+    Log::Cursor::Record record;
+    if (!cursor.next(&record) || record.nsec + SLACK_NSEC < before || record.nsec > after + SLACK_NSEC) {
+        cout << "FAIL tsc: record not stamped in [" << before << ", " << after << "]" << endl;
+        failures++;
+    }
+    unlink(options.filename);
+}
+
+// The collector writes a record only once it is committed: with producers
+// racing it over a small ring, every record reaches the file once, whole and
+// in the order of its thread
+void commit_visibility_test() {
+    static const int THREADS = 4;
+    static const int RECORDS = 5000;
+    Log::Options options;
+    options.filename = "/tmp/memlogTest.txt";
+    options.size = 64 * 1024;
+    options.overrun = Log::OVERRUN_LOSSLESS;
+    options.maxLatencyUsec = 100;
+    options.prefix = "%i ";
+    {
+        Log log(options);
+        vector<thread> threads;
+        for (int t = 0; t < THREADS; t++) {
+            threads.emplace_back([&log, t] {
+                for (int i = 0; i < RECORDS; i++) {
+                    log.traceVargs(true, nullptr, 0, 'I', "commit %d %d %s\n", t, i, "abcdefghijklmnopqrstuvwxyz");
+                }
+            });
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+    }
+
+    vector<int> next(THREADS, 0);
+    int bad = 0;
+    for (auto &line : readLines(options.filename)) {
+        unsigned id;
+        int t, i;
+        char text[32];
+        if (sscanf(line.c_str(), "%u commit %d %d %31s", &id, &t, &i, text) != 4 || t < 0 || t >= THREADS ||
+            i != next[t] || strcmp(text, "abcdefghijklmnopqrstuvwxyz") != 0) {
+            if (bad++ < 3) {
+                expect("commit line", "", line);
+            }
+            continue;
+        }
+        next[t] = i + 1;
+    }
+    unlink(options.filename);
+
+    for (int t = 0; t < THREADS; t++) {
+        expect("commit records", to_string(RECORDS), to_string(next[t]));
+    }
+}
+
+static string stateLine(const Log &log, const char *name) {
+    char state[16 * 1024];
+
+    log.dumpState(state, sizeof(state));
+    const char *line = strstr(state, name);
+    return line ? string(line, strcspn(line, "\n")) : string();
+}
+
+// The ring is rounded up to a power of two, and records wrapping around its
+// end read back whole after several laps
+void ring_wrap_test() {
+    static const int RECORDS = 20000;
+    Log::Options options;
+    options.filename = "/tmp/memlogTest.txt";
+    options.enableCollect = false;
+    options.size = 100000;
+    options.prefix = "%i ";
+    Log log(options);
+
+    expect("ring size", "Size: 131072", stateLine(log, "Size: "));
+    for (int i = 0; i < RECORDS; i++) {
+        log.traceVargs(true, nullptr, 0, 'I', "wrap %d %s\n", i, &"abcdefghijklmnopqrstuvwxyz"[i % 26]);
+    }
+    dumpToFile(log, "/tmp/memlogTest.dump");
+
+    vector<string> lines = readLines("/tmp/memlogTest.dump");
+    int next = -1;
+    int bad = 0;
+    for (auto &line : lines) {
+        unsigned id;
+        int i;
+        char text[32];
+        if (sscanf(line.c_str(), "%u wrap %d %31s", &id, &i, text) != 3 || (next >= 0 && i != next) ||
+            id != (unsigned) i || string(text) != &"abcdefghijklmnopqrstuvwxyz"[i % 26]) {
+            if (bad++ < 3) {
+                expect("wrap line", "", line);
+            }
+            continue;
+        }
+        next = i + 1;
+    }
+    unlink(options.filename);
+    unlink("/tmp/memlogTest.dump");
+
+    expect("wrap last", to_string(RECORDS), to_string(next));
+    if (lines.size() < 1000) {
+        cout << "FAIL wrap: " << lines.size() << " records in the ring" << endl;
+        failures++;
+    }
+}
+
+// A prefaulted ring, on huge pages where the system has them, logs as any other
+void ring_allocation_test() {
+    Log::Options options;
+    options.filename = "/tmp/memlogTest.txt";
+    options.enableCollect = false;
+    options.size = 4 * 1024 * 1024;
+    options.allocation.hugePages = true;
+    options.allocation.prefault = true;
+    options.prefix = "%i ";
+    Log log(options);
+
+    expect("prefault", "Prefaulted: 1", stateLine(log, "Prefaulted: "));
+    log.traceVargs(true, nullptr, 0, 'I', "allocation %d\n", 9);
+    dumpToFile(log, "/tmp/memlogTest.dump");
+    expect("allocation", "0 allocation 9\n", readFile("/tmp/memlogTest.dump"));
+    unlink(options.filename);
+    unlink("/tmp/memlogTest.dump");
+}
+
+// Records a session left in its ring file are recovered as dump() printed
+// them, their sites read back from the .sites file
+void ring_file_recover_test() {
+    static const char *RING_FILE = "/tmp/memlogTest.ring";
+    Log::Options options;
+    options.filename = "/tmp/memlogTest.txt";
+    options.enableCollect = false;
+    options.size = 256 * 1024;
+    options.ringFile = RING_FILE;
+    unlink(RING_FILE);
+    {
+        Log log(options);
+        for (int i = 0; i < 100; i++) {
+            log.traceVargs(true, "ring_file_recover_test", 7, 'W', "recover %d %s %.2f\n", i, "ring", i / 4.0);
+        }
+        dumpToFile(log, "/tmp/memlogTest.dump");
+    }
+    unlink(options.filename);
+
+    if (access((string(RING_FILE) + ".sites").c_str(), R_OK) != 0) {
+        cout << "FAIL recover: no site file" << endl;
+        failures++;
+    }
+
+    FILE *file = fopen("/tmp/memlogTest.out", "w");
+    bool recovered = Log::recover(RING_FILE, Stream::create(file));
+    fclose(file);
+
+    string text = readFile("/tmp/memlogTest.out");
+    string expected = "<<<< Recovered logs of pid: " + to_string(getpid()) + " >>>>>\n" +
+                      readFile("/tmp/memlogTest.dump") + "<<<< End of recovered logs >>>>>\n";
+    expect("recover", "1", to_string(recovered));
+    expect("recover", expected, text);
+    if (text.find("W:ring_file_recover_test:7] recover 99 ring 24.75\n") == string::npos) {
+        cout << "FAIL recover: last record missing" << endl;
+        failures++;
+    }
+
+    unlink(RING_FILE);
+    unlink((string(RING_FILE) + ".sites").c_str());
+    unlink("/tmp/memlogTest.dump");
+    unlink("/tmp/memlogTest.out");
+}
+
+// A binary trace file decodes to the text dump() prints of the same records
+void binary_decode_test() {
+    Log::Options options;
+    options.filename = "/tmp/memlogTest.bin";
+    options.size = 1024 * 1024;
+    options.binary = true;
+    {
+        Log log(options);
+        for (int i = 0; i < 2000; i++) {
+            log.traceVargs(true, "binary_decode_test", 11, 'I', "binary %d %s %.3f\n", i, "name", i / 8.0);
+            log.traceVargs(true, nullptr, 12, 'E', "binary %lld %x\n", -1000000000000LL * i, i);
+            log.traceVargs(false, nullptr, 0, 0, "binary %c\n", 'a' + i % 26);
+        }
+        dumpToFile(log, "/tmp/memlogTest.dump");
+    }
+
+    FILE *input = fopen(options.filename, "r");
+    FILE *output = fopen("/tmp/memlogTest.out", "w");
+    bool decoded = Log::decode(input, Stream::create(output));
+    fclose(output);
+    fclose(input);
+
+    expect("decode", "1", to_string(decoded));
+    expect("decode", readFile("/tmp/memlogTest.dump"), readFile("/tmp/memlogTest.out"));
+    if (readLines("/tmp/memlogTest.out").size() != 6000) {
+        cout << "FAIL decode: " << readLines("/tmp/memlogTest.out").size() << " records" << endl;
+        failures++;
+    }
+    unlink(options.filename);
+    unlink("/tmp/memlogTest.dump");
+    unlink("/tmp/memlogTest.out");
+}
+
+// Ids of the records decoded from a binary file in range
+static vector<unsigned> decodeIds(const char *path, const Log::Range &range) {
+    vector<unsigned> ids;
+    FILE *input = fopen(path, "r");
+    FILE *output = fopen("/tmp/memlogTest.out", "w");
+    bool decoded = Log::decode(input, range, Stream::create(output));
+    fclose(output);
+    fclose(input);
+
+    expect("seek decode", "1", to_string(decoded));
+    for (auto &line : readLines("/tmp/memlogTest.out")) {
+        unsigned id;
+        // After "[2019 Mar  4 17:36:16.442382600"
+        if (line.size() > 31 && sscanf(line.c_str() + 31, ":%u:", &id) == 1) {
+            ids.push_back(id);
+        }
+    }
+    unlink("/tmp/memlogTest.out");
+    return ids;
+}
+
+// Decoding a range of ids or of time from an indexed binary file returns the
+// records in it and none far outside
+void segment_seek_test() {
+    static const unsigned RECORDS = 50000;
+    Log::Options options;
+    options.filename = "/tmp/memlogTest.bin";
+    options.size = 4 * 1024 * 1024;
+    options.binary = true;
+    Log::Range byTime;
+    {
+        Log log(options);
+        for (unsigned i = 0; i < RECORDS; i++) {
+            log.traceVargs(true, "segment_seek_test", 13, 'I', "seek %u\n", i);
+            if (i % 5000 == 0) {
+                usleep(1000);
+            }
+        }
+
+        Log::Cursor::Query query;
+        query.order = Log::Cursor::OLDEST_FIRST;
+        query.fromId = 40000;
+        query.toId = 40004;
+        Log::Cursor cursor(&log, query);
+        Log::Cursor::Record record;
+        while (cursor.next(&record)) {
+            byTime.fromNsec = byTime.fromNsec ? byTime.fromNsec : record.nsec;
+            byTime.toNsec = record.nsec;
+        }
+    }
+
+    Log::Range byId;
+    byId.fromId = 30000;
+    byId.toId = 30009;
+    vector<unsigned> ids = decodeIds(options.filename, byId);
+    vector<unsigned> expected;
+    for (unsigned id = 30000; id <= 30009; id++) {
+        expected.push_back(id);
+    }
+    expect("seek by id", "10", to_string(ids.size()));
+    if (ids != expected) {
+        cout << "FAIL seek by id: not the records 30000 to 30009" << endl;
+        failures++;
+    }
+
+    // Records stamped the same nanosecond as the ends are in range too
+    ids = decodeIds(options.filename, byTime);
+    bool contiguous = !ids.empty();
+    for (size_t i = 1; i < ids.size(); i++) {
+        contiguous &= ids[i] == ids[i - 1] + 1;
+    }
+    if (!contiguous || ids.front() > 40000 || ids.back() < 40004 || ids.size() > 20) {
+        cout << "FAIL seek by time: " << ids.size() << " records" << endl;
+        failures++;
+    }
+    unlink(options.filename);
+}
+
+// What zlib reads of a gzip file before the end or an error
+static string gunzipFile(const char *path) {
+    char buffer[64 * 1024];
+    string text;
+    int length;
+
+    gzFile file = gzopen(path, "rb");
+    if (!file) {
+        return text;
+    }
+    while ((length = gzread(file, buffer, sizeof(buffer))) > 0) {
+        text.append(buffer, length);
+    }
+    gzclose(file);
+    return text;
+}
+
+// A compressed trace file reads back with zlib, and so does the part of it
+// up to the last whole member when it is cut short
+void gzip_stream_test() {
+    static const int RECORDS = 100000;
+    Log::Options options;
+    options.filename = "/tmp/memlogTest.gz";
+    options.size = 1024 * 1024;
+    options.overrun = Log::OVERRUN_LOSSLESS;
+    options.compression = Stream::BUFFERED_COMPRESS;
+    options.prefix = "%i ";
+    string expected;
+    {
+        Log log(options);
+        char line[64];
+        for (int i = 0; i < RECORDS; i++) {
+            log.traceVargs(true, nullptr, 0, 'I', "gzip %d %s\n", i, "abcdefghijklmnopqrstuvwxyz");
+            expected.append(line, snprintf(line, sizeof(line), "%d gzip %d %s\n", i, i, "abcdefghijklmnopqrstuvwxyz"));
+        }
+    }
+    expect("gzip", "1", to_string(gunzipFile(options.filename) == expected));
+
+    string compressed = readFile(options.filename);
+    FILE *file = fopen("/tmp/memlogTest.cut.gz", "w");
+    fwrite(compressed.data(), 1, compressed.size() / 2, file);
+    fclose(file);
+
+    string text = gunzipFile("/tmp/memlogTest.cut.gz");
+    if (text.size() < Stream::LOG_STREAM_BUFFER_SIZE || expected.compare(0, text.size(), text) != 0) {
+        cout << "FAIL gzip: " << text.size() << " bytes read of the truncated file" << endl;
+        failures++;
+    }
+    unlink(options.filename);
+    unlink("/tmp/memlogTest.cut.gz");
+}
+
+// Trace file of a collected Log, the same records whatever the options
+static string collectRecords(Log::Options options, int records) {
+    unlink(options.filename);
+    {
+        Log log(options);
+        for (int i = 0; i < records; i++) {
+            log.traceVargs(true, "collectRecords", 17, 'I', "records %d %s %.1f\n", i, "abcdefghijklmnopqrstuvwxyz",
+                           i / 2.0);
+        }
+    }
+    string text = readFile(options.filename);
+    unlink(options.filename);
+    return text;
+}
+
+// The io_uring writer, buffered or O_DIRECT, writes the file the default
+// writer does
+void uring_stream_test() {
+    static const int RECORDS = 100000;
+    Log::Options options;
+    options.filename = "/tmp/memlogTest.txt";
+    options.size = 1024 * 1024;
+    options.overrun = Log::OVERRUN_LOSSLESS;
+    options.prefix = "%i %s ";
+    string expected = collectRecords(options, RECORDS);
+
+    options.compression = Stream::BUFFERED_URING;
+    expect("uring", "1", to_string(collectRecords(options, RECORDS) == expected));
+    options.uring.direct = true;
+    options.uring.depth = 2;
+    expect("uring direct", "1", to_string(collectRecords(options, RECORDS) == expected));
+    if (expected.size() < 4 * Stream::LOG_STREAM_BUFFER_SIZE) {
+        cout << "FAIL uring: " << expected.size() << " bytes written" << endl;
+        failures++;
+    }
+}
+
+// Microseconds until the collector wrote count records, or until limitUsec
+static uint64_t waitCollected(const Log &log, uint64_t count, uint64_t limitUsec) {
+    uint64_t start = Clock::monotonicNsec();
+    uint64_t elapsed = 0;
+
+    while (elapsed < limitUsec) {
+        if (strtoull(stateLine(log, "Collected trace: ").c_str() + strlen("Collected trace: "), nullptr, 10) >= count) {
+            break;
+        }
+        usleep(1000);
+        elapsed = (Clock::monotonicNsec() - start) / 1000;
+    }
+    return elapsed;
+}
+
+// A lone record is collected within maxLatencyUsec, and a ring filling past
+// the watermark wakes the collector long before it
+void collector_wakeup_test() {
+    Log::Options options;
+    options.filename = "/tmp/memlogTest.txt";
+    options.size = 64 * 1024;
+    options.maxLatencyUsec = 20000;
+    {
+        Log log(options);
+        usleep(50000);
+        log.traceVargs(true, nullptr, 0, 'I', "wakeup %d\n", 1);
+        uint64_t usec = waitCollected(log, 1, 1000000);
+        if (usec >= 500000) {
+            cout << "FAIL wakeup: record collected after " << usec << " usec" << endl;
+            failures++;
+        }
+    }
+
+    options.maxLatencyUsec = 10000000;
+    options.wakeWatermarkPct = 25;
+    {
+        Log log(options);
+        usleep(50000);
+        int records = 0;
+        for (uint32_t bytes = 0; bytes < options.size / 2; bytes += 64, records++) {
+            log.traceVargs(true, nullptr, 0, 'I', "wakeup %d %s\n", records, "abcdefghijklmnopqrstuvwxyz");
+        }
+        uint64_t usec = waitCollected(log, 1, 2000000);
+        if (usec >= 1000000) {
+            cout << "FAIL wakeup: watermark did not wake the collector in " << usec << " usec" << endl;
+            failures++;
+        }
+    }
+    unlink(options.filename);
+}
+
+// Formatter threads write the file and the dump() a single thread does
+void format_pool_test() {
+    static const int RECORDS = 100000;
+    Log::Options options;
+    options.filename = "/tmp/memlogTest.txt";
+    options.size = 1024 * 1024;
+    options.overrun = Log::OVERRUN_LOSSLESS;
+    options.prefix = "%i %s ";
+    string expected = collectRecords(options, RECORDS);
+
+    options.formatters = 3;
+    expect("format pool", "1", to_string(collectRecords(options, RECORDS) == expected));
+
+    options.enableCollect = false;
+    options.size = 8 * 1024 * 1024;
+    string dumps[2];
+    for (uint32_t formatters = 0; formatters < 2; formatters++) {
+        options.formatters = formatters * 3;
+        Log log(options);
+        for (int i = 0; i < RECORDS; i++) {
+            log.traceVargs(true, "format_pool_test", 19, 'D', "pool %d %s\n", i, "abcdefghijklmnopqrstuvwxyz");
+        }
+        dumpToFile(log, "/tmp/memlogTest.dump");
+        dumps[formatters] = readFile("/tmp/memlogTest.dump");
+    }
+    expect("format pool dump", "1", to_string(dumps[0] == dumps[1] && dumps[0].size() > 0));
+    unlink(options.filename);
+    unlink("/tmp/memlogTest.dump");
+}
+
+static uint64_t stateCount(const Log &log, const char *name) {
+    return strtoull(stateLine(log, name).c_str() + strlen(name), nullptr, 10);
+}
+
+// Drop keeps the oldest records and counts the others, lossless keeps them all
+void overrun_policy_test() {
+    static const int RECORDS = 20000;
+    Log::Options options;
+    options.filename = "/tmp/memlogTest.txt";
+    options.size = 64 * 1024;
+    options.prefix = "";
+    options.maxLatencyUsec = 10000000;
+    options.wakeWatermarkPct = 100;
+
+    for (Log::Overrun overrun : { Log::OVERRUN_DROP, Log::OVERRUN_LOSSLESS }) {
+        const char *name = overrun == Log::OVERRUN_DROP ? "drop" : "lossless";
+        uint64_t dropped;
+        unlink(options.filename);
+        options.overrun = overrun;
+        {
+            Log log(options);
+            expect("overrun policy", string("Overrun policy: ") + name, stateLine(log, "Overrun policy: "));
+            for (int i = 0; i < RECORDS; i++) {
+                log.traceVargs(true, nullptr, 0, 'I', "overrun %d %s\n", i, "abcdefghijklmnopqrstuvwxyz");
+            }
+            dropped = stateCount(log, "Overrun drop: ");
+        }
+
+        int count = 0;
+        int last = -1;
+        for (auto &line : readLines(options.filename)) {
+            int i;
+            if (sscanf(line.c_str(), "overrun %d", &i) != 1 || i <= last) {
+                expect(name, "", line);
+                break;
+            }
+            last = i;
+            count++;
+        }
+        expect(name, to_string(RECORDS), to_string(count + dropped));
+        if (overrun == Log::OVERRUN_LOSSLESS) {
+            expect(name, "0", to_string(dropped));
+        }
+    }
+    unlink(options.filename);
+}
+
+// Files start over at rotation.bytes, and the oldest are deleted to keep the
+// directory within retainBytes: what is left is the newest records, in full
+void rotation_retention_test() {
+    static const int RECORDS = 100000;
+    static const char *DIRECTORY = "/tmp/memlogTest.rotation";
+    Log::Options options;
+    options.filename = "/tmp/memlogTest.rotation/trace.txt";
+    options.size = 256 * 1024;
+    options.overrun = Log::OVERRUN_LOSSLESS;
+    options.prefix = "";
+    options.rotation.bytes = 64 * 1024;
+    options.rotation.retainBytes = 256 * 1024;
+    mkdir(DIRECTORY, 0755);
+    unsigned rotated = 0, failed = 0, deleted = 0;
+    {
+        Log log(options);
+        for (int i = 0; i < RECORDS; i++) {
+            log.traceVargs(true, nullptr, 0, 'I', "rotate %d %s\n", i, "abcdefghijklmnopqrstuvwxyz");
+        }
+        // The collector of the last records rotates before the Log is gone
+        waitCollected(log, RECORDS, 1000000);
+        sscanf(stateLine(log, "Rotated files: ").c_str(), "Rotated files: %u fail: %u retention deletes: %u",
+               &rotated, &failed, &deleted);
+    }
+
+    set<int> kept;
+    uint64_t bytes = 0;
+    unsigned files = 0;
+    DIR *dir = opendir(DIRECTORY);
+    for (struct dirent *entry; dir && (entry = readdir(dir)) != nullptr;) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        string path = string(DIRECTORY) + "/" + entry->d_name;
+        for (auto &line : readLines(path.c_str())) {
+            int i;
+            if (sscanf(line.c_str(), "rotate %d", &i) == 1) {
+                kept.insert(i);
+            }
+        }
+        bytes += readFile(path.c_str()).size();
+        files++;
+        unlink(path.c_str());
+    }
+    if (dir) {
+        closedir(dir);
+    }
+    rmdir(DIRECTORY);
+
+    expect("rotation failures", "0", to_string(failed));
+    // The collector may rotate once more after the counters were read
+    if (rotated < 10 || !deleted || files < 2 || files > rotated + 2 - deleted) {
+        cout << "FAIL rotation: " << rotated << " rotated " << deleted << " deleted " << files << " left" << endl;
+        failures++;
+    }
+    if (bytes > options.rotation.retainBytes + 2 * options.rotation.bytes) {
+        cout << "FAIL retention: " << bytes << " bytes left" << endl;
+        failures++;
+    }
+    // Whole files are deleted, the newest records are left without a gap
+    if (kept.empty() || *kept.rbegin() != RECORDS - 1 || *kept.begin() == 0 ||
+        kept.size() != (size_t) (*kept.rbegin() - *kept.begin() + 1)) {
+        cout << "FAIL retention: " << kept.size() << " records left" << endl;
+        failures++;
+    }
+}
+
+// %#s keeps the pointer of a static string and prints it in full, a binary
+// file carries the text of it. %s is cut to maxStringLength.
+void static_string_test() {
+    static const char STATIC[] = "a static string longer than the capture limit";
+    static const char *EXPECTED = "a static string longer than the capture limit|abcdefg...|short\n";
+    Log::Options options;
+    options.filename = "/tmp/memlogTest.txt";
+    options.enableCollect = false;
+    options.prefix = "";
+    options.maxStringLength = 10;
+    {
+        Log log(options);
+        log.traceVargs(true, nullptr, 0, 'I', "%#s|%s|%s\n", STATIC, "abcdefghijklmnop", "short");
+        dumpToFile(log, "/tmp/memlogTest.dump");
+        expect("pointer string", EXPECTED, readFile("/tmp/memlogTest.dump"));
+
+        log.traceVargs(true, nullptr, 0, 'I', "%#s\n", STATIC);
+        Log::Cursor cursor(&log, Log::Cursor::Query());
+        Log::Cursor::Record record;
+        if (!cursor.next(&record) || record.argsLength > sizeof(uint64_t)) {
+            cout << "FAIL pointer string: the record holds more than a pointer" << endl;
+            failures++;
+        }
+    }
+    unlink(options.filename);
+
+    options.filename = "/tmp/memlogTest.bin";
+    options.enableCollect = true;
+    options.binary = true;
+    {
+        Log log(options);
+        log.traceVargs(true, nullptr, 0, 'I', "%#s|%s|%s\n", STATIC, "abcdefghijklmnop", "short");
+    }
+    FILE *input = fopen(options.filename, "r");
+    FILE *output = fopen("/tmp/memlogTest.out", "w");
+    Log::decode(input, Stream::create(output));
+    fclose(output);
+    fclose(input);
+
+    // The decoder prints the default prefix
+    string text = readFile("/tmp/memlogTest.out");
+    size_t prefix = text.find("] ");
+    expect("inline string", EXPECTED, prefix == string::npos ? text : text.substr(prefix + 2));
+    unlink(options.filename);
+    unlink("/tmp/memlogTest.dump");
+    unlink("/tmp/memlogTest.out");
+}
+
+static vector<unsigned> queryIds(Log &log, const Log::Cursor::Query &query, vector<uint64_t> *nsecs = nullptr) {
+    Log::Cursor cursor(&log, query);
+    Log::Cursor::Record record;
+    vector<unsigned> ids;
+
+    while (cursor.next(&record)) {
+        ids.push_back(record.header->id);
+        if (nsecs) {
+            nsecs->push_back(record.nsec);
+        }
+    }
+    return ids;
+}
+
+static vector<unsigned> idSequence(unsigned from, unsigned to, int step) {
+    vector<unsigned> ids;
+    for (long id = from; step > 0 ? id <= (long) to : id >= (long) to; id += step) {
+        ids.push_back((unsigned) id);
+    }
+    return ids;
+}
+
+// Queries by tag, function and level, id, time, and the newest records only,
+// in either order
+void cursor_query_test() {
+    static const unsigned RECORDS = 999;
+    Log::Options options;
+    options.filename = "/tmp/memlogTest.txt";
+    options.enableCollect = false;
+    Log log(options);
+
+    for (unsigned i = 0; i < RECORDS; i++) {
+        switch (i % 3) {
+            case 0:
+                log.traceVargs(true, "cursor_alpha", 1, 'W', "cursor %u\n", i);
+                break;
+            case 1:
+                log.traceVargs(true, "cursor_beta", 2, 'I', "cursor %u\n", i);
+                break;
+            default:
+                log.traceVargs(true, "cursor_beta", 3, 'E', "cursor %u\n", i);
+                break;
+        }
+    }
+
+    Log::Cursor::Query query;
+    query.order = Log::Cursor::OLDEST_FIRST;
+    query.tag = 'W';
+    expect("cursor tag", "1", to_string(queryIds(log, query) == idSequence(0, RECORDS - 3, 3)));
+
+    query = Log::Cursor::Query();
+    query.functionName = "cursor_beta";
+    query.level = Log::warn;
+    expect("cursor level", "1", to_string(queryIds(log, query) == idSequence(RECORDS - 1, 2, -3)));
+
+    query = Log::Cursor::Query();
+    query.fromId = 100;
+    query.toId = 199;
+    expect("cursor ids", "1", to_string(queryIds(log, query) == idSequence(199, 100, -1)));
+
+    query = Log::Cursor::Query();
+    query.last = 5;
+    expect("cursor last", "1", to_string(queryIds(log, query) == idSequence(RECORDS - 1, RECORDS - 5, -1)));
+    query.order = Log::Cursor::OLDEST_FIRST;
+    expect("cursor last", "1", to_string(queryIds(log, query) == idSequence(RECORDS - 5, RECORDS - 1, 1)));
+
+    // Records stamped the same nanosecond as the ends are in range too
+    vector<uint64_t> nsecs;
+    query = Log::Cursor::Query();
+    query.order = Log::Cursor::OLDEST_FIRST;
+    queryIds(log, query, &nsecs);
+    query.fromNsec = nsecs[500];
+    query.toNsec = nsecs[509];
+    vector<unsigned> ids = queryIds(log, query);
+    if (ids.empty() || ids.front() > 500 || ids.back() < 509 || ids.size() > 20) {
+        cout << "FAIL cursor time: " << ids.size() << " records" << endl;
+        failures++;
+    }
+    unlink(options.filename);
+}
+
+// A snapshot taken while threads log holds each thread's records up to a
+// point without a gap, and stays the same while they go on
+void snapshot_test() {
+    static const int THREADS = 3;
+    static const int RECORDS = 50000;
+    Log::Options options;
+    options.filename = "/tmp/memlogTest.txt";
+    options.enableCollect = false;
+    options.size = 8 * 1024 * 1024;
+    options.prefix = "";
+    Log log(options);
+
+    bool stop = false;
+    vector<thread> threads;
+    for (int t = 0; t < THREADS; t++) {
+        threads.emplace_back([&log, &stop, t] {
+            for (int i = 0; i < RECORDS && !__atomic_load_n(&stop, __ATOMIC_RELAXED); i++) {
+                log.traceVargs(true, nullptr, 0, 'I', "snapshot %d %d\n", t, i);
+                if (i % 64 == 0) {
+                    this_thread::yield();
+                }
+            }
+        });
+    }
+    usleep(20000);
+    Log::Snapshot snapshot(&log);
+    string texts[2];
+    for (auto &text : texts) {
+        FILE *file = fopen("/tmp/memlogTest.dump", "w");
+        snapshot.write(Stream::create(file));
+        fclose(file);
+        text = readFile("/tmp/memlogTest.dump");
+        usleep(5000);
+    }
+    __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    vector<int> next(THREADS, 0);
+    size_t count = 0;
+    for (auto &line : readLines("/tmp/memlogTest.dump")) {
+        int t, i;
+        if (sscanf(line.c_str(), "snapshot %d %d", &t, &i) != 2 || t < 0 || t >= THREADS || i != next[t]) {
+            expect("snapshot line", "", line);
+            break;
+        }
+        next[t] = i + 1;
+        count++;
+    }
+    expect("snapshot stable", "1", to_string(texts[0] == texts[1]));
+    if (!count) {
+        cout << "FAIL snapshot: empty" << endl;
+        failures++;
+    }
+
+    Log::Cursor::Query query;
+    expect("snapshot cursor", to_string(count), to_string(queryIds(*snapshot.log(), query).size()));
+    unlink(options.filename);
+    unlink("/tmp/memlogTest.dump");
+}
+
+// Logs sharing the threads of a collector pool each get all of their
+// records written, in order
+void collector_pool_test() {
+    static const int LOGS = 5;
+    static const int RECORDS = 3000;
+    auto pool = make_shared<Log::CollectorPool>(2);
+    string filenames[LOGS];
+    {
+        vector<unique_ptr<Log>> logs;
+        for (int l = 0; l < LOGS; l++) {
+            Log::Options options;
+            filenames[l] = "/tmp/memlogTest." + to_string(l) + ".txt";
+            options.filename = filenames[l].c_str();
+            options.size = 64 * 1024;
+            options.overrun = Log::OVERRUN_LOSSLESS;
+            options.prefix = "";
+            options.collectorPool = pool;
+            options.collectorPriority = l % 2 + 1;
+            logs.emplace_back(new Log(options));
+        }
+
+        vector<thread> threads;
+        for (int l = 0; l < LOGS; l++) {
+            threads.emplace_back([&logs, l] {
+                for (int i = 0; i < RECORDS; i++) {
+                    logs[l]->traceVargs(true, nullptr, 0, 'I', "pool %d %d %s\n", l, i, "abcdefghijklmnopqrstuvwxyz");
+                }
+            });
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+    }
+
+    for (int l = 0; l < LOGS; l++) {
+        int next = 0;
+        for (auto &line : readLines(filenames[l].c_str())) {
+            int log, i;
+            if (sscanf(line.c_str(), "pool %d %d", &log, &i) != 2 || log != l || i != next) {
+                expect("collector pool line", "", line);
+                break;
+            }
+            next++;
+        }
+        expect("collector pool records", to_string(RECORDS), to_string(next));
+        unlink(filenames[l].c_str());
+    }
+}
+
 int main() {
     auto log = std::make_shared<Log>();
     log->info("Hello world %d!\n", 1000L);
     log->info("Hello world %d!\n", 1001L);
     log->info("Hello world %d!\n", 1002L);
+    log->log<Log::info>(FMT("Hello world %d %s %.2f!\n"), 1003, "static", 1.5);
     log->dump();
     //performance_test1(log);
+
+    number_format_test();
+    prefix_format_test();
+    shard_merge_test();
+    tsc_clock_test();
+    commit_visibility_test();
+    ring_wrap_test();
+    ring_allocation_test();
+    ring_file_recover_test();
+    binary_decode_test();
+    segment_seek_test();
+    gzip_stream_test();
+    uring_stream_test();
+    collector_wakeup_test();
+    format_pool_test();
+    overrun_policy_test();
+    rotation_retention_test();
+    static_string_test();
+    cursor_query_test();
+    snapshot_test();
+    collector_pool_test();
+
+    cout << (failures ? "FAILED " : "passed ") << failures << endl;
+    return failures ? 1 : 0;
 }
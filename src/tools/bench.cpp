@@ -0,0 +1,263 @@
+/* Copyright 2019 memlog Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+//
+// Latency of each traceVargs call, against snprintf and fprintf on the same
+// formats, as CSV
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include "log.h"
+
+using namespace std;
+using namespace memlog;
+
+static const char SHORT_STRING[] = "session";
+static const char MEDIUM_STRING[] = "GET /api/v1/accounts/42/transactions?from=2019-03-04&limit=100";
+static const string LONG_STRING(512, 'x');
+
+// One format, called the same way through each method
+struct Workload {
+    const char *name;
+    void (*memlog)(Log *log, int i);
+    void (*snprintf)(char *buffer, int i);
+    void (*fprintf)(FILE *file, int i);
+};
+
+#define WORKLOAD(name, format, ...) \
+    { name, \
+      [](Log *log, int i) { log->traceVargs(true, __func__, __LINE__, 'I', format, __VA_ARGS__); }, \
+      [](char *buffer, int i) { snprintf(buffer, LOG_MAX_LOG_TRACE_LINE, format, __VA_ARGS__); }, \
+      [](FILE *file, int i) { fprintf(file, format, __VA_ARGS__); } }
+
+static const Workload WORKLOADS[] = {
+    WORKLOAD("int", "Hello world %d!\n", i),
+    WORKLOAD("ints", "request %d status %d bytes %u elapsed %ld\n", i, i & 0xff, i * 7u, (long) i * 1000),
+    WORKLOAD("double", "temperature %f ratio %.3f\n", i * 0.5, i / 3.0),
+    WORKLOAD("short-string", "user %s op %d\n", SHORT_STRING, i),
+    WORKLOAD("medium-string", "%s took %d us\n", MEDIUM_STRING, i),
+    WORKLOAD("long-string", "payload %s %d\n", LONG_STRING.c_str(), i),
+    WORKLOAD("mixed", "id %d %s value %.2f mask %lx\n", i, SHORT_STRING, i * 0.25, (unsigned long) i << 4),
+};
+
+enum Method {
+    METHOD_MEMLOG,
+    METHOD_SNPRINTF,
+    METHOD_FPRINTF,
+};
+
+static const char *METHOD_NAMES[] = { "memlog", "snprintf", "fprintf" };
+
+struct Run {
+    Method method;
+    const Workload *workload;
+    uint32_t threads;
+    uint32_t ringSize;
+    bool collect;
+};
+
+#ifdef __OPTIMIZE__
+static const char BUILD[] = "optimized";
+#else
+static const char BUILD[] = "unoptimized";
+#endif
+
+static uint32_t callsPerThread = 200000;
+static const char *filename = "/tmp/memlogBench.txt";
+static uint64_t timerNsec;
+
+// Cost of reading the clock twice, taken off each sample
+static uint64_t measureTimer() {
+    vector<uint64_t> samples(100000);
+
+    for (auto &sample : samples) {
+        uint64_t start = Clock::monotonicNsec();
+        sample = Clock::monotonicNsec() - start;
+    }
+    nth_element(samples.begin(), samples.begin() + samples.size() / 2, samples.end());
+    return samples[samples.size() / 2];
+}
+
+static void producer(const Run &run, Log *log, FILE *file, atomic<uint32_t> *ready, uint64_t *samples) {
+    char buffer[LOG_MAX_LOG_TRACE_LINE];
+    uint32_t warmup = callsPerThread / 10;
+
+    ready->fetch_sub(1);
+    while (ready->load()) {
+    }
+
+    for (uint32_t i = 0; i < warmup + callsPerThread; i++) {
+        uint64_t start = Clock::monotonicNsec();
+        switch (run.method) {
+            case METHOD_MEMLOG:
+                run.workload->memlog(log, i);
+                break;
+            case METHOD_SNPRINTF:
+                run.workload->snprintf(buffer, i);
+                break;
+            case METHOD_FPRINTF:
+                run.workload->fprintf(file, i);
+                break;
+        }
+        uint64_t elapsed = Clock::monotonicNsec() - start;
+
+        if (i >= warmup) {
+            samples[i - warmup] = elapsed > timerNsec ? elapsed - timerNsec : 0;
+        }
+    }
+}
+
+static uint64_t percentile(vector<uint64_t> &samples, double fraction) {
+    size_t rank = std::min(samples.size() - 1, (size_t) (fraction * samples.size()));
+
+    nth_element(samples.begin(), samples.begin() + rank, samples.end());
+    return samples[rank];
+}
+
+static void measure(const Run &run) {
+    unique_ptr<Log> log;
+    FILE *file = nullptr;
+
+    if (run.method == METHOD_MEMLOG) {
+        Log::Options options;
+        options.filename = filename;
+        options.size = run.ringSize;
+        options.enableCollect = run.collect;
+        log.reset(new Log(options));
+    } else if (run.method == METHOD_FPRINTF) {
+        file = fopen("/dev/null", "w");
+    }
+
+    vector<uint64_t> samples((size_t) run.threads * callsPerThread);
+    vector<thread> threads;
+    atomic<uint32_t> ready(run.threads);
+
+    uint64_t start = Clock::monotonicNsec();
+    for (uint32_t t = 0; t < run.threads; t++) {
+        threads.emplace_back(producer, cref(run), log.get(), file, &ready, &samples[(size_t) t * callsPerThread]);
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    double sec = (double) (Clock::monotonicNsec() - start) / Clock::NSEC_PER_SEC;
+
+    log.reset();
+    unlink(filename);
+    if (file) {
+        fclose(file);
+    }
+
+    uint64_t sum = 0;
+    for (uint64_t sample : samples) {
+        sum += sample;
+    }
+    uint64_t p50 = percentile(samples, 0.50);
+    uint64_t p99 = percentile(samples, 0.99);
+    uint64_t p999 = percentile(samples, 0.999);
+    uint64_t max = *max_element(samples.begin(), samples.end());
+
+    printf("%s,%s,%u,%u,%d,%zu,%.1f,%lu,%lu,%lu,%lu,%.0f\n", METHOD_NAMES[run.method], run.workload->name,
+           run.threads, run.method == METHOD_MEMLOG ? run.ringSize : 0, run.method == METHOD_MEMLOG && run.collect,
+           samples.size(), (double) sum / samples.size(), (unsigned long) p50, (unsigned long) p99,
+           (unsigned long) p999, (unsigned long) max, samples.size() / sec);
+    fflush(stdout);
+}
+
+static vector<uint32_t> parseList(const char *text) {
+    vector<uint32_t> values;
+    char *end;
+
+    while (*text) {
+        values.push_back(strtoul(text, &end, 0));
+        text = *end == ',' ? end + 1 : end;
+        if (end == text && *text) {
+            return {};
+        }
+    }
+    return values;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [--calls N] [--threads N,N] [--sizes BYTES,BYTES] [--workload NAME] [--file PATH]\n"
+            "NAME is int, ints, double, short-string, medium-string, long-string or mixed.\n"
+            "Times each call of traceVargs, snprintf and fprintf to /dev/null on the same formats,\n"
+            "traceVargs for each ring size with the collector off and on. One CSV line per run:\n"
+            "method,workload,threads,ring,collector,calls,mean_ns,p50_ns,p99_ns,p999_ns,max_ns,calls_per_sec\n"
+            "Build with -DCMAKE_BUILD_TYPE=Release for numbers worth comparing.\n",
+            name);
+}
+
+int main(int argc, char **argv) {
+    vector<uint32_t> threadCounts = { 1, 2, 4 };
+    vector<uint32_t> ringSizes = { 64 * 1024, 1024 * 1024, Log::DEFAULT_BUFFER_SIZE };
+    const char *only = nullptr;
+
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+
+        if (!strcmp(argv[i], "--calls") && hasValue) {
+            callsPerThread = strtoul(argv[++i], nullptr, 0);
+        } else if (!strcmp(argv[i], "--threads") && hasValue) {
+            threadCounts = parseList(argv[++i]);
+        } else if (!strcmp(argv[i], "--sizes") && hasValue) {
+            ringSizes = parseList(argv[++i]);
+        } else if (!strcmp(argv[i], "--workload") && hasValue) {
+            only = argv[++i];
+        } else if (!strcmp(argv[i], "--file") && hasValue) {
+            filename = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    bool known = !only;
+    for (const Workload &workload : WORKLOADS) {
+        known = known || !strcmp(only, workload.name);
+    }
+    if (!callsPerThread || threadCounts.empty() || ringSizes.empty() || !known) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    timerNsec = measureTimer();
+    printf("# %s build, cpus %ld, calls per thread %u, timer overhead %lu ns subtracted\n",
+           BUILD, sysconf(_SC_NPROCESSORS_ONLN), callsPerThread, (unsigned long) timerNsec);
+    printf("method,workload,threads,ring,collector,calls,mean_ns,p50_ns,p99_ns,p999_ns,max_ns,calls_per_sec\n");
+
+    for (const Workload &workload : WORKLOADS) {
+        if (only && strcmp(only, workload.name)) {
+            continue;
+        }
+        for (uint32_t threads : threadCounts) {
+            measure(Run{ METHOD_SNPRINTF, &workload, threads, 0, false });
+            measure(Run{ METHOD_FPRINTF, &workload, threads, 0, false });
+            for (uint32_t size : ringSizes) {
+                for (bool collect : { false, true }) {
+                    measure(Run{ METHOD_MEMLOG, &workload, threads, size, collect });
+                }
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,140 @@
+/* Copyright 2019 memlog Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+//
+// Render a trace file written in binary mode as text
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <sys/stat.h>
+#include "log.h"
+
+using namespace memlog;
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [--segments] [--from TIME] [--to TIME] [--from-id ID] [--to-id ID] [--site ID] [file]\n"
+            "TIME is nanoseconds since the epoch, \"YYYY-MM-DD HH:MM:SS[.frac]\", or \"HH:MM:SS[.frac]\"\n"
+            "on the day the file was last written. Without options the whole file is decoded, from\n"
+            "stdin if no file is given.\n", name);
+}
+
+// Local time, as printed in the records. The end of a range without a
+// fraction takes in the whole second.
+static bool parseTime(const char *text, time_t day, bool rangeEnd, uint64_t *nsec) {
+    struct tm tm;
+    const char *rest;
+    char *end;
+
+    localtime_r(&day, &tm);
+    rest = strptime(text, "%Y-%m-%d %H:%M:%S", &tm);
+    if (rest == nullptr) {
+        // A failed match may leave fields set
+        localtime_r(&day, &tm);
+        rest = strptime(text, "%H:%M:%S", &tm);
+    }
+    if (rest == nullptr) {
+        *nsec = strtoull(text, &end, 10);
+        return *end == 0 && end != text;
+    }
+
+    tm.tm_isdst = -1;
+    *nsec = (uint64_t) mktime(&tm) * Clock::NSEC_PER_SEC;
+    if (*rest == '.') {
+        uint64_t scale = Clock::NSEC_PER_SEC;
+        for (rest++; *rest >= '0' && *rest <= '9'; rest++) {
+            scale /= 10;
+            *nsec += (*rest - '0') * scale;
+        }
+    } else if (rangeEnd) {
+        *nsec += Clock::NSEC_PER_SEC - 1;
+    }
+    return *rest == 0;
+}
+
+int main(int argc, char **argv) {
+    const char *from = nullptr;
+    const char *to = nullptr;
+    const char *filename = nullptr;
+    bool segments = false;
+    bool ranged = false;
+    Log::Range range;
+
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+
+        if (!strcmp(argv[i], "--segments")) {
+            segments = true;
+        } else if (!strcmp(argv[i], "--from") && hasValue) {
+            from = argv[++i];
+        } else if (!strcmp(argv[i], "--to") && hasValue) {
+            to = argv[++i];
+        } else if (!strcmp(argv[i], "--from-id") && hasValue) {
+            range.fromId = strtoul(argv[++i], nullptr, 0);
+            ranged = true;
+        } else if (!strcmp(argv[i], "--to-id") && hasValue) {
+            range.toId = strtoul(argv[++i], nullptr, 0);
+            ranged = true;
+        } else if (!strcmp(argv[i], "--site") && hasValue) {
+            range.site = strtoul(argv[++i], nullptr, 0);
+            ranged = true;
+        } else if (argv[i][0] != '-' && !filename) {
+            filename = argv[i];
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if ((segments || ranged || from || to) && !filename) {
+        fprintf(stderr, "%s: seeking needs a file\n", argv[0]);
+        return 2;
+    }
+
+    FILE *file = filename ? fopen(filename, "rb") : stdin;
+    if (!file) {
+        perror(filename);
+        return 1;
+    }
+
+    struct stat st;
+    time_t day = filename && stat(filename, &st) == 0 ? st.st_mtime : time(nullptr);
+    if ((from && !parseTime(from, day, false, &range.fromNsec)) ||
+        (to && !parseTime(to, day, true, &range.toNsec))) {
+        fprintf(stderr, "%s: invalid time\n", argv[0]);
+        return 2;
+    }
+
+    bool valid;
+    if (segments) {
+        valid = Log::listSegments(file);
+    } else if (ranged || from || to) {
+        valid = Log::decode(file, range);
+    } else {
+        valid = Log::decode(file);
+    }
+    if (file != stdin) {
+        fclose(file);
+    }
+
+    if (!valid) {
+        fprintf(stderr, "%s: not a binary trace file or truncated\n", filename ? filename : "stdin");
+        return 1;
+    }
+    return 0;
+}
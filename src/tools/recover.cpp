@@ -0,0 +1,36 @@
+/* Copyright 2019 memlog Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+//
+// Print the logs a crashed process left in its ring file
+//
+
+#include <cstdio>
+#include "log.h"
+
+using namespace memlog;
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <ring file>\n", argv[0]);
+        return 2;
+    }
+
+    if (!Log::recover(argv[1])) {
+        fprintf(stderr, "%s: no valid ring file\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}